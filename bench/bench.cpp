@@ -0,0 +1,124 @@
+#include <benchmark/benchmark.h>
+#include <tsh.h>
+#include <stats.h>
+#include <string>
+
+using namespace std;
+
+/**
+ * Microbenchmarks for the shell's hot paths. Run through `make bench`, which
+ * writes google-benchmark JSON for comparing versions; every benchmark also
+ * reports heap allocations per iteration.
+ */
+
+/**
+ * @brief Reports operator new calls per iteration since start_allocs.
+ */
+static void report_allocs(benchmark::State &state, uint64_t start_allocs) {
+  state.counters["allocs"] = benchmark::Counter(
+      stats.allocs - start_allocs, benchmark::Counter::kAvgIterations);
+}
+
+/**
+ * @brief A command line of n tokens, or of n pipeline stages when piped.
+ */
+static string make_line(int n, bool piped) {
+  string line;
+  for (int k = 0; k < n; k++) {
+    if (k) line += piped ? " | " : " ";
+    line += piped ? "cat" : "tok" + to_string(k % 100);
+  }
+  return line + "\n";
+}
+
+// read_input over an in-memory stdin of state.range(0)-byte lines
+static void BM_ReadInput(benchmark::State &state) {
+  string line(state.range(0) - 1, 'x');
+  line += '\n';
+  string data;
+  while (data.size() < (1u << 20)) data += line;
+
+  FILE *saved = stdin;
+  FILE *in = fmemopen(&data[0], data.size(), "r");
+  stdin = in;
+  uint64_t allocs = stats.allocs;
+  for (auto _ : state) {
+    char *got = read_input();
+    if (!got) {
+      rewind(in);
+      got = read_input();
+    }
+    benchmark::DoNotOptimize(got);
+    free(got);
+  }
+  report_allocs(state, allocs);
+  stdin = saved;
+  fclose(in);
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ReadInput)->Arg(8)->Arg(80)->Arg(4096)->Arg(1 << 16);
+
+// parse_input of a line of state.range(0) tokens
+static void BM_ParseTokens(benchmark::State &state) {
+  string line = make_line(state.range(0), false);
+  CommandLine cmdline;
+  uint64_t allocs = stats.allocs;
+  for (auto _ : state) {
+    char *input_line = strdup(line.c_str());
+    parse_input(input_line, cmdline);
+    benchmark::DoNotOptimize(&cmdline.front());
+    cleanup(cmdline, input_line);
+  }
+  report_allocs(state, allocs);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ParseTokens)->RangeMultiplier(10)->Range(1, 10000);
+
+// parse_input of a pipeline state.range(0) stages deep
+static void BM_ParsePipeDepth(benchmark::State &state) {
+  string line = make_line(state.range(0), true);
+  CommandLine cmdline;
+  uint64_t allocs = stats.allocs;
+  for (auto _ : state) {
+    char *input_line = strdup(line.c_str());
+    parse_input(input_line, cmdline);
+    benchmark::DoNotOptimize(&cmdline.back());
+    cleanup(cmdline, input_line);
+  }
+  report_allocs(state, allocs);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ParsePipeDepth)->RangeMultiplier(10)->Range(1, 1000);
+
+// Process::add_token filling a stage to MAX_ARGS words
+static void BM_AddToken(benchmark::State &state) {
+  char word[] = "token";
+  for (auto _ : state) {
+    Process p(0, 0);
+    for (int k = 0; k < MAX_ARGS; k++) p.add_token(word);
+    benchmark::DoNotOptimize(p.cmdTokens);
+  }
+  state.SetItemsProcessed(state.iterations() * MAX_ARGS);
+}
+BENCHMARK(BM_AddToken);
+
+// end-to-end parse_input + run_commands of a whole line
+static void BM_RunCommands(benchmark::State &state, const char *line) {
+  CommandLine cmdline;
+  ExecContext ctx;
+  ctx.out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  uint64_t allocs = stats.allocs;
+  for (auto _ : state) {
+    char *input_line = strdup(line);
+    parse_input(input_line, cmdline);
+    run_commands(cmdline, &ctx);
+    cleanup(cmdline, input_line);
+  }
+  report_allocs(state, allocs);
+  close(ctx.out_fd);
+}
+BENCHMARK_CAPTURE(BM_RunCommands, true, "true")->UseRealTime();
+BENCHMARK_CAPTURE(BM_RunCommands, true_pipe, "true | true")->UseRealTime();
+BENCHMARK_CAPTURE(BM_RunCommands, yes_head, "yes | head -1000")->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,225 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Head-to-head driver: feeds the same generated scripts to tsh and to the
+ * locally installed dash and bash, and compares wall time, CPU, max RSS,
+ * read/write syscalls and context switches.
+ *
+ *   tsh_compare [--tsh PATH] [--shells tsh,dash,bash] [--runs N]
+ *
+ * Every script is given on stdin, which is how tsh reads commands, with
+ * output sent to /dev/null. tsh has no loops, so loops are unrolled; the
+ * text is plain "a | b" and "a; b" syntax that all three shells run alike.
+ * The scripts are written out before anything runs, so the driver's own
+ * memory does not leak into the children's max RSS.
+ */
+
+struct Workload {
+  const char *name;
+  string script;
+};
+
+struct Sample {
+  double wall_ms;
+  double cpu_ms;   // user + system, shell plus every child it waited for
+  long maxrss_kb;  // largest of the shell and its children
+  long syscalls;   // read and write syscalls, from /proc/PID/io
+  long ctxsw;      // voluntary + involuntary context switches
+};
+
+/**
+ * @brief Builds the corpus. Each workload stresses one part of the shell.
+ */
+static vector<Workload> make_corpus() {
+  vector<Workload> corpus;
+  ostringstream s;
+
+  // spawn-heavy: one short-lived process per line; a path, since dash and
+  // bash would otherwise run their true builtin
+  for (int k = 0; k < 1000; k++) s << "/bin/true\n";
+  corpus.push_back({"spawn-loop", s.str()});
+
+  // long pipelines: 20 stages a line
+  s.str("");
+  for (int k = 0; k < 50; k++) {
+    s << "echo x";
+    for (int d = 1; d < 20; d++) s << " | cat";
+    s << "\n";
+  }
+  corpus.push_back({"long-pipeline", s.str()});
+
+  // huge argv: 24 words (tsh's MAX_ARGS) of 4 KiB each per exec
+  s.str("");
+  string word(4096, 'a');
+  for (int k = 0; k < 200; k++) {
+    s << "/bin/echo";
+    for (int w = 1; w < 24; w++) s << " " << word;
+    s << "\n";
+  }
+  corpus.push_back({"huge-argv", s.str()});
+
+  // builtin-only: nothing is forked
+  s.str("");
+  for (int k = 0; k < 20000; k++) s << ":\n";
+  corpus.push_back({"builtin-loop", s.str()});
+
+  return corpus;
+}
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * @brief Sum of syscr and syscw for a (zombie) process.
+ */
+static long proc_syscalls(pid_t pid) {
+  ifstream io("/proc/" + to_string(pid) + "/io");
+  string key;
+  long value, total = 0;
+  while (io >> key >> value) {
+    if (key == "syscr:" || key == "syscw:") total += value;
+  }
+  return total;
+}
+
+/**
+ * @brief Runs shell once with script_path on stdin.
+ *
+ * @return false if the shell could not be run or failed.
+ */
+static bool run_once(const string &shell, const string &script_path,
+                     Sample &out) {
+  double start = now_ms();
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    int in = open(script_path.c_str(), O_RDONLY);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(in, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execlp(shell.c_str(), shell.c_str(), (char *) NULL);
+    _exit(127);
+  }
+
+  // let it exit but keep the zombie around long enough to read /proc
+  siginfo_t info;
+  waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+  out.wall_ms = now_ms() - start;
+  out.syscalls = proc_syscalls(pid);
+
+  int status;
+  struct rusage ru;
+  wait4(pid, &status, 0, &ru);
+  out.cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 +
+               (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+  out.maxrss_kb = ru.ru_maxrss;
+  out.ctxsw = ru.ru_nvcsw + ru.ru_nivcsw;
+  return WIFEXITED(status) && WEXITSTATUS(status) != 127;
+}
+
+/**
+ * @brief Median-by-wall-time of runs samples.
+ */
+static bool measure(const string &shell, const string &script_path, int runs,
+                    Sample &out) {
+  vector<Sample> samples(runs);
+  for (Sample &s : samples) {
+    if (!run_once(shell, script_path, s)) return false;
+  }
+  sort(samples.begin(), samples.end(),
+       [](const Sample &a, const Sample &b) { return a.wall_ms < b.wall_ms; });
+  out = samples[runs / 2];
+  return true;
+}
+
+int main(int argc, char **argv) {
+  static struct option opts[] = {
+      {"tsh", required_argument, NULL, 't'},
+      {"shells", required_argument, NULL, 's'},
+      {"runs", required_argument, NULL, 'r'},
+      {NULL, 0, NULL, 0},
+  };
+  string tsh = "./tsh_app";
+  string shell_list = "tsh,dash,bash";
+  int runs = 3;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    switch (opt) {
+      case 't': tsh = optarg; break;
+      case 's': shell_list = optarg; break;
+      case 'r': runs = max(1, atoi(optarg)); break;
+      default:
+        fprintf(stderr,
+                "usage: tsh_compare [--tsh PATH] [--shells LIST] [--runs N]\n");
+        return EXIT_FAILURE;
+    }
+  }
+  if (tsh.find('/') == string::npos) tsh = "./" + tsh;
+
+  vector<string> shells;
+  stringstream list(shell_list);
+  for (string name; getline(list, name, ',');) shells.push_back(name);
+
+  char dir[] = "/tmp/tsh_compare.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  vector<string> names;
+  {
+    vector<Workload> corpus = make_corpus();
+    for (const Workload &w : corpus) {
+      names.push_back(w.name);
+      ofstream(string(dir) + "/" + w.name + ".sh") << w.script;
+    }
+  }
+  malloc_trim(0);
+
+  printf("%-14s %-6s %10s %10s %10s %10s %8s %8s\n", "workload", "shell",
+         "wall ms", "cpu ms", "maxrss KB", "r/w calls", "ctxsw", "vs tsh");
+  for (const string &workload : names) {
+    string path = string(dir) + "/" + workload + ".sh";
+    const char *wname = workload.c_str();
+
+    double tsh_wall = 0;
+    for (const string &name : shells) {
+      Sample s;
+      if (!measure(name == "tsh" ? tsh : name, path, runs, s)) {
+        printf("%-14s %-6s %10s\n", wname, name.c_str(), "n/a");
+        continue;
+      }
+      if (name == "tsh") tsh_wall = s.wall_ms;
+      char ratio[16] = "";
+      if (tsh_wall > 0) snprintf(ratio, sizeof(ratio), "%.2fx", s.wall_ms / tsh_wall);
+      printf("%-14s %-6s %10.1f %10.1f %10ld %10ld %8ld %8s\n", wname,
+             name.c_str(), s.wall_ms, s.cpu_ms, s.maxrss_kb, s.syscalls,
+             s.ctxsw, ratio);
+    }
+    unlink(path.c_str());
+  }
+  rmdir(dir);
+  return 0;
+}
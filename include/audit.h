@@ -0,0 +1,35 @@
+#ifndef _TSH_AUDIT_H
+#define _TSH_AUDIT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+
+/**
+ * Audit log of executed commands (--audit FILE), one JSON object per line:
+ *
+ *   {"ts":<unix ns at start>,"pid":N,"status":N,"dur_ns":N,
+ *    "hash":"<fnv-1a of argv>","argv":"...","truncated":true?}
+ *
+ * pid is 0 for builtins run inside the shell. Executors push fixed-size
+ * records into a bounded lock-free ring (any number of producers, one
+ * consumer) and a writer thread drains it with writev. Nothing on the
+ * executor's path blocks or allocates; when the ring is full the record is
+ * dropped and counted in stats.audit_dropped.
+ */
+#define AUDIT_RING_SIZE 4096  // records, a power of two
+#define AUDIT_ARGV_MAX 200    // bytes of argv text kept per record
+#define AUDIT_BATCH 256       // records per writev
+
+extern std::atomic<bool> audit_enabled;
+
+inline bool audit_on() {
+  return audit_enabled.load(std::memory_order_relaxed);
+}
+
+bool audit_open(const char *path);
+void audit_command(char *const *argv, pid_t pid, int status, uint64_t start_ns,
+                   uint64_t end_ns);
+void audit_close();
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef _TSH_EDITOR_H
+#define _TSH_EDITOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+class History;
+class PromptEngine;
+
+/**
+ * Interactive line editor, used when stdin and stdout are terminals.
+ *
+ * Keys are read in raw mode and edit a UTF-8 buffer (emacs bindings:
+ * C-a/C-e/C-b/C-f and the arrows move, M-b/M-f by word, C-k/C-u/C-w/M-d kill,
+ * C-y yanks, C-l clears the screen; with a History, C-p/C-n and the up and
+ * down arrows step through it and C-r searches it; Tab completes command
+ * names from the path index and filenames in the background). Nothing is
+ * drawn while keys are being handled; once the input read so far is used
+ * up, the line is rendered once
+ * by diffing it against what is on screen, and the changes go out in a
+ * single write(). The line scrolls horizontally when it is wider than the
+ * terminal, so it always occupies a single row.
+ *
+ * C-r searches incrementally: each key typed narrows the query, the line
+ * shows the best match from the history's index, C-r again steps to the
+ * next one, C-g puts back the line as it was, and any other key leaves the
+ * match to be edited (or, with Enter, run).
+ *
+ * Pastes arrive whole (bracketed paste mode): the text between the
+ * terminal's ESC [200~ and ESC [201~ is read in bulk, without handling a
+ * key or drawing anything per byte. Pasted without a newline, it is
+ * inserted at the cursor. Otherwise the line is completed with its first
+ * line and accepted, the rest is echoed in the same write, and read_line
+ * returns each further whole line in turn without touching the terminal;
+ * a last line with no newline is left to edit at the next prompt.
+ *
+ * With a PromptEngine, the prompt is repainted in place whenever one of
+ * its background segments changes. CSI sequences in the prompt (colours)
+ * take no columns.
+ *
+ * The terminal is in raw mode only inside read_line, so commands run with
+ * the settings the user had.
+ */
+class LineEditor {
+ public:
+  LineEditor(int in_fd, int out_fd);
+  ~LineEditor();
+
+  char *read_line(const char *prompt);
+  void set_history(History *h) { history = h; }
+  void set_prompt_engine(PromptEngine *p) { prompts = p; }
+  bool pasting() const { return !pasted.empty(); }
+
+ private:
+  enum Action { EDIT, ACCEPT, CANCEL, END_OF_INPUT };
+
+  bool raw_mode();
+  void cooked_mode();
+  int next_byte(bool wait = true);
+  Action handle_key(int c);
+  Action handle_escape();
+
+  void history_up();
+  void history_down();
+  void search_start();
+  Action search_key(int c);
+  void search_show();
+  void complete(bool again);
+  void extend(size_t start, const std::string &common, size_t total,
+              bool dir, const std::vector<std::string> &names, bool again);
+  void file_update();
+  Action paste();
+  void show_candidates(std::vector<std::string> names, size_t more);
+
+  void insert(const char *s, size_t n);
+  void erase(size_t from, size_t to, bool keep);
+  size_t prev_char(size_t pos) const;
+  size_t next_char(size_t pos) const;
+  size_t prev_word(size_t pos) const;
+  size_t next_word(size_t pos) const;
+
+  void render(bool full = false);
+  void flush();
+
+  int in_fd;
+  int out_fd;
+  bool tty;
+  bool raw = false;
+  struct termios saved;
+
+  char inbuf[512];
+  size_t in_pos = 0;
+  size_t in_len = 0;
+
+  std::string prompt;
+  std::string buf;    // the line being edited, UTF-8
+  size_t cursor = 0;  // byte offset into buf, on a character boundary
+  std::string yank;   // the last killed text
+
+  PromptEngine *prompts = nullptr;  // repaints the prompt when it changes
+  History *history = nullptr;
+  size_t hist_pos = 0;  // offset of the entry shown; end() for the new line
+  std::string draft;    // the new line, while an entry is shown
+
+  bool searching = false;
+  std::string query;
+  std::vector<std::string> found;  // matches for query, best first
+  size_t found_pos = 0;            // the one shown
+  std::string before;              // the line and cursor C-g goes back to
+  size_t before_cursor = 0;
+
+  bool tab_pending = false;  // the last key was a Tab that stopped short
+  uint64_t file_id = 0;      // the filename completion running, if any
+  size_t file_base = 0;      // where the name it completes starts in buf
+  bool file_listing = false; // its names are listed as they come in
+  size_t file_listed = 0;
+
+  std::deque<std::string> pasted;  // whole lines of a paste, still to return
+  std::string paste_rest;          // the line to edit after them
+  size_t paste_cursor = 0;
+
+  int cols = 80;
+  size_t scroll = 0;       // columns of prompt + buf scrolled off the left
+  std::string shown;       // what render() last put on the row
+  size_t shown_col = 0;    // where it left the cursor
+  std::string out;         // escape sequences and text for the next write
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _TSH_FILECOMPLETE_H
+#define _TSH_FILECOMPLETE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define FILE_COMPLETE_SHOWN 256  // candidates kept for listing
+
+struct FileCandidate {
+  std::string name;
+  bool dir;
+};
+
+/**
+ * What a completion has found so far: the first FILE_COMPLETE_SHOWN names
+ * in directory order, how many there are in all, and the longest prefix
+ * they share.
+ */
+struct FileMatches {
+  std::vector<FileCandidate> shown;
+  size_t total = 0;
+  std::string common;
+  bool done = false;
+};
+
+/**
+ * Filename completion off the calling thread.
+ *
+ * file_complete_start() hands a directory and a name prefix to a worker
+ * thread and returns at once. The worker reads the directory with
+ * getdents64() in batches, publishing the matches after each one and
+ * making file_complete_fd() readable, so that the line editor can poll it
+ * next to the terminal and show results as they arrive. Starting another
+ * completion or calling file_complete_cancel() abandons the current one
+ * between two batches.
+ *
+ * Whole listings are cached by (device, inode) and reused while the
+ * directory's mtime is unchanged, so completing in the same directory
+ * again costs one stat() on the worker. The least recently completed-in
+ * directory is dropped to make room.
+ */
+uint64_t file_complete_start(const std::string &dir, const std::string &prefix);
+void file_complete_cancel();
+int file_complete_fd();
+bool file_complete_poll(uint64_t id, FileMatches &out);
+void file_complete_stop();
+
+#endif
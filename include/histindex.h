@@ -0,0 +1,87 @@
+#ifndef _TSH_HISTINDEX_H
+#define _TSH_HISTINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class History;
+
+struct HistoryMatch {
+  const char *text;  // into the history mapping, until its next refresh()
+  size_t len;
+  uint32_t count;    // times it was run
+  double score;
+};
+
+/**
+ * Trigram index over the distinct entries of a History, kept in FILE.idx
+ * next to it and searched in place through an mmap.
+ *
+ * Each distinct command text gets an id in order of first appearance, with
+ * its hash, run count and the offset and sequence number of its latest run.
+ * For every trigram of lowercased text the file holds the ascending ids
+ * that contain it, so a substring query intersects the lists of its
+ * trigrams and only checks the survivors against the history itself.
+ * Entries appended since the file was written (by any session) go into an
+ * in-memory delta with the same layout, and the two are merged back into
+ * a fresh file by save().
+ *
+ * Matches rank by how often and how recently they were run.
+ */
+class HistoryIndex {
+ public:
+  HistoryIndex(History &history, const std::string &path);
+  ~HistoryIndex();
+  HistoryIndex(const HistoryIndex &) = delete;
+  HistoryIndex &operator=(const HistoryIndex &) = delete;
+
+  std::vector<HistoryMatch> search(const std::string &query, size_t limit);
+  bool save();
+
+  struct Entry {
+    uint64_t hash;
+    uint64_t offset;  // of the latest run in the history file
+    uint32_t count;
+    uint32_t seq;     // of the latest run, counting every entry in the file
+  };
+
+ private:
+  void load();
+  void unload();
+  void catch_up();
+  void add(const char *text, size_t len, uint64_t offset);
+  int64_t find(uint64_t hash, const char *text, size_t len) const;
+  Entry entry(uint32_t id) const;
+  bool same_text(uint32_t id, const char *text, size_t len) const;
+  bool postings(uint32_t key, const uint32_t *&base, size_t &nbase,
+                const std::vector<uint32_t> *&delta) const;
+
+  History &history;
+  std::string path;
+  bool loaded = false;
+  bool dirty = false;
+
+  // the file
+  const char *map = nullptr;
+  size_t map_len = 0;
+  const Entry *base_entries = nullptr;
+  uint32_t nbase = 0;
+  const struct IndexTrigram *trigrams = nullptr;
+  uint32_t ntrigrams = 0;
+  const struct IndexSlot *slots = nullptr;
+  uint32_t nslots = 0;
+  const uint32_t *base_postings = nullptr;
+
+  // what is not in the file yet
+  uint64_t indexed = 0;  // history bytes covered
+  uint32_t total_seq = 0;
+  std::unordered_map<uint32_t, Entry> updates;  // base entries run again
+  std::vector<Entry> delta;                     // ids from nbase on
+  std::unordered_multimap<uint64_t, uint32_t> delta_ids;
+  std::unordered_map<uint32_t, std::vector<uint32_t>> delta_postings;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _TSH_HISTORY_H
+#define _TSH_HISTORY_H
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <histindex.h>
+
+class Process;
+
+/**
+ * Persistent command history shared by every session on the host
+ * ($TSH_HISTORY, else ~/.tsh_history).
+ *
+ * The file is plain text, one entry per line. Entries are appended with a
+ * single O_APPEND write() each, so concurrent sessions never interleave
+ * within an entry. Reading goes through a read-only mmap of the file, and
+ * entries are addressed by byte offset rather than by index: opening costs
+ * an open(), an fstat() and an mmap() however long the file is, and
+ * stepping back through it touches only the pages that are shown. A line
+ * with no newline yet (another session mid-write) is not an entry.
+ *
+ * Offsets stay valid as the file grows. refresh() maps whatever other
+ * sessions have appended since the last call.
+ *
+ * search() goes through a HistoryIndex kept in FILE.idx, which is only
+ * mapped on the first search and brought up to date when the History is
+ * destroyed.
+ */
+class History {
+ public:
+  History() {}
+  ~History();
+  History(const History &) = delete;
+  History &operator=(const History &) = delete;
+
+  bool open(const char *path);
+  bool add(const char *line, size_t len);
+  void refresh();
+
+  size_t end() const { return complete; }
+  bool prev(size_t &pos, const char *&entry, size_t &len) const;
+  bool at(size_t pos, const char *&entry, size_t &len) const;
+  const char *data() const { return map; }
+
+  std::vector<HistoryMatch> search(const std::string &query, size_t limit);
+
+ private:
+  int fd = -1;
+  std::string path;
+  std::unique_ptr<HistoryIndex> index;  // on the first search
+  const char *map = nullptr;
+  size_t map_len = 0;
+  size_t complete = 0;  // offset just past the last newline
+};
+
+extern History *shell_history;  // the interactive session's, if any
+
+const char *history_path();
+int history_builtin(Process *p, int out_fd, int err_fd);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _TSH_INTERN_H
+#define _TSH_INTERN_H
+
+#include <stddef.h>
+
+/**
+ * String interning for words that outlive the line they came from. Only
+ * builtin names, "quit" and the profiler's stage labels are interned; typed
+ * command words are looked up with intern_find() but never added, and
+ * history entries are not interned at all. Each distinct string is stored
+ * once, in an append-only arena, and every intern() of an equal string
+ * returns the same pointer, so interned strings compare equal exactly when
+ * their pointers do. Interned strings are never freed, which is why the set
+ * is kept bounded.
+ *
+ * Thread-safe; lookups of strings already interned only take a shared lock.
+ */
+#define INTERN_CHUNK (64 << 10)  // arena block size
+
+const char *intern(const char *s);
+const char *intern(const char *s, size_t len);
+const char *intern_find(const char *s);
+
+#endif
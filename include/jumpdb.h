@@ -0,0 +1,87 @@
+#ifndef _TSH_JUMPDB_H
+#define _TSH_JUMPDB_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define JUMP_SLACK 1000     // lines past one per directory before compacting
+#define JUMP_MAX_RANK 9000  // summed counts past which every count ages
+
+class Process;
+
+struct JumpMatch {
+  std::string dir;
+  double score;
+};
+
+/**
+ * Directories entered with cd, ranked by frecency for the z builtin, and
+ * shared by every session on the host ($TSH_Z, else ~/.tsh_z).
+ *
+ * The file is plain text, one "count time dir" record per line. A visit
+ * appends "1 now dir" with a single O_APPEND write(), so recording one
+ * never takes a lock. Reading goes through a mmap of the file, and
+ * refresh() only parses what was appended since the last call, merging it
+ * into a table with one entry per directory; a query is a stat(), an
+ * fstat() and a pass over that table.
+ *
+ * Once the file holds JUMP_SLACK lines more than there are directories,
+ * the session that notices compacts it: under a non-blocking flock(), so
+ * that only one session does, it writes a line per directory to a new
+ * file and renames it into place, then copies over whatever was appended
+ * to the old one meanwhile. Other sessions see the new inode on their next
+ * refresh() and read it afresh; a visit another session appends to the old
+ * file right after that copy is lost, which a frecency ranking can afford.
+ * As in z, counts are scaled down when their sum passes JUMP_MAX_RANK, those
+ * that fall under 1 are forgotten, and so are directories that no longer
+ * exist.
+ *
+ * cd and z only run in the shell's own loop; see ExecContext::shell_state.
+ *
+ * A directory scores its count weighted by how recent its last visit was:
+ * x4 within the hour, x2 within the day, /2 within the week, /4 after that.
+ */
+class JumpDb {
+ public:
+  JumpDb() {}
+  ~JumpDb();
+  JumpDb(const JumpDb &) = delete;
+  JumpDb &operator=(const JumpDb &) = delete;
+
+  bool open(const char *path);
+  bool visit(const char *dir, time_t now);
+  void refresh();
+  bool compact();
+  std::vector<JumpMatch> match(const std::vector<std::string> &terms,
+                               time_t now);
+  size_t size() const { return dirs.size(); }
+
+ private:
+  struct Entry {
+    double count;
+    time_t last;
+  };
+
+  void reopen();
+  void unmap();
+
+  int fd = -1;
+  std::string path;
+  ino_t ino = 0;
+  const char *map = nullptr;
+  size_t map_len = 0;
+  size_t parsed = 0;  // offset just past the last line taken in
+  size_t lines = 0;   // taken in from this file
+  std::unordered_map<std::string, Entry> dirs;
+};
+
+extern JumpDb *shell_jumps;  // the interactive session's, if any
+
+const char *jump_db_path();
+int z_builtin(Process *p, int out_fd, int err_fd);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _TSH_LATENCY_H
+#define _TSH_LATENCY_H
+
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * Log-bucketed (HDR-style) latency histograms for process startup and
+ * runtime, reported by the tsh-latency builtin and, with --latency, at exit.
+ *
+ * A value lands in one of 16 linear sub-buckets of its power of two, so any
+ * reported percentile is within 1/16 of the true value, from nanoseconds up
+ * to centuries, in a fixed 8 KB per histogram. Recording is two relaxed
+ * atomic adds and a max update.
+ *
+ * Per-command histograms are kept for LATENCY_MAX_COMMANDS names, chosen by
+ * Space-Saving: a name not yet tracked takes over the slot with the fewest
+ * runs, so the busiest commands stay in the table however many others run.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define LATENCY_MAX_COMMANDS 64  // command names tracked, the busiest kept
+#define LATENCY_NAME_MAX 64      // bytes of a tracked name, with its NUL
+#define LATENCY_TOP_N 10         // command names shown in a report
+
+class LatencyHistogram {
+ public:
+  void record(uint64_t ns);
+  uint64_t count() const { return total.load(std::memory_order_relaxed); }
+  uint64_t max() const { return largest.load(std::memory_order_relaxed); }
+  uint64_t percentile(double q) const;
+  void reset();
+
+ private:
+  std::atomic<uint64_t> buckets[HIST_BUCKETS] = {};
+  std::atomic<uint64_t> total{0};
+  std::atomic<uint64_t> largest{0};
+};
+
+class Process;
+
+void latency_fork_exec(const char *cmd, uint64_t ns);
+void latency_exec_exit(const char *cmd, uint64_t ns);
+void latency_pipeline(uint64_t ns);
+void latency_print(int fd, bool json);
+void latency_report_at_exit();
+int latency_builtin(Process *p, int out_fd, int err_fd);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _LIBTSH_H
+#define _LIBTSH_H
+
+#include <chrono>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+/**
+ * Embedding API for the tsh executor.
+ *
+ * A Pipeline is built from argv vectors, so nothing is tokenized and no
+ * shell state is shared between calls; any number of threads may run their
+ * own pipelines at once.
+ *
+ *   tsh::Result r = tsh::Pipeline{{"grep", "x", "log"}, {"sort"}}.run();
+ *   if (r.ok()) use(r.out);
+ */
+namespace tsh {
+
+struct RunOptions {
+  bool capture_out = true;  // collect the last stage's stdout into Result::out
+  bool capture_err = true;  // collect every stage's stderr into Result::err
+  int in_fd = -1;           // first stage's stdin; -1 inherits the caller's
+  int out_fd = -1;          // used when capture_out is false
+  int err_fd = -1;          // used when capture_err is false
+};
+
+struct Result {
+  std::vector<int> status;  // per stage, in pipeline order; 128+N if killed
+  std::string out;
+  std::string err;
+  std::chrono::nanoseconds wall{0};
+  std::vector<std::chrono::nanoseconds> stage_wall;  // fork to reap
+
+  /**
+   * @brief The pipeline's status is its last stage's, as in the shell.
+   */
+  int exit_status() const { return status.empty() ? 1 : status.back(); }
+  bool ok() const { return exit_status() == 0; }
+};
+
+class Pipeline {
+ public:
+  Pipeline() {}
+  Pipeline(std::initializer_list<std::vector<std::string>> stages);
+
+  Pipeline &add(std::vector<std::string> argv);
+  size_t size() const { return stages.size(); }
+
+  Result run(const RunOptions &opts = RunOptions()) const;
+
+ private:
+  std::vector<std::vector<std::string>> stages;
+};
+
+}  // namespace tsh
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _TSH_PATHINDEX_H
+#define _TSH_PATHINDEX_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/**
+ * Index of the executables on $PATH, for command-name completion and for
+ * resolving command words without execvp() walking PATH on every exec.
+ *
+ * A background thread lists each PATH directory once, then watches them
+ * with inotify; a change to one directory rescans only that one, and one
+ * that does not exist yet (~/.local/bin, say) is watched and scanned within
+ * a second of being created. After each scan it builds a fresh compressed
+ * (radix) trie of every name with, per name, a bitmask of the directories
+ * that have it, and swaps it in. Lookups take a mutex the thread only holds
+ * for the swap, walk the trie without allocating, and take under a
+ * microsecond.
+ *
+ * Until the first scan is done, or once $PATH is not what it was built
+ * from, lookups find nothing and callers fall back to execvp(), and
+ * path_absent() to checking each directory on disk. The index
+ * covers at most the first PATH_INDEX_DIRS directories; with a relative
+ * entry among them it still completes names but resolves none, since the
+ * working directory moves under it.
+ *
+ * With each trie, the watcher also updates a BK-tree of the same names and
+ * the builtins, by edit distance, from which path_suggest() finds what a
+ * command that is not found was probably meant to be in well under a
+ * millisecond, comparing against a small part of the names.
+ */
+#define PATH_INDEX_DIRS 64
+
+void path_index_start(const std::vector<std::string> &also = {});
+void path_index_stop();
+bool path_resolve(const char *name, char *out, size_t size);
+size_t path_complete(const char *prefix, size_t len,
+                     std::vector<std::string> &out, size_t limit);
+bool path_absent(const char *name);
+size_t path_suggest(const char *name, std::vector<std::string> &out,
+                    size_t limit);
+
+#endif
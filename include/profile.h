@@ -0,0 +1,13 @@
+#ifndef _TSH_PROFILE_H
+#define _TSH_PROFILE_H
+
+/**
+ * Script profiler (--profile SCRIPT): runs a script like the interactive
+ * loop would, minus the prompt, and attributes wall time per source line and
+ * per command to either the shell (read, parse, spawn, builtins) or the
+ * children. tsh scripts have no functions, so commands are the unit below a
+ * line.
+ */
+int profile_script(const char *script, const char *folded_path);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef _TSH_PROMPT_H
+#define _TSH_PROMPT_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define PROMPT_DEFAULT "$ "
+#define PROMPT_WORKERS 2
+#define SEGMENT_TIMEOUT_MS 2000  // a segment's command is killed after this
+
+/**
+ * The interactive prompt, expanded from a template ($TSH_PROMPT, else
+ * PROMPT_DEFAULT) in which {name} stands for a segment:
+ *
+ *   {cwd} {user} {host} {status} (of the last line, if not 0)
+ *   {duration} (of the last line, from half a second)
+ *   {git} (branch, with '*' if there are uncommitted changes)  {kube}
+ *   {red} {green} {yellow} {blue} {magenta} {cyan} {bold} {reset}
+ *
+ * {git} and {kube} can take a while (git status in a big repository, a
+ * kubeconfig on a slow mount), so they are never computed on the caller's
+ * thread. begin(), at each new prompt, queues a refresh of each such
+ * segment for PROMPT_WORKERS threads; text() meanwhile uses the value cached
+ * for the same segment and directory, if any. When a refresh brings a
+ * different value, fd() becomes readable so that the line editor can
+ * repaint the prompt in place. A refresh whose command takes longer than
+ * SEGMENT_TIMEOUT_MS is killed and the cached value kept.
+ */
+class PromptEngine {
+ public:
+  explicit PromptEngine(const char *tmpl);
+  ~PromptEngine();
+  PromptEngine(const PromptEngine &) = delete;
+  PromptEngine &operator=(const PromptEngine &) = delete;
+
+  void finished(int status, uint64_t ns);
+  void begin();
+  std::string text();
+  int fd() const { return notify_fd; }
+  void drain();
+
+ private:
+  enum Kind { TEXT, CWD, USER, HOST, STATUS, DURATION, GIT, KUBE };
+  struct Part {
+    Kind kind;
+    std::string text;  // for TEXT
+  };
+  struct Job {
+    Kind kind;
+    std::string cwd;
+    std::string key;
+  };
+
+  static bool async(Kind k) { return k == GIT || k == KUBE; }
+  std::string key(Kind k, const std::string &cwd) const;
+  void worker();
+
+  std::vector<Part> parts;
+  int last_status = 0;
+  uint64_t last_ns = 0;
+  int notify_fd = -1;
+
+  std::mutex mtx;
+  std::condition_variable wake;
+  std::deque<Job> jobs;
+  std::unordered_map<std::string, std::string> cache;  // by key()
+  std::unordered_map<std::string, bool> pending;       // queued or running
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _TSH_REAPER_H
+#define _TSH_REAPER_H
+
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/**
+ * Subreaper support for long-lived tsh processes (--subreaper).
+ *
+ * Once enabled, orphaned descendants are re-parented to tsh instead of init
+ * and a reaper thread collects them in batches on every SIGCHLD, with
+ * wait4(-1, WNOHANG) (not waitid(P_ALL), which gives no rusage). Children
+ * the executor forked itself go through child_fork()/child_wait(), so the
+ * reaper never loses their status: if it gets to one first, the status is
+ * parked until its owner asks for it; those are counted in owned_reaped.
+ */
+struct ReaperStats {
+  uint64_t orphans_reaped;  // unknown children collected
+  uint64_t owned_reaped;    // executor children collected on the owner's behalf
+  uint64_t batches;         // reaping passes that found something
+};
+
+bool reaper_enable();
+bool reaper_enabled();
+size_t reap_orphans();
+ReaperStats reaper_stats();
+
+pid_t child_fork();
+pid_t child_wait(pid_t pid, int *raw_status, struct rusage *usage = nullptr);
+pid_t child_try_wait(pid_t pid, int *raw_status,
+                     struct rusage *usage = nullptr);
+
+#endif
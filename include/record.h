@@ -0,0 +1,37 @@
+#ifndef _TSH_RECORD_H
+#define _TSH_RECORD_H
+
+#include <stdint.h>
+
+/**
+ * Session recording (--record FILE) and replay (--replay FILE).
+ *
+ * The log starts with RECORD_MAGIC and the session's wall-clock start, then
+ * holds one record per event: a type byte followed by LEB128 varints and
+ * raw bytes.
+ *
+ *   REC_ENV_SET    len, "NAME=VALUE"
+ *   REC_ENV_UNSET  len, "NAME"
+ *   REC_LINE       ns since the previous line started (or the session),
+ *                  ns the line ran for, zigzagged exit status, len, line
+ *
+ * The environment is written in full before the first line and as deltas
+ * after that. Records are buffered by the shell and written out by a
+ * background thread, so recording never puts a write(2) on the prompt path.
+ */
+#define RECORD_MAGIC "TSHREC\0\1"
+
+enum RecordType : uint8_t {
+  REC_ENV_SET = 1,
+  REC_ENV_UNSET = 2,
+  REC_LINE = 3,
+};
+
+bool record_open(const char *path);
+bool record_on();
+void record_input(const char *line);
+void record_status(int status);
+void record_close();
+int replay_session(const char *path, bool max_speed);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef _TSH_SERVER_H
+#define _TSH_SERVER_H
+
+#include <stdint.h>
+#include <tsh.h>
+
+/**
+ * Wire protocol spoken over the --serve Unix socket.
+ *
+ * Every message starts with a FrameHeader followed by len payload bytes. A
+ * client binds its stdin, stdout and stderr to the session by attaching them
+ * (SCM_RIGHTS, in that order) to any request header; children then write
+ * straight to the client's descriptors and nothing is proxied. The binding
+ * stays in place until the next request that carries descriptors.
+ *
+ *   FRAME_LINE    client -> server   payload: one command line
+ *   FRAME_STATUS  server -> client   payload: int32_t exit status
+ *   FRAME_BATCH   client -> server   payload: BatchOptions, then count
+ *                                    command lines, each a uint32_t length
+ *                                    followed by that many bytes, and
+ *                                    nothing after the last one
+ *   FRAME_RESULT  server -> client   payload: BatchResult, then out_len bytes
+ *                                    of stdout and err_len bytes of stderr
+ *   FRAME_END     server -> client   payload: uint32_t results sent
+ *
+ * Results of a batch arrive in completion order, not submission order. They
+ * are written by the workers themselves, so a client that stops reading
+ * stalls the batch instead of growing a buffer in the daemon.
+ *
+ * The same frames can be spoken over stdin/stdout with tsh_app --batch; the
+ * session is then bound to /dev/null, stderr and stderr, since stdout
+ * carries the replies.
+ */
+enum FrameType : uint32_t {
+  FRAME_LINE = 1,
+  FRAME_STATUS = 2,
+  FRAME_BATCH = 3,
+  FRAME_RESULT = 4,
+  FRAME_END = 5,
+};
+
+struct FrameHeader {
+  uint32_t type;
+  uint32_t len;
+};
+
+/* where a batch line's stdout and stderr go */
+enum BatchCapture : uint32_t {
+  CAPTURE_SESSION = 0,  // the descriptors bound to the session
+  CAPTURE_DISCARD = 1,  // /dev/null
+  CAPTURE_OUTPUT = 2,   // collected and returned in the FRAME_RESULT
+};
+
+struct BatchOptions {
+  uint32_t concurrency;  // lines run at once; 0 means 1
+  uint32_t timeout_ms;   // per line, 0 for none; expiry kills with SIGKILL
+  uint32_t capture;      // a BatchCapture
+  uint32_t count;        // number of lines that follow
+};
+
+#define RESULT_TIMED_OUT 0x1
+
+struct BatchResult {
+  uint32_t index;  // position of the line in its batch
+  int32_t status;
+  uint64_t usec;   // wall time of the line; 64 bits, so it never wraps
+  uint32_t flags;
+  uint32_t out_len;
+  uint32_t err_len;
+};
+
+#define SERVE_MAX_FRAME (64u << 20)
+#define BATCH_MAX_CONCURRENCY 256
+
+int serve(const char *sock_path, int workers);
+int serve_stdio();
+int submit(const char *sock_path);
+void serve_stream(int in_fd, int out_fd, bool sock, ExecContext &bound);
+
+#endif
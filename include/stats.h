@@ -0,0 +1,53 @@
+#ifndef _TSH_STATS_H
+#define _TSH_STATS_H
+
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * Runtime counters for the shell's hot paths, shown by the tsh-stats builtin
+ * and optionally dumped to a file (--stats-file). Every counter is a relaxed
+ * atomic, so bumping one costs a single uncontended add.
+ *
+ * X(name, description)
+ */
+#define TSH_STATS(X)                                                   \
+  X(lines_read, "lines returned by read_input")                        \
+  X(bytes_read, "bytes returned by read_input")                        \
+  X(tokens_parsed, "tokens produced by parse_input")                   \
+  X(forks, "children forked")                                          \
+  X(execs, "successful execs")                                         \
+  X(exec_failures, "execs that failed")                                \
+  X(fork_exec_ns, "total fork-to-exec latency, ns")                    \
+  X(builtins, "builtins run inside the shell")                         \
+  X(quits, "quit commands")                                            \
+  X(children_reaped, "children waited for by the executor")            \
+  X(allocs, "heap allocations (operator new)")                         \
+  X(frees, "heap frees (operator delete)")                             \
+  X(alloc_bytes, "bytes requested from operator new")                 \
+  X(audit_records, "commands written to the audit log")                \
+  X(audit_dropped, "audit records dropped on a full ring")              \
+  X(interned_strings, "distinct words in the intern table")            \
+  X(interned_bytes, "bytes of interned words")                        \
+  X(path_scans, "PATH directories listed by the path index")          \
+  X(path_resolved, "command words resolved by the path index")
+
+struct ShellStats {
+#define TSH_STAT_FIELD(name, desc) std::atomic<uint64_t> name{0};
+  TSH_STATS(TSH_STAT_FIELD)
+#undef TSH_STAT_FIELD
+};
+
+extern ShellStats stats;
+
+inline void stat_add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+  counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+class Process;
+
+void stats_print(int fd, bool json);
+bool stats_dump_start(const char *path, unsigned interval_sec);
+int stats_builtin(Process *p, int out_fd, int err_fd);
+
+#endif
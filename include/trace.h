@@ -0,0 +1,54 @@
+#ifndef _TSH_TRACE_H
+#define _TSH_TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+
+/**
+ * Execution tracing in Chrome/Perfetto trace-event format (--trace FILE or
+ * the trace builtin).
+ *
+ * Each thread records complete ("X") events into its own fixed-size ring, so
+ * recording is a clock read and a few stores with no lock or allocation; a
+ * full ring overwrites its oldest events. A thread's ring is handed to the
+ * next new thread when it exits, so there are only as many rings as threads
+ * ever alive at once. All rings are written out as JSON when the shell exits.
+ */
+#define TRACE_RING_SIZE 16384  // events per thread, a power of two
+
+class Process;
+
+extern std::atomic<bool> trace_enabled;
+
+inline bool trace_on() {
+  return trace_enabled.load(std::memory_order_relaxed);
+}
+
+uint64_t trace_now();
+void trace_event(const char *name, uint64_t start_ns, uint64_t end_ns,
+                 const char *detail = nullptr, pid_t track = 0);
+bool trace_open(const char *path);
+void trace_set(bool on);
+void trace_flush();
+int trace_builtin(Process *p, int out_fd, int err_fd);
+
+/**
+ * @brief Records a span from construction to destruction when tracing is on.
+ * name must outlive the trace (a string literal).
+ */
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char *name, const char *detail = nullptr)
+      : name(name), detail(detail), start(trace_on() ? trace_now() : 0) {}
+  ~TraceSpan() {
+    if (start && trace_on()) trace_event(name, start, trace_now(), detail);
+  }
+
+ private:
+  const char *name;
+  const char *detail;
+  uint64_t start;
+};
+
+#endif
@@ -1,17 +1,20 @@
 #ifndef _SIMPLE_SHELL_H
 #define _SIMPLE_SHELL_H
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <chrono>
 #include <iostream>
 #include <list>
 #include <vector>
 #include <map>
 #include <map>
+#include <string>
 #include <functional>
 #include <list>
 #include <cstring>
@@ -26,6 +29,7 @@
 using namespace std;
 
 #define MAX_LINE 81
+#define MAX_ARGS 24
 
 class Process {
  public:
@@ -33,7 +37,7 @@ class Process {
   ~Process();
 
   void add_token(char *tok);
-  char *cmdTokens[25];
+  char *cmdTokens[MAX_ARGS + 1];
 
   bool pipe_in;
   bool pipe_out;
@@ -42,12 +46,98 @@ class Process {
   int i;
 };
 
+/**
+ * @brief A parsed command line: every stage of every pipeline on it, in
+ * order, in one contiguous array, with the executor's per-stage bookkeeping
+ * alongside in flat arrays of the same length. Stages are reused from line
+ * to line, so keeping a CommandLine around avoids reallocating it for every
+ * command, and a pipeline is only as long as memory allows.
+ */
+#define CMDLINE_KEEP_STAGES 64  // stages' worth of memory kept across lines
+
+class CommandLine {
+ public:
+  Process &add(bool pipe_in, bool pipe_out);
+  void clear();
+  size_t size() const { return stages.size(); }
+  bool empty() const { return stages.empty(); }
+  Process &operator[](size_t k) { return stages[k]; }
+  Process &front() { return stages.front(); }
+  Process &back() { return stages.back(); }
+  Process *begin() { return stages.data(); }
+  Process *end() { return stages.data() + stages.size(); }
+
+ private:
+  friend bool run_commands(CommandLine &line, struct ExecContext *ctx);
+
+  vector<Process> stages;
+  // filled in by run_commands, indexed like stages
+  vector<pid_t> pids;
+  vector<uint64_t> spawn_ns;
+  vector<uint64_t> exec_ns;
+  vector<int> raw_status;
+  vector<char> reaped;
+};
+
+/**
+ * @brief What became of one stage, recorded when ExecContext::stages is set.
+ * start is just before fork, exec when the exec was seen to succeed (start if
+ * it never did), and end when the stage was reaped, which for an early
+ * pipeline stage can be later than when it actually exited. cpu is the
+ * stage's user + system time, its own waited-for children included.
+ */
+struct StageResult {
+  pid_t pid;
+  int status;
+  chrono::steady_clock::time_point start;
+  chrono::steady_clock::time_point exec;
+  chrono::steady_clock::time_point end;
+  chrono::nanoseconds cpu;
+};
+
+/**
+ * @brief Where the outer ends of a command line are wired, and what it
+ * returned. A descriptor of -1 means "inherit the shell's own".
+ *
+ * With own_pgrp set, every pipeline is started in a process group of its own
+ * and on_pgrp (if any) is told the group id, so a supervisor can signal the
+ * whole pipeline at once.
+ *
+ * With stages set, one StageResult per forked stage is appended to it.
+ *
+ * shell_state is set only by the shell itself (run(), --profile, --replay):
+ * builtins that move the process to another directory, cd and z, are refused
+ * without it, since under --serve or libtsh the process and its directory
+ * are shared by every session and caller.
+ */
+struct ExecContext {
+  ExecContext();
+
+  int in_fd;
+  int out_fd;
+  int err_fd;
+  int status;
+
+  bool own_pgrp;
+  function<void(pid_t)> on_pgrp;
+  bool shell_state;
+
+  vector<StageResult> *stages;
+};
+
+typedef int (*Builtin)(Process *p, int out_fd, int err_fd);
+
 void run();
 void display_prompt();
-void cleanup(list<Process *> &process_list, char *input_line);
+void cleanup(CommandLine &line, char *input_line);
 char *read_input();
-void parse_input(char *input_line, list<Process *> &process_list);
-bool run_commands(list<Process *> &command_list);
+void parse_input(char *input_line, CommandLine &line);
+bool run_commands(CommandLine &line, ExecContext *ctx = nullptr);
 bool isQuit(Process *process);
+Builtin find_builtin(const char *name);
+vector<string> builtin_names();
+int change_dir(const char *dir, int err_fd);
+void json_escape(string &out, const char *s);
+int wait_status(int raw_status);
 
 #endif
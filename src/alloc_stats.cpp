@@ -0,0 +1,27 @@
+#include <stats.h>
+#include <stdlib.h>
+#include <new>
+
+/**
+ * Counting replacements for the global operator new/delete, feeding the
+ * allocs, frees and alloc_bytes counters. They are linked into the tsh
+ * binaries only, never into libtsh.a, so embedders keep their own allocator.
+ */
+
+void *operator new(size_t size) {
+  stat_add(stats.allocs);
+  stat_add(stats.alloc_bytes, size);
+  if (void *p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void *p) noexcept {
+  if (p) stat_add(stats.frees);
+  free(p);
+}
+
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
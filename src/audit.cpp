@@ -0,0 +1,221 @@
+#include <tsh.h>
+#include <audit.h>
+#include <stats.h>
+#include <trace.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+atomic<bool> audit_enabled(false);
+
+struct AuditRecord {
+  uint64_t ts_ns;
+  uint64_t dur_ns;
+  uint64_t argv_hash;
+  int32_t pid;
+  int32_t status;
+  bool truncated;
+  char argv[AUDIT_ARGV_MAX];
+};
+
+/**
+ * @brief A slot of the ring. seq says whose turn it is: a producer may fill
+ * slot i when seq == i, the writer may take it when seq == i + 1, and the
+ * writer hands it back for the next lap by setting seq to i + size.
+ */
+struct AuditSlot {
+  atomic<uint64_t> seq;
+  AuditRecord rec;
+};
+
+static AuditSlot ring[AUDIT_RING_SIZE];
+static atomic<uint64_t> enqueue_pos{0};
+static uint64_t dequeue_pos = 0;  // writer thread only
+static atomic<bool> audit_stop{false};
+static thread audit_writer;
+static int audit_fd = -1;
+
+/**
+ * @brief Claims the next free slot, or returns nullptr when the ring is full.
+ * Producers race with a CAS on enqueue_pos only.
+ */
+static AuditSlot *claim() {
+  uint64_t pos = enqueue_pos.load(memory_order_relaxed);
+  for (;;) {
+    AuditSlot *slot = &ring[pos & (AUDIT_RING_SIZE - 1)];
+    uint64_t seq = slot->seq.load(memory_order_acquire);
+    if (seq == pos) {
+      if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+        return slot;
+    } else if (seq < pos) {
+      return nullptr;
+    } else {
+      pos = enqueue_pos.load(memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * @brief Appends one record to the log. Safe from any thread; never blocks.
+ */
+void audit_command(char *const *argv, pid_t pid, int status, uint64_t start_ns,
+                   uint64_t end_ns) {
+  AuditSlot *slot = claim();
+  if (!slot) {
+    stat_add(stats.audit_dropped);
+    return;
+  }
+  AuditRecord &r = slot->rec;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  r.dur_ns = end_ns - start_ns;
+  r.ts_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec - r.dur_ns;
+  r.pid = pid;
+  r.status = status;
+
+  // the hash covers all of argv even when the text is cut short
+  uint64_t h = 14695981039346656037ull;
+  size_t len = 0;
+  r.truncated = false;
+  for (size_t i = 0; argv[i]; i++) {
+    for (const char *c = argv[i];; c++) {
+      h = (h ^ (uint8_t) *c) * 1099511628211ull;
+      if (!*c) break;
+    }
+    if (i && len < AUDIT_ARGV_MAX - 1) r.argv[len++] = ' ';
+    size_t n = strlen(argv[i]);
+    if (n > AUDIT_ARGV_MAX - 1 - len) {
+      n = AUDIT_ARGV_MAX - 1 - len;
+      r.truncated = true;
+    }
+    memcpy(r.argv + len, argv[i], n);
+    len += n;
+  }
+  r.argv[len] = '\0';
+  r.argv_hash = h;
+
+  uint64_t pos = slot->seq.load(memory_order_relaxed);
+  slot->seq.store(pos + 1, memory_order_release);
+}
+
+static void format(string &out, const AuditRecord &r) {
+  char head[160];
+  snprintf(head, sizeof(head),
+           "{\"ts\":%lu,\"pid\":%d,\"status\":%d,\"dur_ns\":%lu,"
+           "\"hash\":\"%016lx\",\"argv\":\"",
+           (unsigned long) r.ts_ns, r.pid, r.status, (unsigned long) r.dur_ns,
+           (unsigned long) r.argv_hash);
+  out = head;
+  json_escape(out, r.argv);
+  out += r.truncated ? "\",\"truncated\":true}\n" : "\"}\n";
+}
+
+/**
+ * @brief Takes up to AUDIT_BATCH records off the ring and writes them with
+ * one writev. Line buffers keep their capacity, so a steady stream of
+ * records is formatted without allocating.
+ *
+ * @return size_t records written.
+ */
+static size_t drain(vector<string> &lines) {
+  struct iovec iov[AUDIT_BATCH];
+  size_t n = 0;
+  while (n < AUDIT_BATCH) {
+    AuditSlot &slot = ring[dequeue_pos & (AUDIT_RING_SIZE - 1)];
+    if (slot.seq.load(memory_order_acquire) != dequeue_pos + 1) break;
+    format(lines[n], slot.rec);
+    slot.seq.store(dequeue_pos + AUDIT_RING_SIZE, memory_order_release);
+    dequeue_pos++;
+    iov[n].iov_base = &lines[n][0];
+    iov[n].iov_len = lines[n].size();
+    n++;
+  }
+
+  struct iovec *v = iov;
+  size_t left = n;
+  while (left) {
+    ssize_t w = writev(audit_fd, v, left);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      perror("audit");
+      break;
+    }
+    while (left && (size_t) w >= v->iov_len) {
+      w -= v->iov_len;
+      v++;
+      left--;
+    }
+    if (left) {
+      v->iov_base = (char *) v->iov_base + w;
+      v->iov_len -= w;
+    }
+  }
+  stat_add(stats.audit_records, n);
+  return n;
+}
+
+/**
+ * @brief The writer thread. Once stopped, it keeps draining until every slot
+ * claimed so far has been written, waiting out producers still filling one.
+ */
+static void writer_loop() {
+  vector<string> lines(AUDIT_BATCH);
+  for (;;) {
+    bool stop = audit_stop.load(memory_order_acquire);
+    if (drain(lines) == AUDIT_BATCH) continue;
+    if (!stop) {
+      usleep(10000);
+    } else if (dequeue_pos == enqueue_pos.load(memory_order_acquire)) {
+      return;
+    } else {
+      sched_yield();  // claimed, not yet published
+    }
+  }
+}
+
+static void close_at_exit() { audit_close(); }
+
+/**
+ * @brief Starts logging executed commands to path, appending.
+ *
+ * @return false if path cannot be opened or the log is already open.
+ */
+bool audit_open(const char *path) {
+  static bool registered = false;
+  if (audit_fd >= 0) return false;
+  audit_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (audit_fd < 0) {
+    perror(path);
+    return false;
+  }
+  for (uint64_t i = 0; i < AUDIT_RING_SIZE; i++) {
+    ring[i].seq.store(i, memory_order_relaxed);
+  }
+  enqueue_pos.store(0, memory_order_relaxed);
+  dequeue_pos = 0;
+  audit_stop.store(false);
+  audit_writer = thread(writer_loop);
+  if (!registered) atexit(close_at_exit);
+  registered = true;
+  audit_enabled = true;
+  return true;
+}
+
+/**
+ * @brief Stops accepting records, writes out what is queued, including
+ * records still being filled in, and closes the log. A command that checked
+ * audit_on() just before the stop but claims its slot only after the writer
+ * has finished is not logged. Safe to call when no log is open.
+ */
+void audit_close() {
+  if (audit_fd < 0) return;
+  audit_enabled = false;
+  audit_stop.store(true, memory_order_release);
+  audit_writer.join();
+  close(audit_fd);
+  audit_fd = -1;
+}
@@ -0,0 +1,789 @@
+#include <tsh.h>
+#include <editor.h>
+#include <history.h>
+#include <filecomplete.h>
+#include <pathindex.h>
+#include <prompt.h>
+#include <stats.h>
+#include <algorithm>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+
+using namespace std;
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+#define KEY_ESC 27
+#define KEY_DEL 127
+#define ESC_TIMEOUT_MS 50  // for the rest of an escape sequence
+#define SEARCH_MATCHES 64  // C-r steps through at most this many
+#define COMPLETE_MAX 256   // candidates a Tab looks at
+#define PASTE_START "200~"
+#define PASTE_END "\x1b[201~"
+
+static volatile sig_atomic_t resized = 0;
+
+static void on_sigwinch(int) { resized = 1; }
+
+static bool is_cont(unsigned char c) { return (c & 0xc0) == 0x80; }
+
+/**
+ * @brief Bytes in the UTF-8 character at s[pos]; a stray byte counts as one.
+ */
+static size_t char_len(const string &s, size_t pos) {
+  if (s[pos] == '\x1b' && pos + 1 < s.size() && s[pos + 1] == '[') {
+    // a CSI sequence (prompt colours) is one unit, of width 0
+    size_t n = 2;
+    while (pos + n < s.size() && (s[pos + n] < 0x40 || s[pos + n] > 0x7e)) n++;
+    return min(n + 1, s.size() - pos);
+  }
+  size_t n = 1;
+  while (pos + n < s.size() && is_cont(s[pos + n])) n++;
+  return n;
+}
+
+static uint32_t decode(const char *p, size_t n) {
+  unsigned char c = p[0];
+  if (n == 1 || n > 4) return c;
+  uint32_t cp = c & (0x7f >> n);
+  for (size_t k = 1; k < n; k++) cp = (cp << 6) | (p[k] & 0x3f);
+  return cp;
+}
+
+/**
+ * @brief Terminal columns taken by a code point: 0 for combining marks and
+ * zero-width characters, 2 for East Asian wide ones and emoji, else 1.
+ * A table of the common ranges rather than wcwidth(), which depends on the
+ * locale tsh happens to be started in.
+ */
+static int char_width(uint32_t cp) {
+  if ((cp >= 0x300 && cp <= 0x36f) || (cp >= 0x1ab0 && cp <= 0x1aff) ||
+      (cp >= 0x1dc0 && cp <= 0x1dff) || (cp >= 0x200b && cp <= 0x200f) ||
+      (cp >= 0x20d0 && cp <= 0x20ff) || (cp >= 0xfe00 && cp <= 0xfe0f))
+    return 0;
+  if ((cp >= 0x1100 && cp <= 0x115f) || (cp >= 0x2e80 && cp <= 0xa4cf) ||
+      (cp >= 0xac00 && cp <= 0xd7a3) || (cp >= 0xf900 && cp <= 0xfaff) ||
+      (cp >= 0xfe30 && cp <= 0xfe4f) || (cp >= 0xff00 && cp <= 0xff60) ||
+      (cp >= 0xffe0 && cp <= 0xffe6) || (cp >= 0x1f300 && cp <= 0x1f64f) ||
+      (cp >= 0x1f900 && cp <= 0x1f9ff) || (cp >= 0x20000 && cp <= 0x3fffd))
+    return 2;
+  return 1;
+}
+
+static int width_at(const string &s, size_t pos, size_t n) {
+  if (s[pos] == '\x1b') return 0;
+  return char_width(decode(&s[pos], n));
+}
+
+/**
+ * @brief Byte offset of the character starting at column col of s.
+ */
+static size_t byte_at_col(const string &s, size_t col) {
+  size_t pos = 0, c = 0;
+  while (pos < s.size() && c < col) {
+    size_t n = char_len(s, pos);
+    c += width_at(s, pos, n);
+    pos += n;
+  }
+  return pos;
+}
+
+static int terminal_cols(int fd) {
+  struct winsize ws;
+  if (ioctl(fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col) return ws.ws_col;
+  return 80;
+}
+
+/**
+ * @brief Constructor for LineEditor. Raw mode and resize tracking are only
+ * used when both descriptors are terminals; otherwise keys are read as they
+ * come, which is what the tests rely on.
+ */
+LineEditor::LineEditor(int in_fd, int out_fd)
+    : in_fd(in_fd), out_fd(out_fd),
+      tty(isatty(in_fd) && isatty(out_fd)) {
+  if (tty) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    // SA_RESTART, so a resize does not fail blocking calls elsewhere in the
+    // shell with EINTR; next_byte() always waits in poll() before reading,
+    // and poll() is never restarted, so it still wakes up to redraw
+    sa.sa_handler = on_sigwinch;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+  }
+}
+
+LineEditor::~LineEditor() { cooked_mode(); }
+
+bool LineEditor::raw_mode() {
+  if (!tty || raw || tcgetattr(in_fd, &saved) < 0) return raw;
+  struct termios t = saved;
+  t.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  t.c_oflag &= ~OPOST;
+  t.c_cflag |= CS8;
+  t.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  t.c_cc[VMIN] = 1;
+  t.c_cc[VTIME] = 0;
+  raw = tcsetattr(in_fd, TCSADRAIN, &t) == 0;
+  if (raw) out += "\x1b[?2004h";  // bracketed paste
+  return raw;
+}
+
+void LineEditor::cooked_mode() {
+  if (raw) {
+    out += "\x1b[?2004l";
+    flush();
+    tcsetattr(in_fd, TCSADRAIN, &saved);
+  }
+  raw = false;
+}
+
+/**
+ * @brief The next input byte, or -1 at end of input. Without wait, gives up
+ * after ESC_TIMEOUT_MS; that is how a lone ESC is told from the start of a
+ * sequence. A terminal resize redraws the line while waiting.
+ */
+int LineEditor::next_byte(bool wait) {
+  if (in_pos < in_len) return (unsigned char) inbuf[in_pos++];
+  if (!wait) {
+    struct pollfd pfd = {in_fd, POLLIN, 0};
+    if (poll(&pfd, 1, ESC_TIMEOUT_MS) <= 0) return -1;
+  }
+  for (;;) {
+    if (resized) {
+      resized = 0;
+      cols = terminal_cols(out_fd);
+      render(true);
+      flush();
+    }
+    // filename completions and prompt segments are shown as they come in;
+    // in_fd is polled even without them, since a read() blocked on it would
+    // be restarted across a resize
+    struct pollfd pfd[3] = {{in_fd, POLLIN, 0}, {-1, POLLIN, 0},
+                            {-1, POLLIN, 0}};
+    if (wait && file_id) pfd[1].fd = file_complete_fd();
+    if (wait && prompts) pfd[2].fd = prompts->fd();
+    int r = poll(pfd, 3, -1);
+    if (r < 0 && errno == EINTR) continue;
+    if (r > 0 && !(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+      if (pfd[1].revents & POLLIN) file_update();
+      if (pfd[2].revents & POLLIN) {
+        prompts->drain();
+        prompt = prompts->text();
+      }
+      render();
+      flush();
+      continue;
+    }
+    ssize_t n = read(in_fd, inbuf, sizeof(inbuf));
+    if (n > 0) {
+      in_pos = 1;
+      in_len = n;
+      return (unsigned char) inbuf[0];
+    }
+    if (n < 0 && errno == EINTR) continue;
+    return -1;
+  }
+}
+
+size_t LineEditor::prev_char(size_t pos) const {
+  if (!pos) return 0;
+  do pos--; while (pos && is_cont(buf[pos]));
+  return pos;
+}
+
+size_t LineEditor::next_char(size_t pos) const {
+  return pos < buf.size() ? pos + char_len(buf, pos) : pos;
+}
+
+size_t LineEditor::prev_word(size_t pos) const {
+  while (pos && buf[pos - 1] == ' ') pos--;
+  while (pos && buf[pos - 1] != ' ') pos--;
+  return pos;
+}
+
+size_t LineEditor::next_word(size_t pos) const {
+  while (pos < buf.size() && buf[pos] == ' ') pos++;
+  while (pos < buf.size() && buf[pos] != ' ') pos++;
+  return pos;
+}
+
+void LineEditor::insert(const char *s, size_t n) {
+  buf.insert(cursor, s, n);
+  cursor += n;
+}
+
+/**
+ * @brief Removes buf[from, to) and leaves the cursor there; with keep, the
+ * text becomes what C-y yanks.
+ */
+void LineEditor::erase(size_t from, size_t to, bool keep) {
+  if (from >= to) return;
+  if (keep) yank = buf.substr(from, to - from);
+  buf.erase(from, to - from);
+  cursor = from;
+}
+
+/**
+ * @brief Replaces the line with the previous history entry, skipping ones
+ * identical to what is shown. The new line is kept in draft.
+ */
+void LineEditor::history_up() {
+  if (!history) return;
+  const char *entry;
+  size_t len, pos = hist_pos;
+  do {
+    if (!history->prev(pos, entry, len)) return;
+  } while (buf.size() == len && !buf.compare(0, len, entry, len));
+  if (hist_pos == history->end()) draft = buf;
+  hist_pos = pos;
+  buf.assign(entry, len);
+  cursor = buf.size();
+}
+
+/**
+ * @brief Replaces the line with the next history entry, or with the draft
+ * once past the newest.
+ */
+void LineEditor::history_down() {
+  const char *entry;
+  size_t len;
+  if (!history || !history->at(hist_pos, entry, len)) return;
+  hist_pos += len + 1;
+  if (history->at(hist_pos, entry, len)) buf.assign(entry, len);
+  else buf = draft;
+  cursor = buf.size();
+}
+
+void LineEditor::search_start() {
+  if (!history) return;
+  searching = true;
+  query.clear();
+  found.clear();
+  found_pos = 0;
+  before = buf;
+  before_cursor = cursor;
+}
+
+/**
+ * @brief Shows the current match with the cursor on the query in it; with
+ * none, the line stays as it was.
+ */
+void LineEditor::search_show() {
+  if (found_pos >= found.size()) return;
+  buf = found[found_pos];
+  string lower = buf, q = query;
+  for (char &c : lower) c = tolower((unsigned char) c);
+  for (char &c : q) c = tolower((unsigned char) c);
+  size_t at = lower.find(q);
+  cursor = at == string::npos ? buf.size() : at;
+}
+
+/**
+ * @brief Handles byte c during a C-r search.
+ */
+LineEditor::Action LineEditor::search_key(int c) {
+  if (c == CTRL_KEY('R')) {
+    if (found_pos + 1 < found.size()) found_pos++;
+    search_show();
+    return EDIT;
+  }
+  if (c == CTRL_KEY('G')) {
+    searching = false;
+    buf = before;
+    cursor = before_cursor;
+    return EDIT;
+  }
+  if (c == KEY_DEL || c == CTRL_KEY('H')) {
+    while (!query.empty() && is_cont(query.back())) query.pop_back();
+    if (!query.empty()) query.pop_back();
+  } else if (c >= 0x20) {
+    query += (char) c;
+    size_t n = c >= 0xf8 ? 1 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3
+             : c >= 0xc0 ? 2 : 1;
+    int b;
+    for (size_t got = 1; got < n && (b = next_byte(false)) >= 0; got++)
+      query += (char) b;
+  } else {
+    // anything else ends the search and acts on the match
+    searching = false;
+    return handle_key(c);
+  }
+
+  found.clear();
+  found_pos = 0;
+  if (!query.empty()) {
+    for (const HistoryMatch &m : history->search(query, SEARCH_MATCHES))
+      found.emplace_back(m.text, m.len);
+  }
+  search_show();
+  return EDIT;
+}
+
+/**
+ * @brief Lists names under the line, in columns, then more as a count of
+ * those left out, and redraws the line below them.
+ */
+void LineEditor::show_candidates(vector<string> names, size_t more) {
+  sort(names.begin(), names.end());
+  size_t widest = 0;
+  for (const string &name : names) widest = max(widest, name.size());
+  size_t per_row = max<size_t>(1, cols / (widest + 2));
+  out += "\r\n";
+  for (size_t k = 0; k < names.size(); k++) {
+    out += names[k];
+    if ((k + 1) % per_row == 0 || k + 1 == names.size()) out += "\r\n";
+    else out.append(widest + 2 - names[k].size(), ' ');
+  }
+  if (more) out += "... and " + to_string(more) + " more\r\n";
+  render(true);
+}
+
+/**
+ * @brief Extends the word at [start, cursor) to common, the prefix all total
+ * candidates share, and past a unique one with a '/' (dir) or a space. When
+ * they agree no further, a second Tab (again) lists names.
+ */
+void LineEditor::extend(size_t start, const string &common, size_t total,
+                        bool dir, const vector<string> &names, bool again) {
+  if (!total) {
+    out += '\a';
+    return;
+  }
+  size_t typed = cursor - start;
+  if (common.size() > typed)
+    insert(common.data() + typed, common.size() - typed);
+  if (total == 1) insert(dir ? "/" : " ", 1);
+  else if (common.size() > typed) return;
+  else if (again) show_candidates(names, total - names.size());
+  else {
+    out += '\a';
+    tab_pending = true;
+  }
+}
+
+/**
+ * @brief Tab. The first word of a stage completes from the path index
+ * right away; any other word (or one with a slash) completes as a filename
+ * on the worker of filecomplete.h, while the line stays editable. A Tab
+ * while that is still reading lists what it has found so far, and keeps
+ * listing as more comes in.
+ */
+void LineEditor::complete(bool again) {
+  size_t start = cursor;
+  while (start && !strchr(" |;", buf[start - 1])) start--;
+  size_t before = start;
+  while (before && buf[before - 1] == ' ') before--;
+  bool command = !before || buf[before - 1] == '|' || buf[before - 1] == ';';
+  const char *slash = (const char *) memrchr(buf.data() + start, '/',
+                                             cursor - start);
+
+  if (command && !slash) {
+    vector<string> names;
+    path_complete(buf.data() + start, cursor - start, names, COMPLETE_MAX);
+    string common = names.empty() ? "" : names[0];
+    for (const string &name : names) {
+      size_t k = 0;
+      while (k < common.size() && k < name.size() && name[k] == common[k]) k++;
+      common.resize(k);
+    }
+    // past COMPLETE_MAX, the names left out may agree on less
+    if (names.size() == COMPLETE_MAX) common.resize(cursor - start);
+    extend(start, common, names.size(), false, names, again);
+    return;
+  }
+
+  if (file_id) {
+    file_listing = true;
+    file_update();
+    return;
+  }
+  size_t base = slash ? slash - buf.data() + 1 : start;
+  string dir = slash ? buf.substr(start, base - 1 - start) : ".";
+  if (dir.empty()) dir = "/";
+  file_id = file_complete_start(dir, buf.substr(base, cursor - base));
+  file_base = base;
+  file_listing = again;
+  file_listed = 0;
+}
+
+/**
+ * @brief Takes in what the running filename completion has found: new
+ * names are listed if a list is being shown, and once it is done the word
+ * is extended.
+ */
+void LineEditor::file_update() {
+  FileMatches m;
+  if (!file_id || !file_complete_poll(file_id, m)) return;
+  if (file_listing && m.shown.size() > file_listed) {
+    vector<string> names;
+    for (size_t k = file_listed; k < m.shown.size(); k++)
+      names.push_back(m.shown[k].name + (m.shown[k].dir ? "/" : ""));
+    file_listed = m.shown.size();
+    show_candidates(names, m.done ? m.total - m.shown.size() : 0);
+  }
+  if (!m.done) return;
+  file_id = 0;
+  bool dir = m.total == 1 && m.shown[0].dir;
+  extend(file_base, m.common, m.total, dir, {}, false);
+}
+
+/**
+ * @brief Takes in a bracketed paste, the ESC [200~ that starts it already
+ * read: the text up to ESC [201~ is read in bulk, then split into lines.
+ */
+LineEditor::Action LineEditor::paste() {
+  string text;
+  size_t pos = string::npos;
+  for (;;) {
+    size_t from = text.size() >= strlen(PASTE_END) - 1
+                      ? text.size() - (strlen(PASTE_END) - 1) : 0;
+    text.append(inbuf + in_pos, in_len - in_pos);
+    in_pos = in_len;
+    if ((pos = text.find(PASTE_END, from)) != string::npos) break;
+    ssize_t n = read(in_fd, inbuf, sizeof(inbuf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;  // the end marker never came: keep what did
+    in_pos = 0;
+    in_len = n;
+  }
+  if (pos != string::npos) {
+    // what followed the marker, all from the last read, is typed input
+    in_pos = in_len - (text.size() - pos - strlen(PASTE_END));
+    text.resize(pos);
+  }
+  searching = false;  // the match stays, to paste into
+
+  // terminals send newlines as CRs; other control characters are dropped
+  vector<string> lines(1);
+  for (size_t k = 0; k < text.size(); k++) {
+    unsigned char c = text[k];
+    if (c == '\r' || c == '\n') {
+      if (c == '\r' && k + 1 < text.size() && text[k + 1] == '\n') k++;
+      lines.emplace_back();
+    } else if (c >= 0x20 || c == '\t') {
+      lines.back() += (char) c;
+    }
+  }
+  if (lines.size() == 1) {
+    insert(lines[0].data(), lines[0].size());
+    return EDIT;
+  }
+
+  string tail = buf.substr(cursor);
+  buf.resize(cursor);
+  buf += lines[0];
+  cursor = buf.size();
+  for (size_t k = 1; k + 1 < lines.size(); k++)
+    pasted.push_back(move(lines[k]));
+  paste_rest = lines.back();
+  paste_cursor = paste_rest.size();
+  paste_rest += tail;
+  return ACCEPT;
+}
+
+/**
+ * @brief Handles the key that starts with byte c.
+ */
+LineEditor::Action LineEditor::handle_key(int c) {
+  if (file_id && c != '\t') {
+    // typing on abandons a filename completion
+    file_complete_cancel();
+    file_id = 0;
+  }
+  if (searching) return search_key(c);
+  bool again = tab_pending;
+  tab_pending = false;
+  switch (c) {
+    case '\r':
+    case '\n': return ACCEPT;
+    case CTRL_KEY('C'): return CANCEL;
+    case CTRL_KEY('D'):
+      if (buf.empty()) return END_OF_INPUT;
+      erase(cursor, next_char(cursor), false);
+      break;
+    case KEY_DEL:
+    case CTRL_KEY('H'): erase(prev_char(cursor), cursor, false); break;
+    case CTRL_KEY('A'): cursor = 0; break;
+    case CTRL_KEY('E'): cursor = buf.size(); break;
+    case CTRL_KEY('B'): cursor = prev_char(cursor); break;
+    case CTRL_KEY('F'): cursor = next_char(cursor); break;
+    case CTRL_KEY('K'): erase(cursor, buf.size(), true); break;
+    case CTRL_KEY('U'): erase(0, cursor, true); break;
+    case CTRL_KEY('W'): erase(prev_word(cursor), cursor, true); break;
+    case CTRL_KEY('Y'): insert(yank.data(), yank.size()); break;
+    case CTRL_KEY('P'): history_up(); break;
+    case CTRL_KEY('N'): history_down(); break;
+    case CTRL_KEY('R'): search_start(); break;
+    case '\t': complete(again); break;
+    case CTRL_KEY('L'):
+      out += "\x1b[H\x1b[2J";
+      render(true);
+      break;
+    case KEY_ESC: return handle_escape();
+    default:
+      if (c >= 0x20) {
+        // the rest of a UTF-8 character arrives with its first byte
+        char ch[4] = {(char) c};
+        size_t n = c >= 0xf8 ? 1 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3
+                 : c >= 0xc0 ? 2 : 1;
+        size_t got = 1;
+        int b;
+        while (got < n && (b = next_byte(false)) >= 0) ch[got++] = b;
+        insert(ch, got);
+      }
+      break;
+  }
+  return EDIT;
+}
+
+/**
+ * @brief Handles what follows an ESC: a CSI or SS3 sequence (arrows, Home,
+ * End, Delete, with Ctrl or Alt for words) or an Alt-modified key.
+ */
+LineEditor::Action LineEditor::handle_escape() {
+  int c = next_byte(false);
+  if (c == '[' || c == 'O') {
+    char seq[16];
+    size_t n = 0;
+    int f;
+    while (n < sizeof(seq) - 1 && (f = next_byte(false)) >= 0) {
+      seq[n++] = f;
+      if (f >= 0x40 && f <= 0x7e) break;
+    }
+    seq[n] = '\0';
+    if (!strcmp(seq, PASTE_START)) return paste();
+    if (!strcmp(seq, "A")) history_up();
+    else if (!strcmp(seq, "B")) history_down();
+    else if (!strcmp(seq, "C")) cursor = next_char(cursor);
+    else if (!strcmp(seq, "D")) cursor = prev_char(cursor);
+    else if (!strcmp(seq, "H") || !strcmp(seq, "1~") || !strcmp(seq, "7~"))
+      cursor = 0;
+    else if (!strcmp(seq, "F") || !strcmp(seq, "4~") || !strcmp(seq, "8~"))
+      cursor = buf.size();
+    else if (!strcmp(seq, "3~")) erase(cursor, next_char(cursor), false);
+    else if (!strcmp(seq, "1;5C") || !strcmp(seq, "1;3C"))
+      cursor = next_word(cursor);
+    else if (!strcmp(seq, "1;5D") || !strcmp(seq, "1;3D"))
+      cursor = prev_word(cursor);
+    return EDIT;
+  }
+  switch (c) {
+    case 'b': cursor = prev_word(cursor); break;
+    case 'f': cursor = next_word(cursor); break;
+    case 'd': erase(cursor, next_word(cursor), true); break;
+    case KEY_DEL: erase(prev_word(cursor), cursor, true); break;
+  }
+  return EDIT;
+}
+
+/**
+ * @brief Brings the row up to date with prompt + buf, into out for the next
+ * flush(). Only the part after the first character that differs from what is
+ * on screen is rewritten; the cursor is moved with whichever is shorter,
+ * backspaces or re-sent text versus a CUB/CUF sequence. With full, the row is
+ * redrawn from column 0, as after a clear or a resize.
+ */
+void LineEditor::render(bool full) {
+  string shown_prompt = prompt;
+  if (searching) {
+    shown_prompt = !query.empty() && found.empty() ? "(failed " : "(";
+    shown_prompt += "reverse-i-search)`" + query + "': ";
+  }
+  string line = shown_prompt + buf;
+  size_t cursor_byte = shown_prompt.size() + cursor;
+  size_t width = 0, cursor_col = 0;
+  for (size_t pos = 0; pos < line.size(); pos += char_len(line, pos)) {
+    if (pos == cursor_byte) cursor_col = width;
+    width += width_at(line, pos, char_len(line, pos));
+  }
+  if (cursor_byte >= line.size()) cursor_col = width;
+
+  // keep the cursor in view; the last column is left alone so that the
+  // terminal never wraps
+  size_t avail = cols > 1 ? cols - 1 : 1;
+  if (width <= avail) scroll = 0;
+  else if (cursor_col < scroll) scroll = cursor_col;
+  else if (cursor_col - scroll > avail) scroll = cursor_col - avail;
+
+  string view;
+  size_t col = 0, view_width = 0;
+  for (size_t pos = 0; pos < line.size();) {
+    size_t n = char_len(line, pos);
+    size_t w = width_at(line, pos, n);
+    size_t start = col;
+    col += w;
+    if (line[pos] == '\x1b') {
+      view.append(line, pos, n);  // colours apply even if scrolled off
+    } else if (start < scroll) {
+      // a wide character cut by the left edge shows as padding
+      if (col > scroll) view.append(col - scroll, ' ');
+    } else if (col - scroll <= avail) {
+      view.append(line, pos, n);
+    } else {
+      break;
+    }
+    pos += n;
+  }
+  for (size_t pos = 0; pos < view.size(); pos += char_len(view, pos))
+    view_width += width_at(view, pos, char_len(view, pos));
+  size_t view_cursor = cursor_col - scroll;
+
+  if (full) {
+    out += '\r';
+    shown.clear();
+    shown_col = 0;
+  }
+
+  size_t same = 0, same_col = 0, shown_width = 0;
+  while (same < view.size() && same < shown.size()) {
+    size_t n = char_len(view, same);
+    if (shown.compare(same, n, view, same, n) != 0 ||
+        char_len(shown, same) != n)
+      break;
+    same_col += width_at(view, same, n);
+    same += n;
+  }
+  for (size_t pos = 0; pos < shown.size(); pos += char_len(shown, pos))
+    shown_width += width_at(shown, pos, char_len(shown, pos));
+
+  // moves the terminal cursor from column from to column to of view
+  auto move = [&](size_t from, size_t to) {
+    char esc[16];
+    if (to < from) {
+      int len = snprintf(esc, sizeof(esc), "\x1b[%zuD", from - to);
+      if (from - to <= (size_t) len) out.append(from - to, '\b');
+      else out += esc;
+    } else if (to > from) {
+      int len = snprintf(esc, sizeof(esc), "\x1b[%zuC", to - from);
+      size_t a = byte_at_col(view, from), b = byte_at_col(view, to);
+      if (b - a <= (size_t) len) out.append(view, a, b - a);
+      else out += esc;
+    }
+  };
+
+  size_t at = shown_col;
+  if (full || view != shown) {
+    move(at, same_col);
+    // the terminal's colours are those of the end of the row: restore the
+    // ones in effect where the rewrite starts
+    string sgr, shown_sgr;
+    for (size_t pos = 0, n; pos < same; pos += n) {
+      n = char_len(view, pos);
+      if (view[pos] == '\x1b') sgr.append(view, pos, n);
+    }
+    for (size_t pos = 0, n; pos < shown.size(); pos += n) {
+      n = char_len(shown, pos);
+      if (shown[pos] == '\x1b') shown_sgr.append(shown, pos, n);
+    }
+    if (sgr != shown_sgr || (full && view.find('\x1b') != string::npos))
+      out += "\x1b[0m" + sgr;
+    out.append(view, same, string::npos);
+    at = view_width;
+    if (full || shown_width > view_width) out += "\x1b[K";
+  }
+  move(at, view_cursor);
+  shown = view;
+  shown_col = view_cursor;
+}
+
+/**
+ * @brief Sends everything render() queued in a single write.
+ */
+void LineEditor::flush() {
+  const char *p = out.data();
+  size_t left = out.size();
+  while (left) {
+    ssize_t w = write(out_fd, p, left);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) break;
+    p += w;
+    left -= w;
+  }
+  out.clear();
+}
+
+/**
+ * @brief A line as read_line() returns it: line and a newline, malloc'd.
+ */
+static char *make_line(const string &line) {
+  char *out = (char *) malloc(line.size() + 2);
+  if (!out) return NULL;
+  memcpy(out, line.data(), line.size());
+  out[line.size()] = '\n';
+  out[line.size() + 1] = '\0';
+  stat_add(stats.lines_read);
+  stat_add(stats.bytes_read, line.size() + 1);
+  return out;
+}
+
+/**
+ * @brief Shows prompt and edits one line; while the lines of a paste are
+ * queued, returns the next one instead, leaving the terminal alone.
+ *
+ * @return char* the line with a trailing newline, malloc'd as read_input()
+ * returns it; a line cancelled with C-c comes back empty ("\n"). NULL on C-d
+ * at an empty line or at the end of input.
+ */
+char *LineEditor::read_line(const char *p) {
+  if (!pasted.empty()) {
+    char *line = make_line(pasted.front());
+    pasted.pop_front();
+    return line;
+  }
+  prompt = p;
+  buf = move(paste_rest);
+  cursor = paste_cursor;
+  paste_rest.clear();
+  paste_cursor = 0;
+  scroll = 0;
+  searching = false;
+  tab_pending = false;
+  file_id = 0;
+  if (history) {
+    history->refresh();
+    hist_pos = history->end();
+  }
+  raw_mode();
+  cols = tty ? terminal_cols(out_fd) : 80;
+  render(true);
+  flush();
+
+  Action act = EDIT;
+  while (act == EDIT) {
+    int c = next_byte();
+    if (c < 0) {
+      act = buf.empty() ? END_OF_INPUT : ACCEPT;
+      break;
+    }
+    act = handle_key(c);
+    // draw once the keys read so far are all handled
+    if (act == EDIT && in_pos == in_len) {
+      render();
+      flush();
+    }
+  }
+
+  searching = false;
+  if (file_id) file_complete_cancel();
+  file_id = 0;
+  render();
+  if (act == CANCEL) {
+    out += "^C";
+    buf.clear();
+  }
+  out += "\r\n";
+  // the rest of a paste is echoed at once, under its first line
+  for (const string &line : pasted) {
+    out += line;
+    out += "\r\n";
+  }
+  shown.clear();
+  shown_col = 0;
+  cooked_mode();
+  flush();
+
+  if (act == END_OF_INPUT) return NULL;
+  return make_line(buf);
+}
@@ -0,0 +1,234 @@
+#include <tsh.h>
+#include <filecomplete.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+#define DENTS_BUF (32 * 1024)  // bytes per getdents64() call
+#define FILE_CACHE_DIRS 32     // listings kept
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct Listing {
+  struct timespec mtime;
+  vector<pair<string, unsigned char>> entries;  // name, d_type
+  uint64_t used;  // cache_tick when last completed from
+};
+
+static mutex fc_mutex;
+static condition_variable fc_wake;
+static thread worker;
+static bool fc_stop = false;
+static uint64_t next_id = 0;
+static string req_dir, req_prefix;  // the newest request, until taken
+static bool requested = false;
+static atomic<uint64_t> current(0);  // the completion wanted; 0 for none
+static FileMatches published;        // for current
+static int notify_fd = -1;
+
+static map<pair<dev_t, ino_t>, Listing> cache;  // worker only
+static uint64_t cache_tick = 0;                  // worker only
+
+static bool cancelled(uint64_t id) { return current.load() != id; }
+
+/**
+ * @brief Adds name to m if it starts with prefix. Hidden names only match
+ * a prefix that starts with a dot.
+ */
+static void match(FileMatches &m, const string &dir, const string &prefix,
+                  const char *name, unsigned char type) {
+  if (name[0] == '.' && (prefix.empty() || prefix[0] != '.')) return;
+  if (!strcmp(name, ".") || !strcmp(name, "..")) return;
+  if (strncmp(name, prefix.c_str(), prefix.size())) return;
+
+  if (m.total++ == 0) {
+    m.common = name;
+  } else {
+    size_t k = 0;
+    while (k < m.common.size() && m.common[k] == name[k]) k++;
+    m.common.resize(k);
+  }
+  if (m.shown.size() < FILE_COMPLETE_SHOWN) {
+    bool is_dir = type == DT_DIR;
+    if (type == DT_LNK || type == DT_UNKNOWN) {
+      // only matches pay for a stat, and only here on the worker
+      struct stat st;
+      string path = dir + "/" + name;
+      is_dir = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    m.shown.push_back({name, is_dir});
+  }
+}
+
+/**
+ * @brief Hands m to the editor if id is still the completion it wants.
+ */
+static void publish(uint64_t id, const FileMatches &m) {
+  {
+    lock_guard<mutex> lock(fc_mutex);
+    if (cancelled(id)) return;
+    published = m;
+  }
+  uint64_t one = 1;
+  if (write(notify_fd, &one, sizeof(one)) < 0) {}
+}
+
+static void finish(uint64_t id, FileMatches &m) {
+  m.done = true;
+  publish(id, m);
+}
+
+/**
+ * @brief Completes prefix in dir for completion id: from the cached
+ * listing if the directory has not changed since, else by reading it.
+ */
+static void complete(uint64_t id, const string &dir, const string &prefix) {
+  FileMatches m;
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) close(fd);
+    finish(id, m);
+    return;
+  }
+
+  auto key = make_pair(st.st_dev, st.st_ino);
+  auto hit = cache.find(key);
+  if (hit != cache.end() && hit->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+      hit->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    close(fd);
+    hit->second.used = ++cache_tick;
+    for (auto &e : hit->second.entries) {
+      match(m, dir, prefix, e.first.c_str(), e.second);
+    }
+    finish(id, m);
+    return;
+  }
+
+  Listing listing;
+  listing.mtime = st.st_mtim;
+  static char buf[DENTS_BUF];
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+    size_t before = m.total;
+    for (long pos = 0; pos < n;) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + pos);
+      listing.entries.emplace_back(d->d_name, d->d_type);
+      match(m, dir, prefix, d->d_name, d->d_type);
+      pos += d->d_reclen;
+    }
+    if (cancelled(id)) break;
+    if (m.total != before) publish(id, m);
+  }
+  close(fd);
+  if (n < 0 || cancelled(id)) return;  // a partial listing is not kept
+
+  // the least recently used listing makes room, unless this one replaces
+  // its own stale listing
+  if (cache.size() >= FILE_CACHE_DIRS && !cache.count(key)) {
+    cache.erase(min_element(cache.begin(), cache.end(),
+                            [](const auto &a, const auto &b) {
+                              return a.second.used < b.second.used;
+                            }));
+  }
+  listing.used = ++cache_tick;
+  cache[key] = move(listing);
+  finish(id, m);
+}
+
+static void worker_loop() {
+  unique_lock<mutex> lock(fc_mutex);
+  for (;;) {
+    fc_wake.wait(lock, [] { return fc_stop || requested; });
+    if (fc_stop) return;
+    requested = false;
+    uint64_t id = current;
+    string dir = req_dir, prefix = req_prefix;
+    lock.unlock();
+    complete(id, dir, prefix);
+    lock.lock();
+  }
+}
+
+/**
+ * @brief Starts completing the names in dir that begin with prefix,
+ * abandoning any completion still running.
+ *
+ * @return uint64_t the id to poll for; 0 if the worker cannot be started.
+ */
+uint64_t file_complete_start(const string &dir, const string &prefix) {
+  lock_guard<mutex> lock(fc_mutex);
+  if (notify_fd < 0) {
+    notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (notify_fd < 0) return 0;
+  }
+  if (!worker.joinable()) {
+    fc_stop = false;
+    worker = thread(worker_loop);
+  }
+  uint64_t id = ++next_id;
+  current = id;
+  published = FileMatches();
+  req_dir = dir;
+  req_prefix = prefix;
+  requested = true;
+  fc_wake.notify_one();
+  return id;
+}
+
+/**
+ * @brief Abandons the running completion; the worker drops it after the
+ * batch it is reading.
+ */
+void file_complete_cancel() {
+  lock_guard<mutex> lock(fc_mutex);
+  current = 0;
+}
+
+/**
+ * @brief Readable (an eventfd) whenever new results have been published.
+ */
+int file_complete_fd() { return notify_fd; }
+
+/**
+ * @brief Copies what completion id has found so far into out and clears
+ * file_complete_fd().
+ *
+ * @return false if id is no longer the current completion.
+ */
+bool file_complete_poll(uint64_t id, FileMatches &out) {
+  uint64_t count;
+  if (notify_fd >= 0 && read(notify_fd, &count, sizeof(count)) < 0) {}
+  lock_guard<mutex> lock(fc_mutex);
+  if (cancelled(id)) return false;
+  out = published;
+  return true;
+}
+
+/**
+ * @brief Stops the worker (after the batch it is reading).
+ */
+void file_complete_stop() {
+  {
+    lock_guard<mutex> lock(fc_mutex);
+    fc_stop = true;
+    current = 0;
+    fc_wake.notify_one();
+  }
+  if (worker.joinable()) worker.join();
+}
@@ -0,0 +1,436 @@
+#include <tsh.h>
+#include <history.h>
+#include <histindex.h>
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define INDEX_MAGIC "TSHIDX\0\1"
+#define INDEX_FINGERPRINT 64  // history bytes hashed to tell it is the same file
+#define SHORT_SCAN_FACTOR 4   // short queries rank this many times the limit
+
+struct IndexHeader {
+  char magic[8];
+  uint64_t indexed;      // history bytes covered
+  uint64_t fingerprint;  // of the INDEX_FINGERPRINT bytes before that
+  uint32_t total_seq;
+  uint32_t nentries;
+  uint32_t ntrigrams;
+  uint32_t nslots;       // a power of two
+  uint64_t npostings;
+};
+
+struct IndexTrigram {
+  uint32_t key;
+  uint32_t count;
+  uint64_t start;  // into the postings
+};
+
+struct IndexSlot {
+  uint64_t hash;
+  uint32_t id;  // + 1; 0 for an empty slot
+  uint32_t pad;
+};
+
+// file layout: header, entries, trigrams sorted by key, slots, postings
+
+static uint64_t fnv1a(const char *s, size_t len) {
+  uint64_t h = 1469598103934665603ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static inline unsigned char fold(char c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static inline uint32_t trigram(const char *s) {
+  return fold(s[0]) << 16 | fold(s[1]) << 8 | fold(s[2]);
+}
+
+/**
+ * @brief The distinct trigrams of s, sorted.
+ */
+static void trigrams_of(const char *s, size_t len, vector<uint32_t> &keys) {
+  keys.clear();
+  for (size_t i = 0; i + 3 <= len; i++) keys.push_back(trigram(s + i));
+  sort(keys.begin(), keys.end());
+  keys.erase(unique(keys.begin(), keys.end()), keys.end());
+}
+
+/**
+ * @brief Whether lowercased needle occurs in text, ignoring ASCII case.
+ */
+static bool contains(const char *text, size_t len, const string &needle) {
+  size_t n = needle.size();
+  for (size_t i = 0; i + n <= len; i++) {
+    size_t k = 0;
+    while (k < n && fold(text[i + k]) == (unsigned char) needle[k]) k++;
+    if (k == n) return true;
+  }
+  return false;
+}
+
+static uint64_t fingerprint(const History &h, uint64_t upto) {
+  size_t n = min<uint64_t>(upto, INDEX_FINGERPRINT);
+  return fnv1a(h.data() + upto - n, n);
+}
+
+HistoryIndex::HistoryIndex(History &history, const string &path)
+    : history(history), path(path) {}
+
+HistoryIndex::~HistoryIndex() {
+  unload();
+}
+
+void HistoryIndex::unload() {
+  if (map) munmap((void *) map, map_len);
+  map = nullptr;
+  map_len = 0;
+  base_entries = nullptr;
+  trigrams = nullptr;
+  slots = nullptr;
+  base_postings = nullptr;
+  nbase = ntrigrams = nslots = 0;
+}
+
+/**
+ * @brief Whether the index file in map is whole and consistent: its counts
+ * add up to its size, every trigram's postings lie within the postings,
+ * every posting and slot names an entry, and the slot table has a free slot
+ * to end a probe. Searches follow these offsets unchecked.
+ */
+static bool index_valid(const char *map, size_t map_len) {
+  typedef HistoryIndex::Entry Entry;
+  const IndexHeader *hdr = (const IndexHeader *) map;
+  if (memcmp(hdr->magic, INDEX_MAGIC, 8) ||
+      (hdr->nslots & (hdr->nslots - 1)) ||
+      hdr->npostings > map_len / sizeof(uint32_t))
+    return false;
+  size_t need = sizeof(IndexHeader) + (size_t) hdr->nentries * sizeof(Entry) +
+                (size_t) hdr->ntrigrams * sizeof(IndexTrigram) +
+                (size_t) hdr->nslots * sizeof(IndexSlot) +
+                hdr->npostings * sizeof(uint32_t);
+  if (need != map_len) return false;
+
+  const Entry *entries = (const Entry *) (hdr + 1);
+  const IndexTrigram *trigrams = (const IndexTrigram *) (entries + hdr->nentries);
+  const IndexSlot *slots = (const IndexSlot *) (trigrams + hdr->ntrigrams);
+  const uint32_t *postings = (const uint32_t *) (slots + hdr->nslots);
+  for (uint32_t k = 0; k < hdr->ntrigrams; k++) {
+    const IndexTrigram &t = trigrams[k];
+    if (t.start > hdr->npostings || t.count > hdr->npostings - t.start)
+      return false;
+  }
+  for (uint64_t k = 0; k < hdr->npostings; k++) {
+    if (postings[k] >= hdr->nentries) return false;
+  }
+  bool free_slot = false;
+  for (uint32_t k = 0; k < hdr->nslots; k++) {
+    if (slots[k].id > hdr->nentries) return false;
+    free_slot |= !slots[k].id;
+  }
+  return free_slot || !hdr->nslots;
+}
+
+/**
+ * @brief Maps the index file, if there is one, it is valid, and it still
+ * describes the history: the history has not shrunk and ends the covered
+ * part with the same bytes. Otherwise everything is indexed afresh by
+ * catch_up(), and the rebuilt index replaces the file when saved.
+ */
+void HistoryIndex::load() {
+  loaded = true;
+  indexed = total_seq = 0;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  struct stat st;
+  void *m = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(IndexHeader))
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) return;
+  map = (const char *) m;
+  map_len = st.st_size;
+
+  const IndexHeader *hdr = (const IndexHeader *) map;
+  history.refresh();
+  if (!index_valid(map, map_len) || hdr->indexed > history.end() ||
+      hdr->fingerprint != fingerprint(history, hdr->indexed)) {
+    unload();
+    return;
+  }
+
+  base_entries = (const Entry *) (hdr + 1);
+  nbase = hdr->nentries;
+  trigrams = (const IndexTrigram *) (base_entries + nbase);
+  ntrigrams = hdr->ntrigrams;
+  slots = (const IndexSlot *) (trigrams + ntrigrams);
+  nslots = hdr->nslots;
+  base_postings = (const uint32_t *) (slots + nslots);
+  indexed = hdr->indexed;
+  total_seq = hdr->total_seq;
+}
+
+/**
+ * @brief Indexes the entries appended to the history since the last call.
+ */
+void HistoryIndex::catch_up() {
+  history.refresh();
+  if (indexed > history.end()) {
+    // the history was truncated or replaced: start over
+    unload();
+    updates.clear();
+    delta.clear();
+    delta_ids.clear();
+    delta_postings.clear();
+    indexed = total_seq = 0;
+    dirty = true;
+  }
+  const char *text;
+  size_t len;
+  while (history.at(indexed, text, len)) {
+    add(text, len, indexed);
+    indexed += len + 1;
+  }
+}
+
+HistoryIndex::Entry HistoryIndex::entry(uint32_t id) const {
+  if (id >= nbase) return delta[id - nbase];
+  auto it = updates.find(id);
+  return it == updates.end() ? base_entries[id] : it->second;
+}
+
+bool HistoryIndex::same_text(uint32_t id, const char *text, size_t len) const {
+  const char *t;
+  size_t n;
+  return history.at(entry(id).offset, t, n) && n == len && !memcmp(t, text, n);
+}
+
+/**
+ * @brief The id of the entry with this text, or -1.
+ */
+int64_t HistoryIndex::find(uint64_t hash, const char *text, size_t len) const {
+  for (uint32_t i = hash & (nslots - 1); nslots && slots[i].id;
+       i = (i + 1) & (nslots - 1)) {
+    if (slots[i].hash == hash && same_text(slots[i].id - 1, text, len))
+      return slots[i].id - 1;
+  }
+  auto range = delta_ids.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (same_text(it->second, text, len)) return it->second;
+  }
+  return -1;
+}
+
+void HistoryIndex::add(const char *text, size_t len, uint64_t offset) {
+  dirty = true;
+  uint32_t seq = ++total_seq;
+  uint64_t hash = fnv1a(text, len);
+  int64_t id = find(hash, text, len);
+  if (id >= 0) {
+    Entry e = entry(id);
+    e.offset = offset;
+    e.count++;
+    e.seq = seq;
+    if (id < nbase) updates[id] = e;
+    else delta[id - nbase] = e;
+    return;
+  }
+
+  id = nbase + delta.size();
+  delta.push_back({hash, offset, 1, seq});
+  delta_ids.emplace(hash, id);
+  vector<uint32_t> keys;
+  trigrams_of(text, len, keys);
+  for (uint32_t key : keys) delta_postings[key].push_back(id);
+}
+
+/**
+ * @brief The ids containing trigram key: a run of the file's postings and
+ * the delta's.
+ *
+ * @return false if there are none.
+ */
+bool HistoryIndex::postings(uint32_t key, const uint32_t *&base, size_t &nb,
+                            const vector<uint32_t> *&d) const {
+  const IndexTrigram *t = lower_bound(
+      trigrams, trigrams + ntrigrams, key,
+      [](const IndexTrigram &t, uint32_t k) { return t.key < k; });
+  base = base_postings;
+  nb = 0;
+  if (t != trigrams + ntrigrams && t->key == key) {
+    base = base_postings + t->start;
+    nb = t->count;
+  }
+  auto it = delta_postings.find(key);
+  d = it == delta_postings.end() ? nullptr : &it->second;
+  return nb || d;
+}
+
+/**
+ * @brief The distinct entries containing query (ignoring ASCII case), best
+ * first, at most limit of them.
+ *
+ * Score is log2(1 + runs) plus up to 8 for recency: the newest entry counts
+ * for as much as 255 runs.
+ */
+vector<HistoryMatch> HistoryIndex::search(const string &query, size_t limit) {
+  if (!loaded) load();
+  catch_up();
+
+  string q;
+  for (char c : query) q += fold(c);
+  vector<uint32_t> found;
+
+  if (q.size() < 3) {
+    // too short to index: take the newest distinct matches
+    unordered_set<uint32_t> seen;
+    const char *text;
+    size_t len, pos = history.end();
+    while (seen.size() < limit * SHORT_SCAN_FACTOR &&
+           history.prev(pos, text, len)) {
+      if (!len || !contains(text, len, q)) continue;
+      int64_t id = find(fnv1a(text, len), text, len);
+      if (id >= 0 && seen.insert(id).second) found.push_back(id);
+    }
+  } else {
+    vector<uint32_t> keys;
+    trigrams_of(q.data(), q.size(), keys);
+    struct List { const uint32_t *base; size_t nb; const vector<uint32_t> *d; };
+    vector<List> lists;
+    for (uint32_t key : keys) {
+      List l;
+      if (!postings(key, l.base, l.nb, l.d)) return {};
+      lists.push_back(l);
+    }
+    // drive from the shortest list, probe the rest
+    auto size = [](const List &l) { return l.nb + (l.d ? l.d->size() : 0); };
+    sort(lists.begin(), lists.end(),
+         [&](const List &a, const List &b) { return size(a) < size(b); });
+    auto has = [](const List &l, uint32_t id) {
+      if (binary_search(l.base, l.base + l.nb, id)) return true;
+      return l.d && binary_search(l.d->begin(), l.d->end(), id);
+    };
+    auto consider = [&](uint32_t id) {
+      for (size_t i = 1; i < lists.size(); i++) {
+        if (!has(lists[i], id)) return;
+      }
+      const char *text;
+      size_t len;
+      if (history.at(entry(id).offset, text, len) && contains(text, len, q))
+        found.push_back(id);
+    };
+    const List &drive = lists[0];
+    for (size_t i = 0; i < drive.nb; i++) consider(drive.base[i]);
+    if (drive.d) {
+      for (uint32_t id : *drive.d) consider(id);
+    }
+  }
+
+  vector<HistoryMatch> matches;
+  for (uint32_t id : found) {
+    Entry e = entry(id);
+    HistoryMatch m;
+    history.at(e.offset, m.text, m.len);
+    m.count = e.count;
+    m.score = log2(1.0 + e.count) + 8.0 * e.seq / total_seq;
+    matches.push_back(m);
+  }
+  size_t n = min(limit, matches.size());
+  partial_sort(matches.begin(), matches.begin() + n, matches.end(),
+               [](const HistoryMatch &a, const HistoryMatch &b) {
+                 return a.score > b.score;
+               });
+  matches.resize(n);
+  return matches;
+}
+
+/**
+ * @brief Merges the delta into a new index file, written beside the old one
+ * and renamed over it so that other sessions only ever map a whole file.
+ *
+ * @return false if it could not be written.
+ */
+bool HistoryIndex::save() {
+  if (!dirty) return true;
+
+  IndexHeader hdr;
+  memcpy(hdr.magic, INDEX_MAGIC, 8);
+  hdr.indexed = indexed;
+  hdr.fingerprint = fingerprint(history, indexed);
+  hdr.total_seq = total_seq;
+  hdr.nentries = nbase + delta.size();
+
+  vector<Entry> entries(base_entries, base_entries + nbase);
+  for (auto &u : updates) entries[u.first] = u.second;
+  entries.insert(entries.end(), delta.begin(), delta.end());
+
+  vector<uint32_t> keys;
+  for (auto &d : delta_postings) keys.push_back(d.first);
+  sort(keys.begin(), keys.end());
+  vector<IndexTrigram> tris;
+  vector<uint32_t> posts;
+  size_t b = 0, k = 0;
+  while (b < ntrigrams || k < keys.size()) {
+    uint32_t key = b < ntrigrams && (k == keys.size() || trigrams[b].key <= keys[k])
+                       ? trigrams[b].key : keys[k];
+    IndexTrigram t = {key, 0, posts.size()};
+    if (b < ntrigrams && trigrams[b].key == key) {
+      posts.insert(posts.end(), base_postings + trigrams[b].start,
+                   base_postings + trigrams[b].start + trigrams[b].count);
+      b++;
+    }
+    if (k < keys.size() && keys[k] == key) {
+      const vector<uint32_t> &d = delta_postings[key];
+      posts.insert(posts.end(), d.begin(), d.end());
+      k++;
+    }
+    t.count = posts.size() - t.start;
+    tris.push_back(t);
+  }
+  hdr.ntrigrams = tris.size();
+  hdr.npostings = posts.size();
+
+  hdr.nslots = 16;
+  while (hdr.nslots < 2 * hdr.nentries) hdr.nslots *= 2;
+  vector<IndexSlot> table(hdr.nslots, IndexSlot{0, 0, 0});
+  for (uint32_t id = 0; id < hdr.nentries; id++) {
+    uint32_t i = entries[id].hash & (hdr.nslots - 1);
+    while (table[i].id) i = (i + 1) & (hdr.nslots - 1);
+    table[i] = {entries[id].hash, id + 1, 0};
+  }
+
+  string tmp = path + ".tmp." + to_string(getpid());
+  FILE *f = fopen(tmp.c_str(), "we");
+  if (!f) {
+    perror(tmp.c_str());
+    return false;
+  }
+  fwrite(&hdr, sizeof hdr, 1, f);
+  fwrite(entries.data(), sizeof(Entry), entries.size(), f);
+  fwrite(tris.data(), sizeof(IndexTrigram), tris.size(), f);
+  fwrite(table.data(), sizeof(IndexSlot), table.size(), f);
+  fwrite(posts.data(), sizeof(uint32_t), posts.size(), f);
+  bool ok = !ferror(f);
+  if (fclose(f) || !ok || rename(tmp.c_str(), path.c_str()) < 0) {
+    perror(path.c_str());
+    unlink(tmp.c_str());
+    return false;
+  }
+  // the new file holds everything: map it afresh on the next search
+  unload();
+  updates.clear();
+  delta.clear();
+  delta_ids.clear();
+  delta_postings.clear();
+  loaded = dirty = false;
+  return true;
+}
@@ -0,0 +1,202 @@
+#include <tsh.h>
+#include <history.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+#define HISTORY_SHOW 20  // entries `history` prints by default
+#define HISTORY_FOUND 20  // matches `history search` prints
+
+History *shell_history = nullptr;
+
+History::~History() {
+  if (index) index->save();
+  index.reset();
+  if (map) munmap((void *) map, map_len);
+  if (fd >= 0) close(fd);
+}
+
+/**
+ * @brief Opens (creating if need be) the history file at path and maps it.
+ *
+ * @return false if it cannot be opened.
+ */
+bool History::open(const char *path) {
+  fd = ::open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  this->path = path;
+  refresh();
+  return true;
+}
+
+/**
+ * @brief Extends the mapping over whatever has been appended since the last
+ * call, by this session or another. Costs an fstat() when nothing has.
+ */
+void History::refresh() {
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || (size_t) st.st_size == map_len) return;
+
+  void *m = MAP_FAILED;
+  if (map && (size_t) st.st_size > map_len) {
+    m = mremap((void *) map, map_len, st.st_size, MREMAP_MAYMOVE);
+  } else {
+    // first mapping, or the file was truncated under us
+    if (map) munmap((void *) map, map_len);
+    if (st.st_size) m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  if (m == MAP_FAILED) {
+    map = nullptr;
+    map_len = complete = 0;
+    return;
+  }
+  map = (const char *) m;
+  map_len = st.st_size;
+  const char *nl = (const char *) memrchr(map, '\n', map_len);
+  complete = nl ? nl - map + 1 : 0;
+}
+
+/**
+ * @brief Appends line (len bytes, no newline) as one entry, in one write.
+ * Blank lines and repeats of the newest entry are not recorded.
+ *
+ * @return bool whether an entry was written.
+ */
+bool History::add(const char *line, size_t len) {
+  if (fd < 0 || strspn(line, " \t") >= len) return false;
+  refresh();
+  const char *last;
+  size_t last_len, pos = end();
+  if (prev(pos, last, last_len) && last_len == len && !memcmp(last, line, len))
+    return false;
+
+  // one writev, so concurrent sessions' entries do not interleave; the rest
+  // of a short write (a signal, a full disk) follows it
+  struct iovec iov[2] = {{(void *) line, len}, {(void *) "\n", 1}};
+  struct iovec *v = iov;
+  int left = 2;
+  while (left) {
+    ssize_t w = writev(fd, v, left);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    for (; left && (size_t) w >= v->iov_len; v++, left--) w -= v->iov_len;
+    if (left) {
+      v->iov_base = (char *) v->iov_base + w;
+      v->iov_len -= w;
+    }
+  }
+  refresh();
+  return true;
+}
+
+/**
+ * @brief Steps back from the entry at pos (or from end()) to the one before.
+ *
+ * @return false if pos is the first entry.
+ */
+bool History::prev(size_t &pos, const char *&entry, size_t &len) const {
+  if (!pos || pos > complete) return false;
+  size_t stop = pos - 1;  // the newline ending the previous entry
+  const char *nl = (const char *) memrchr(map, '\n', stop);
+  size_t start = nl ? nl - map + 1 : 0;
+  entry = map + start;
+  len = stop - start;
+  pos = start;
+  return true;
+}
+
+/**
+ * @brief The entry starting at pos.
+ *
+ * @return false if pos is end().
+ */
+bool History::at(size_t pos, const char *&entry, size_t &len) const {
+  if (pos >= complete) return false;
+  const char *nl = (const char *) memchr(map + pos, '\n', complete - pos);
+  entry = map + pos;
+  len = nl - entry;
+  return true;
+}
+
+/**
+ * @brief The distinct entries containing query, ignoring ASCII case, ranked
+ * by how often and how recently they were run.
+ */
+vector<HistoryMatch> History::search(const string &query, size_t limit) {
+  if (fd < 0) return {};
+  if (!index) index.reset(new HistoryIndex(*this, path + ".idx"));
+  return index->search(query, limit);
+}
+
+/**
+ * @brief $TSH_HISTORY, else ~/.tsh_history; nullptr without either.
+ */
+const char *history_path() {
+  static string path;
+  if (path.empty()) {
+    const char *env = getenv("TSH_HISTORY"), *home = getenv("HOME");
+    if (env && *env) path = env;
+    else if (home && *home) path = string(home) + "/.tsh_history";
+  }
+  return path.empty() ? nullptr : path.c_str();
+}
+
+/**
+ * @brief history search TEXT... — prints the best HISTORY_FOUND entries
+ * containing TEXT, best first, each after the number of times it was run.
+ */
+static int history_search(Process *p, int out_fd) {
+  string query;
+  for (int i = 2; p->cmdTokens[i]; i++) {
+    if (i > 2) query += ' ';
+    query += p->cmdTokens[i];
+  }
+  string out;
+  char count[16];
+  for (const HistoryMatch &m : shell_history->search(query, HISTORY_FOUND)) {
+    snprintf(count, sizeof(count), "%6u  ", m.count);
+    out += count;
+    out.append(m.text, m.len);
+    out += '\n';
+  }
+  if (write(out_fd, out.data(), out.size()) < 0) {}
+  return out.empty();
+}
+
+/**
+ * @brief history [N] — prints the newest N entries (HISTORY_SHOW by
+ * default), oldest first. history search TEXT... — see history_search().
+ */
+int history_builtin(Process *p, int out_fd, int err_fd) {
+  const char *arg = p->cmdTokens[1];
+  bool search = arg && !strcmp(arg, "search");
+  long n = arg ? strtol(arg, NULL, 10) : HISTORY_SHOW;
+  if ((arg && !search && n <= 0) || (search && !p->cmdTokens[2])) {
+    dprintf(err_fd, "usage: history [N]\n       history search TEXT...\n");
+    return 2;
+  }
+  if (!shell_history) {
+    dprintf(err_fd, "history: no history file\n");
+    return 1;
+  }
+  if (search) return history_search(p, out_fd);
+
+  History &h = *shell_history;
+  h.refresh();
+  const char *entry;
+  size_t len, pos = h.end();
+  for (long k = 0; k < n && h.prev(pos, entry, len); k++) {}
+
+  string out;
+  while (h.at(pos, entry, len)) {
+    out.append(entry, len + 1);
+    pos += len + 1;
+  }
+  if (write(out_fd, out.data(), out.size()) < 0) {}
+  return 0;
+}
@@ -0,0 +1,123 @@
+#include <tsh.h>
+#include <intern.h>
+#include <stats.h>
+#include <mutex>
+#include <shared_mutex>
+
+using namespace std;
+
+/**
+ * @brief The table: an open-addressing set of pointers into the arena with
+ * linear probing, kept at most half full. Each slot also holds the string's
+ * hash, so probes only compare bytes on a likely match.
+ */
+struct InternTable {
+  struct Slot {
+    const char *str;
+    size_t hash;
+  };
+
+  shared_mutex mtx;
+  vector<Slot> slots = vector<Slot>(256);
+  size_t used = 0;
+  char *chunk = nullptr;  // current arena block
+  size_t chunk_left = 0;
+};
+
+/**
+ * @brief The one table, built on first use so other translation units may
+ * intern from their static initializers.
+ */
+static InternTable &table() {
+  static InternTable *t = new InternTable();
+  return *t;
+}
+
+static size_t hash_bytes(const char *s, size_t len) {
+  size_t h = 14695981039346656037ull;
+  for (size_t k = 0; k < len; k++) h = (h ^ (unsigned char) s[k]) * 1099511628211ull;
+  return h;
+}
+
+/**
+ * @brief The slot holding s, or the empty slot where it would go.
+ */
+static InternTable::Slot &probe(InternTable &t, const char *s, size_t len,
+                                size_t h) {
+  size_t mask = t.slots.size() - 1;
+  for (size_t k = h & mask;; k = (k + 1) & mask) {
+    InternTable::Slot &slot = t.slots[k];
+    if (!slot.str) return slot;
+    if (slot.hash == h && strncmp(slot.str, s, len) == 0 && !slot.str[len])
+      return slot;
+  }
+}
+
+/**
+ * @brief Copies s into the arena, NUL-terminated. Strings over a quarter of
+ * a block get a block of their own, so a long one never wastes the rest of
+ * the current block.
+ */
+static const char *arena_copy(InternTable &t, const char *s, size_t len) {
+  char *dst;
+  if (len + 1 > INTERN_CHUNK / 4) {
+    dst = (char *) malloc(len + 1);
+  } else {
+    if (len + 1 > t.chunk_left) {
+      t.chunk = (char *) malloc(INTERN_CHUNK);
+      t.chunk_left = INTERN_CHUNK;
+    }
+    dst = t.chunk;
+    t.chunk += len + 1;
+    t.chunk_left -= len + 1;
+  }
+  memcpy(dst, s, len);
+  dst[len] = '\0';
+  stat_add(stats.interned_strings);
+  stat_add(stats.interned_bytes, len + 1);
+  return dst;
+}
+
+static void grow(InternTable &t) {
+  vector<InternTable::Slot> old(t.slots.size() * 2);
+  old.swap(t.slots);
+  for (const InternTable::Slot &slot : old) {
+    if (slot.str) probe(t, slot.str, strlen(slot.str), slot.hash) = slot;
+  }
+}
+
+/**
+ * @brief The canonical copy of the first len bytes of s, made on first
+ * sight.
+ */
+const char *intern(const char *s, size_t len) {
+  InternTable &t = table();
+  size_t h = hash_bytes(s, len);
+  {
+    shared_lock<shared_mutex> lock(t.mtx);
+    InternTable::Slot &slot = probe(t, s, len, h);
+    if (slot.str) return slot.str;
+  }
+
+  unique_lock<shared_mutex> lock(t.mtx);
+  InternTable::Slot &slot = probe(t, s, len, h);
+  if (slot.str) return slot.str;  // another thread got here first
+  slot.str = arena_copy(t, s, len);
+  slot.hash = h;
+  const char *str = slot.str;
+  if (++t.used * 2 > t.slots.size()) grow(t);
+  return str;
+}
+
+const char *intern(const char *s) { return intern(s, strlen(s)); }
+
+/**
+ * @brief The canonical copy of s if it has been interned, else nullptr.
+ * Never adds to the table.
+ */
+const char *intern_find(const char *s) {
+  InternTable &t = table();
+  size_t len = strlen(s);
+  shared_lock<shared_mutex> lock(t.mtx);
+  return probe(t, s, len, hash_bytes(s, len)).str;
+}
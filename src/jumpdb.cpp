@@ -0,0 +1,261 @@
+#include <tsh.h>
+#include <jumpdb.h>
+#include <algorithm>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define JUMP_AGING 0.99  // what counts are scaled by past JUMP_MAX_RANK
+
+JumpDb *shell_jumps = nullptr;
+
+JumpDb::~JumpDb() {
+  unmap();
+  if (fd >= 0) close(fd);
+}
+
+void JumpDb::unmap() {
+  if (map) munmap((void *) map, map_len);
+  map = nullptr;
+  map_len = parsed = lines = 0;
+  dirs.clear();
+}
+
+/**
+ * @brief Opens (creating if need be) the database at path and reads it.
+ *
+ * @return false if it cannot be opened.
+ */
+bool JumpDb::open(const char *path) {
+  this->path = path;
+  reopen();
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Drops what was read and opens the file now at path, as after a
+ * compaction.
+ */
+void JumpDb::reopen() {
+  unmap();
+  if (fd >= 0) close(fd);
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  struct stat st;
+  ino = fd >= 0 && fstat(fd, &st) == 0 ? st.st_ino : 0;
+  refresh();
+}
+
+/**
+ * @brief Takes in the records appended since the last call, by this session
+ * or another, and follows the file to its new inode once it is compacted.
+ */
+void JumpDb::refresh() {
+  struct stat st;
+  if (fd < 0) return;
+  if (stat(path.c_str(), &st) == 0 && st.st_ino != ino) {
+    reopen();
+    return;
+  }
+  if (fstat(fd, &st) < 0 || (size_t) st.st_size == map_len) return;
+
+  void *m = MAP_FAILED;
+  if (map && (size_t) st.st_size > map_len) {
+    m = mremap((void *) map, map_len, st.st_size, MREMAP_MAYMOVE);
+  } else {
+    unmap();  // first mapping, or the file was truncated under us
+    if (st.st_size) m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  if (m == MAP_FAILED) {
+    map = nullptr;
+    map_len = parsed = 0;
+    return;
+  }
+  map = (const char *) m;
+  map_len = st.st_size;
+
+  const char *nl;
+  while (parsed < map_len &&
+         (nl = (const char *) memchr(map + parsed, '\n', map_len - parsed))) {
+    const char *p = map + parsed;
+    char *end;
+    double count = strtod(p, &end);
+    time_t last = strtoll(end, &end, 10);
+    parsed = nl - map + 1;
+    lines++;
+    if (end >= nl || *end != ' ' || ++end == nl || count <= 0) continue;
+    Entry &e = dirs.emplace(string(end, nl - end), Entry{0, 0}).first->second;
+    e.count += count;
+    e.last = max(e.last, last);
+  }
+}
+
+/**
+ * @brief Records a visit to dir (absolute), in one write; $HOME is left
+ * out, as z does. Compacts the file if it has grown enough.
+ *
+ * @return bool whether the visit was written.
+ */
+bool JumpDb::visit(const char *dir, time_t now) {
+  const char *home = getenv("HOME");
+  if (fd < 0 || dir[0] != '/' || strchr(dir, '\n') ||
+      (home && !strcmp(dir, home)))
+    return false;
+  refresh();
+  char rec[PATH_MAX + 32];
+  int n = snprintf(rec, sizeof(rec), "1 %lld %s\n", (long long) now, dir);
+  if (n >= (int) sizeof(rec) || write(fd, rec, n) != n) return false;
+  refresh();
+  if (lines > dirs.size() + JUMP_SLACK) compact();
+  return true;
+}
+
+/**
+ * @brief Rewrites the file with a line per directory; see the class.
+ *
+ * @return false if another session is already at it, or on an error.
+ */
+bool JumpDb::compact() {
+  refresh();
+  if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) < 0) return false;
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0 || st.st_ino != ino) {
+    flock(fd, LOCK_UN);  // compacted just before we got the lock
+    return false;
+  }
+  refresh();
+
+  double total = 0;
+  for (auto &d : dirs) total += d.second.count;
+  double scale = total > JUMP_MAX_RANK ? JUMP_AGING : 1;
+  string out;
+  char rec[64];
+  for (auto &d : dirs) {
+    double count = d.second.count * scale;
+    if (count < 1 || stat(d.first.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+      continue;
+    snprintf(rec, sizeof(rec), "%.6g %lld ", count,
+             (long long) d.second.last);
+    out += rec;
+    out += d.first;
+    out += '\n';
+  }
+
+  string tmp = path + ".XXXXXX";
+  int tfd = mkostemp(&tmp[0], O_CLOEXEC | O_APPEND);
+  bool ok = tfd >= 0;
+  if (ok) ok = write(tfd, out.data(), out.size()) == (ssize_t) out.size();
+  if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+  if (!ok && tfd >= 0) unlink(tmp.c_str());
+
+  // visits appended after the refresh above were not in out
+  off_t done = map_len;
+  char buf[4096];
+  ssize_t n;
+  while (ok && (n = pread(fd, buf, sizeof(buf), done)) > 0) {
+    if (write(tfd, buf, n) != n) break;
+    done += n;
+  }
+  if (tfd >= 0) close(tfd);
+  flock(fd, LOCK_UN);
+  if (ok) reopen();
+  return ok;
+}
+
+static double frecency(double count, time_t last, time_t now) {
+  time_t age = now - last;
+  if (age < 3600) return count * 4;
+  if (age < 86400) return count * 2;
+  if (age < 604800) return count / 2;
+  return count / 4;
+}
+
+static bool matches(const char *dir, const vector<string> &terms,
+                    bool fold) {
+  for (const string &term : terms) {
+    const char *at = fold ? strcasestr(dir, term.c_str())
+                          : strstr(dir, term.c_str());
+    if (!at) return false;
+    dir = at + term.size();
+  }
+  return true;
+}
+
+/**
+ * @brief The directories containing terms in that order, best first. Case
+ * matters unless no directory matches with it.
+ */
+vector<JumpMatch> JumpDb::match(const vector<string> &terms, time_t now) {
+  refresh();
+  vector<JumpMatch> found;
+  for (bool fold : {false, true}) {
+    for (auto &d : dirs) {
+      if (matches(d.first.c_str(), terms, fold))
+        found.push_back({d.first, frecency(d.second.count, d.second.last,
+                                           now)});
+    }
+    if (!found.empty()) break;
+  }
+  sort(found.begin(), found.end(), [](const JumpMatch &a, const JumpMatch &b) {
+    return a.score > b.score || (a.score == b.score && a.dir < b.dir);
+  });
+  return found;
+}
+
+/**
+ * @brief $TSH_Z, else ~/.tsh_z; nullptr without either.
+ */
+const char *jump_db_path() {
+  static string path;
+  if (path.empty()) {
+    const char *env = getenv("TSH_Z"), *home = getenv("HOME");
+    if (env && *env) path = env;
+    else if (home && *home) path = string(home) + "/.tsh_z";
+  }
+  return path.empty() ? nullptr : path.c_str();
+}
+
+/**
+ * @brief z TERM... — cd to the best directory containing TERMs in order;
+ * z -l [TERM...] (or no TERM) lists the matches, best last, with scores.
+ */
+int z_builtin(Process *p, int out_fd, int err_fd) {
+  char **arg = p->cmdTokens + 1;
+  bool list = *arg && !strcmp(*arg, "-l");
+  if (list) arg++;
+  if (*arg && **arg == '-') {
+    dprintf(err_fd, "usage: z [-l] [TERM...]\n");
+    return 2;
+  }
+  if (!shell_jumps) {
+    dprintf(err_fd, "z: no directory database\n");
+    return 1;
+  }
+  vector<string> terms;
+  for (; *arg; arg++) terms.push_back(*arg);
+  vector<JumpMatch> found = shell_jumps->match(terms, time(NULL));
+
+  if (list || terms.empty()) {
+    string out;
+    char score[32];
+    for (auto m = found.rbegin(); m != found.rend(); ++m) {
+      snprintf(score, sizeof(score), "%10.1f  ", m->score);
+      out += score + m->dir + "\n";
+    }
+    if (write(out_fd, out.data(), out.size()) < 0) {}
+    return found.empty();
+  }
+  // the best that can still be entered
+  for (const JumpMatch &m : found) {
+    if (access(m.dir.c_str(), X_OK) == 0)
+      return change_dir(m.dir.c_str(), err_fd);
+  }
+  dprintf(err_fd, "z: no match\n");
+  return 1;
+}
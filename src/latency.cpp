@@ -0,0 +1,209 @@
+#include <tsh.h>
+#include <latency.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+/**
+ * @brief Bucket of v: exact below HIST_SUB, otherwise the power of two and
+ * the next HIST_SUB_BITS bits below the leading one.
+ */
+static int bucket_of(uint64_t v) {
+  if (v < HIST_SUB) return v;
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/**
+ * @brief Largest value that falls into bucket idx.
+ */
+static uint64_t bucket_top(int idx) {
+  if (idx < HIST_SUB) return idx;
+  int shift = idx / HIST_SUB - 1;
+  uint64_t low = (uint64_t) (HIST_SUB + idx % HIST_SUB) << shift;
+  return low + ((1ull << shift) - 1);
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  buckets[bucket_of(ns)].fetch_add(1, memory_order_relaxed);
+  total.fetch_add(1, memory_order_relaxed);
+  uint64_t seen = largest.load(memory_order_relaxed);
+  while (ns > seen &&
+         !largest.compare_exchange_weak(seen, ns, memory_order_relaxed)) {}
+}
+
+/**
+ * @brief Value at quantile q (0..1), reported as the top of its bucket and
+ * capped at the largest value seen.
+ */
+uint64_t LatencyHistogram::percentile(double q) const {
+  uint64_t n = count();
+  if (!n) return 0;
+  uint64_t rank = (uint64_t) (q * n);
+  if (rank >= n) rank = n - 1;
+  uint64_t seen = 0;
+  for (int k = 0; k < HIST_BUCKETS; k++) {
+    seen += buckets[k].load(memory_order_relaxed);
+    if (seen > rank) return min(bucket_top(k), max());
+  }
+  return max();
+}
+
+void LatencyHistogram::reset() {
+  for (auto &b : buckets) b.store(0, memory_order_relaxed);
+  total.store(0, memory_order_relaxed);
+  largest.store(0, memory_order_relaxed);
+}
+
+/**
+ * @brief A tracked command. hits is its Space-Saving estimate: a name that
+ * takes over a slot starts from the hits of the one it evicted, so hits
+ * overstates its runs by at most that much.
+ */
+struct CommandLatency {
+  char name[LATENCY_NAME_MAX];
+  uint64_t hits;
+  LatencyHistogram fork_exec;
+  LatencyHistogram exec_exit;
+};
+
+static LatencyHistogram all_fork_exec;
+static LatencyHistogram all_exec_exit;
+static LatencyHistogram all_pipeline;
+
+// guards the slots; histograms are recorded into under it, so a slot is
+// never taken over halfway through a record
+static mutex commands_mtx;
+static CommandLatency commands[LATENCY_MAX_COMMANDS];
+static size_t ncommands = 0;
+
+/**
+ * @brief The slot tracking cmd, or nullptr. Names longer than the slot holds
+ * are tracked by their first LATENCY_NAME_MAX - 1 bytes.
+ */
+static CommandLatency *find_command(const char *cmd) {
+  for (size_t k = 0; k < ncommands; k++) {
+    if (!strncmp(commands[k].name, cmd, LATENCY_NAME_MAX - 1)) return &commands[k];
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Counts one run of cmd and returns its slot. Once every slot is
+ * taken, an untracked name evicts the one with the fewest hits (Space-Saving),
+ * so the table ends up holding the busiest commands, not the first seen.
+ */
+static CommandLatency *count_command(const char *cmd) {
+  CommandLatency *c = find_command(cmd);
+  if (!c) {
+    if (ncommands < LATENCY_MAX_COMMANDS) {
+      c = &commands[ncommands++];
+    } else {
+      c = &commands[0];
+      for (CommandLatency &k : commands)
+        if (k.hits < c->hits) c = &k;
+      c->fork_exec.reset();
+      c->exec_exit.reset();
+    }
+    snprintf(c->name, sizeof(c->name), "%s", cmd);
+  }
+  c->hits++;
+  return c;
+}
+
+void latency_fork_exec(const char *cmd, uint64_t ns) {
+  all_fork_exec.record(ns);
+  lock_guard<mutex> lock(commands_mtx);
+  count_command(cmd)->fork_exec.record(ns);
+}
+
+void latency_exec_exit(const char *cmd, uint64_t ns) {
+  all_exec_exit.record(ns);
+  lock_guard<mutex> lock(commands_mtx);
+  // evicted since its exec: the run is only in the overall histogram
+  if (CommandLatency *c = find_command(cmd)) c->exec_exit.record(ns);
+}
+
+void latency_pipeline(uint64_t ns) { all_pipeline.record(ns); }
+
+/**
+ * @brief One report row: count, p50, p99, p99.9 and max, in microseconds.
+ */
+static void print_row(string &out, const string &name,
+                      const LatencyHistogram &h, bool json, bool first) {
+  char buf[256];
+  if (json) {
+    out += first ? "\"" : ",\"";
+    json_escape(out, name.c_str());
+    snprintf(buf, sizeof(buf),
+             "\":{\"count\":%lu,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+             "\"p999_us\":%.1f,\"max_us\":%.1f}",
+             (unsigned long) h.count(),
+             h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3,
+             h.percentile(0.999) / 1e3, h.max() / 1e3);
+  } else {
+    snprintf(buf, sizeof(buf), "%-28s %9lu %10.1f %10.1f %10.1f %10.1f\n",
+             name.c_str(), (unsigned long) h.count(), h.percentile(0.5) / 1e3,
+             h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3,
+             h.max() / 1e3);
+  }
+  out += buf;
+}
+
+/**
+ * @brief Writes the overall histograms and the LATENCY_TOP_N busiest
+ * commands' ones to fd, as a table or as one JSON object.
+ */
+void latency_print(int fd, bool json) {
+  lock_guard<mutex> lock(commands_mtx);
+  vector<const CommandLatency *> top;
+  for (size_t k = 0; k < ncommands; k++) top.push_back(&commands[k]);
+  sort(top.begin(), top.end(), [](const auto *a, const auto *b) {
+    return a->hits > b->hits;
+  });
+  if (top.size() > LATENCY_TOP_N) top.resize(LATENCY_TOP_N);
+
+  string out;
+  if (json) {
+    out += "{";
+  } else {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%-28s %9s %10s %10s %10s %10s\n", "latency (us)",
+             "count", "p50", "p99", "p99.9", "max");
+    out += buf;
+  }
+  print_row(out, "fork->exec", all_fork_exec, json, true);
+  print_row(out, "exec->exit", all_exec_exit, json, false);
+  print_row(out, "pipeline", all_pipeline, json, false);
+  for (const CommandLatency *c : top) {
+    string name = c->name;
+    print_row(out, name + " fork->exec", c->fork_exec, json, false);
+    print_row(out, name + " exec->exit", c->exec_exit, json, false);
+  }
+  out += json ? "}\n" : "";
+  if (write(fd, out.data(), out.size()) < 0) {}
+}
+
+static void report_at_exit() { latency_print(STDERR_FILENO, false); }
+
+/**
+ * @brief Prints the latency table to stderr when the shell exits (--latency).
+ */
+void latency_report_at_exit() { atexit(report_at_exit); }
+
+/**
+ * @brief tsh-latency [-j] — prints p50/p99/p99.9 latencies, -j for JSON.
+ */
+int latency_builtin(Process *p, int out_fd, int err_fd) {
+  const char *arg = p->cmdTokens[1];
+  bool json = arg && (strcmp(arg, "-j") == 0 || strcmp(arg, "--json") == 0);
+  if (arg && !json) {
+    dprintf(err_fd, "usage: tsh-latency [-j]\n");
+    return 2;
+  }
+  latency_print(out_fd, json);
+  return 0;
+}
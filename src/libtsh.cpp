@@ -0,0 +1,103 @@
+#include <tsh.h>
+#include <libtsh.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <system_error>
+
+using namespace std;
+
+namespace tsh {
+
+/**
+ * @brief Builds a pipeline from one argv per stage.
+ */
+Pipeline::Pipeline(initializer_list<vector<string>> stages) {
+  for (const vector<string> &argv : stages) add(argv);
+}
+
+/**
+ * @brief Appends a stage. argv[0] is looked up on PATH like any command.
+ *
+ * @throw invalid_argument for an empty argv or one longer than MAX_ARGS.
+ */
+Pipeline &Pipeline::add(vector<string> argv) {
+  if (argv.empty() || argv.size() > MAX_ARGS)
+    throw invalid_argument("tsh::Pipeline: stage needs 1 to " +
+                           to_string(MAX_ARGS) + " words");
+  stages.push_back(std::move(argv));
+  return *this;
+}
+
+/**
+ * @brief Reads a capture memfd back from the start.
+ */
+static string slurp(int fd) {
+  struct stat st;
+  string out;
+  if (fd < 0 || fstat(fd, &st) < 0) return out;
+  out.resize(st.st_size);
+  ssize_t n = pread(fd, &out[0], out.size(), 0);
+  out.resize(n > 0 ? n : 0);
+  return out;
+}
+
+/**
+ * @brief Runs the pipeline to completion on the same executor as the shell.
+ *
+ * Each stage becomes a Process whose tokens point straight into this
+ * Pipeline's strings; output is captured through memfds, so a chatty stage
+ * can never fill a pipe nobody is draining.
+ *
+ * @return Result with one status and one duration per stage that was
+ * started; a failed fork leaves the remaining stages out.
+ * @throw system_error if a capture memfd cannot be created; nothing is run
+ * rather than letting output go to the caller's descriptors.
+ */
+Result Pipeline::run(const RunOptions &opts) const {
+  Result res;
+  if (stages.empty()) return res;
+
+  CommandLine line;
+  for (size_t k = 0; k < stages.size(); k++) {
+    Process &p = line.add(k > 0, k + 1 < stages.size());
+    for (const string &word : stages[k]) p.add_token((char *) word.c_str());
+  }
+
+  vector<StageResult> stage_results;
+  ExecContext ctx;
+  ctx.stages = &stage_results;
+  ctx.in_fd = opts.in_fd;
+  ctx.out_fd = opts.capture_out ? memfd_create("tsh-stdout", MFD_CLOEXEC)
+                                : opts.out_fd;
+  ctx.err_fd = opts.capture_err ? memfd_create("tsh-stderr", MFD_CLOEXEC)
+                                : opts.err_fd;
+  if ((opts.capture_out && ctx.out_fd < 0) ||
+      (opts.capture_err && ctx.err_fd < 0)) {
+    int saved = errno;
+    if (opts.capture_out && ctx.out_fd >= 0) close(ctx.out_fd);
+    if (opts.capture_err && ctx.err_fd >= 0) close(ctx.err_fd);
+    throw system_error(saved, generic_category(), "tsh::Pipeline: capture");
+  }
+
+  auto start = chrono::steady_clock::now();
+  run_commands(line, &ctx);
+  res.wall = chrono::steady_clock::now() - start;
+
+  for (const StageResult &rec : stage_results) {
+    res.status.push_back(rec.status);
+    res.stage_wall.push_back(rec.end - rec.start);
+  }
+  if (opts.capture_out) {
+    res.out = slurp(ctx.out_fd);
+    if (ctx.out_fd >= 0) close(ctx.out_fd);
+  }
+  if (opts.capture_err) {
+    res.err = slurp(ctx.err_fd);
+    if (ctx.err_fd >= 0) close(ctx.err_fd);
+  }
+
+  return res;
+}
+
+}  // namespace tsh
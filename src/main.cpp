@@ -1,11 +1,105 @@
 #include <tsh.h>
+#include <server.h>
+#include <audit.h>
+#include <latency.h>
+#include <profile.h>
+#include <record.h>
+#include <reaper.h>
+#include <stats.h>
+#include <trace.h>
+#include <getopt.h>
+#include <thread>
+
+static void usage() {
+  fprintf(stderr,
+          "usage: tsh_app [--serve SOCK [--workers N] | --connect SOCK | "
+          "--batch] [--subreaper] [--trace FILE]\n"
+          "               [--stats-file FILE [--stats-interval SEC]] "
+          "[--latency] [--record FILE]\n"
+          "               [--audit FILE]\n"
+          "       tsh_app --profile SCRIPT [--profile-out FILE]\n"
+          "       tsh_app --replay FILE [--replay-max]\n");
+}
 
 /**
- * @brief the main runner, nothing to do here.
+ * @brief the main runner. Without options it is the interactive shell;
+ * --serve turns it into a daemon and --connect into a client of one;
+ * --batch speaks the daemon's frame protocol over stdin/stdout; --profile
+ * runs a script under the profiler and --replay re-runs a session recorded
+ * with --record. Any of them can be made a subreaper with --subreaper,
+ * traced with --trace, audited with --audit, and have its counters dumped
+ * periodically with --stats-file and its latency percentiles reported at
+ * exit with --latency.
  *
  * @return int
  */
-int main() {
+int main(int argc, char **argv) {
+  static struct option opts[] = {
+      {"serve", required_argument, NULL, 's'},
+      {"workers", required_argument, NULL, 'w'},
+      {"connect", required_argument, NULL, 'c'},
+      {"batch", no_argument, NULL, 'b'},
+      {"subreaper", no_argument, NULL, 'r'},
+      {"trace", required_argument, NULL, 't'},
+      {"stats-file", required_argument, NULL, 'f'},
+      {"stats-interval", required_argument, NULL, 'i'},
+      {"latency", no_argument, NULL, 'l'},
+      {"profile", required_argument, NULL, 'p'},
+      {"profile-out", required_argument, NULL, 'o'},
+      {"record", required_argument, NULL, 'R'},
+      {"audit", required_argument, NULL, 'a'},
+      {"replay", required_argument, NULL, 'P'},
+      {"replay-max", no_argument, NULL, 'M'},
+      {NULL, 0, NULL, 0},
+  };
+  const char *serve_path = NULL;
+  const char *connect_path = NULL;
+  bool batch = false;
+  bool subreaper = false;
+  const char *stats_path = NULL;
+  unsigned stats_interval = 0;
+  const char *profile_path = NULL;
+  const char *profile_out = NULL;
+  const char *replay_path = NULL;
+  bool replay_max = false;
+  int workers = thread::hardware_concurrency();
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    switch (opt) {
+      case 's': serve_path = optarg; break;
+      case 'w': workers = atoi(optarg); break;
+      case 'c': connect_path = optarg; break;
+      case 'b': batch = true; break;
+      case 'r': subreaper = true; break;
+      case 't':
+        if (!trace_open(optarg)) exit(EXIT_FAILURE);
+        break;
+      case 'f': stats_path = optarg; break;
+      case 'i': stats_interval = atoi(optarg); break;
+      case 'l': latency_report_at_exit(); break;
+      case 'p': profile_path = optarg; break;
+      case 'o': profile_out = optarg; break;
+      case 'R':
+        if (!record_open(optarg)) exit(EXIT_FAILURE);
+        break;
+      case 'a':
+        if (!audit_open(optarg)) exit(EXIT_FAILURE);
+        break;
+      case 'P': replay_path = optarg; break;
+      case 'M': replay_max = true; break;
+      default: usage(); exit(EXIT_FAILURE);
+    }
+  }
+
+  if (subreaper && !reaper_enable()) exit(EXIT_FAILURE);
+  if (stats_path && !stats_dump_start(stats_path, stats_interval))
+    exit(EXIT_FAILURE);
+  if (serve_path) exit(serve(serve_path, workers));
+  if (connect_path) exit(submit(connect_path));
+  if (batch) exit(serve_stdio());
+  if (profile_path) exit(profile_script(profile_path, profile_out));
+  if (replay_path) exit(replay_session(replay_path, replay_max));
   run();
   exit(0);
 }
@@ -0,0 +1,599 @@
+#include <tsh.h>
+#include <pathindex.h>
+#include <stats.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define PATH_SETTLE_MS 100  // how long a burst of changes (an install) may run
+#define PATH_RETRY_MS 1000  // between tries at watching a missing directory
+#define PATH_WATCH (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define BK_NAME_MAX 64     // longer names are left out of suggestions
+#define SUGGEST_RADIUS 2   // edits a suggestion may be away; 1 under 8 bytes
+
+typedef vector<pair<string, uint64_t>> NameList;  // sorted, with dir masks
+
+/**
+ * Radix trie of executable names, immutable once built.
+ */
+struct PathTrie {
+  struct Node {
+    uint32_t label;      // offset into labels
+    uint32_t label_len;
+    uint64_t dirs;       // bit i: dirs[i] has the name ending here
+    uint32_t child;      // first of nchild consecutive nodes, by first byte
+    uint32_t nchild;
+  };
+
+  string path;  // the $PATH it was built from
+  vector<string> dirs;
+  bool absolute = true;  // no relative dirs to resolve against
+  vector<Node> nodes;    // nodes[0] is the root
+  string labels;
+
+  void build(const NameList &names, size_t lo, size_t hi, size_t depth,
+             uint32_t at);
+  const Node *walk(const char *s, size_t len, size_t &start,
+                   bool partial) const;
+  void collect(const Node &n, string &name, vector<string> &out,
+               size_t limit) const;
+};
+
+/**
+ * @brief Fills nodes[at] with the names in [lo, hi), which agree on their
+ * first depth bytes, then its children after it.
+ */
+void PathTrie::build(const NameList &names, size_t lo, size_t hi,
+                     size_t depth, uint32_t at) {
+  const string &first = names[lo].first, &last = names[hi - 1].first;
+  size_t end = depth;
+  while (end < first.size() && end < last.size() && first[end] == last[end])
+    end++;
+  nodes[at] = {(uint32_t) labels.size(), (uint32_t) (end - depth), 0, 0, 0};
+  labels.append(first, depth, end - depth);
+  if (first.size() == end) nodes[at].dirs = names[lo++].second;
+
+  uint32_t n = 0;
+  for (size_t k = lo; k < hi; n++) {
+    char c = names[k].first[end];
+    while (k < hi && names[k].first[end] == c) k++;
+  }
+  uint32_t child = nodes.size();
+  nodes.resize(child + n);
+  nodes[at].child = child;
+  nodes[at].nchild = n;
+  for (size_t k = lo; k < hi; child++) {
+    size_t from = k;
+    char c = names[k].first[end];
+    while (k < hi && names[k].first[end] == c) k++;
+    build(names, from, k, end, child);
+  }
+}
+
+/**
+ * @brief The node where s ends; with partial, s may also end inside the
+ * node's label. start is set to the bytes of s before that node.
+ *
+ * @return nullptr if no name starts with s.
+ */
+const PathTrie::Node *PathTrie::walk(const char *s, size_t len, size_t &start,
+                                     bool partial) const {
+  const Node *node = &nodes[0];
+  size_t pos = 0;
+  for (;;) {
+    size_t n = min<size_t>(node->label_len, len - pos);
+    if (memcmp(labels.data() + node->label, s + pos, n)) return nullptr;
+    start = pos;
+    if (n < node->label_len) return partial ? node : nullptr;
+    pos += n;
+    if (pos == len) return node;
+
+    const Node *lo = &nodes[node->child], *hi = lo + node->nchild;
+    unsigned char c = s[pos];
+    lo = lower_bound(lo, hi, c, [&](const Node &child, unsigned char k) {
+      return (unsigned char) labels[child.label] < k;
+    });
+    if (lo == hi || (unsigned char) labels[lo->label] != c) return nullptr;
+    node = lo;
+  }
+}
+
+void PathTrie::collect(const Node &n, string &name, vector<string> &out,
+                       size_t limit) const {
+  size_t had = name.size();
+  name.append(labels, n.label, n.label_len);
+  if (n.dirs && out.size() < limit) out.push_back(name);
+  for (uint32_t k = 0; k < n.nchild && out.size() < limit; k++)
+    collect(nodes[n.child + k], name, out, limit);
+  name.resize(had);
+}
+
+/**
+ * @brief Distance between a and b, both at most BK_NAME_MAX bytes, where a
+ * swap of two neighbours counts as one edit (optimal string alignment).
+ * Not a metric, so it only ranks what the BK-tree finds.
+ */
+static uint32_t swap_distance(const char *a, size_t n, const char *b,
+                              size_t m) {
+  uint32_t rows[3][BK_NAME_MAX + 1];
+  uint32_t *older = rows[0], *prev = rows[1], *cur = rows[2];
+  for (size_t j = 0; j <= m; j++) prev[j] = j;
+  for (size_t i = 1; i <= n; i++) {
+    cur[0] = i;
+    for (size_t j = 1; j <= m; j++) {
+      uint32_t d = min(prev[j - 1] + (a[i - 1] != b[j - 1]),
+                       min(prev[j], cur[j - 1]) + 1);
+      if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1])
+        d = min(d, older[j - 2] + 1);
+      cur[j] = d;
+    }
+    uint32_t *t = older;
+    older = prev;
+    prev = cur;
+    cur = t;
+  }
+  return prev[m];
+}
+
+/**
+ * A name of at most BK_NAME_MAX bytes, set up to be compared with many
+ * others by Levenshtein distance: Myers' bit-parallel algorithm does a
+ * comparison in one pass over the other name, a few word operations per
+ * byte, where the usual table takes a pass per byte of both.
+ */
+struct EditPattern {
+  uint64_t peq[256];  // bit i: the name's byte i is this one
+  size_t len;
+
+  EditPattern(const char *s, size_t n) : len(n) {
+    memset(peq, 0, sizeof(peq));
+    for (size_t i = 0; i < n; i++) peq[(unsigned char) s[i]] |= 1ULL << i;
+  }
+
+  uint32_t distance(const char *t, size_t m) const {
+    if (!len) return m;
+    uint64_t pv = ~0ULL, mv = 0, last = 1ULL << (len - 1);
+    uint32_t score = len;
+    for (size_t j = 0; j < m; j++) {
+      uint64_t eq = peq[(unsigned char) t[j]];
+      uint64_t xv = eq | mv;
+      uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+      uint64_t ph = mv | ~(xh | pv), mh = pv & xh;
+      if (ph & last) score++;
+      else if (mh & last) score--;
+      ph = (ph << 1) | 1;
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
+    }
+    return score;
+  }
+};
+
+/**
+ * BK-tree of command names under edit distance, for suggesting what a
+ * mistyped command may have meant. The watcher keeps it across scans:
+ * names that appear are inserted, ones that go away are only marked dead,
+ * and once the dead outnumber the live ones it is built afresh.
+ */
+struct BkTree {
+  struct Node {
+    uint32_t name;   // offset into names
+    uint32_t len;
+    uint32_t dist;   // to the parent
+    uint32_t child;  // first child; 0 for none, the root being no child
+    uint32_t next;   // next sibling
+    bool live;
+  };
+
+  vector<Node> nodes;  // nodes[0] is the root
+  string names;
+  unordered_map<string, uint32_t> index;
+  size_t dead = 0;
+
+  void insert(const string &name);
+  void search(const char *s, size_t len, uint32_t radius,
+              vector<pair<uint32_t, uint32_t>> &out) const;
+};
+
+void BkTree::insert(const string &name) {
+  auto it = index.find(name);
+  if (it != index.end()) {
+    if (!nodes[it->second].live) dead--;
+    nodes[it->second].live = true;
+    return;
+  }
+  if (name.size() > BK_NAME_MAX) return;
+  EditPattern pattern(name.data(), name.size());
+  uint32_t id = nodes.size();
+  nodes.push_back({(uint32_t) names.size(), (uint32_t) name.size(), 0, 0, 0,
+                   true});
+  names += name;
+  index.emplace(name, id);
+  for (uint32_t at = 0; id;) {
+    const Node &n = nodes[at];
+    uint32_t d = pattern.distance(names.data() + n.name, n.len);
+    uint32_t c = n.child, last = 0;
+    while (c && nodes[c].dist != d) {
+      last = c;
+      c = nodes[c].next;
+    }
+    if (c) {
+      at = c;
+      continue;
+    }
+    nodes[id].dist = d;
+    if (last) nodes[last].next = id;
+    else nodes[at].child = id;
+    break;
+  }
+}
+
+/**
+ * @brief Appends (distance, node) for every live name within radius edits
+ * of s, visiting only subtrees the triangle inequality leaves open.
+ */
+void BkTree::search(const char *s, size_t len, uint32_t radius,
+                    vector<pair<uint32_t, uint32_t>> &out) const {
+  if (nodes.empty()) return;
+  EditPattern pattern(s, len);
+  vector<uint32_t> todo(1, 0);
+  while (!todo.empty()) {
+    const Node &n = nodes[todo.back()];
+    todo.pop_back();
+    uint32_t d = pattern.distance(names.data() + n.name, n.len);
+    if (d <= radius && n.live) out.emplace_back(d, &n - nodes.data());
+    for (uint32_t c = n.child; c; c = nodes[c].next) {
+      if (nodes[c].dist + radius >= d && nodes[c].dist <= d + radius)
+        todo.push_back(c);
+    }
+  }
+}
+
+static mutex trie_mutex;
+static unique_ptr<PathTrie> trie;  // under trie_mutex
+static thread watcher;
+static string watched_path;  // what watcher was started for
+static int stop_fd = -1;
+static atomic<bool> stopping(false);
+static mutex bk_mutex;
+static BkTree bk;  // written by the watcher only, under bk_mutex
+
+/**
+ * @brief Lists the executables in dir: regular files with an execute bit.
+ */
+static void scan(const string &dir, vector<string> &names) {
+  names.clear();
+  stat_add(stats.path_scans);
+  DIR *d = opendir(dir.c_str());
+  if (!d) return;
+  struct dirent *e;
+  while (!stopping && (e = readdir(d))) {
+    if (e->d_type == DT_DIR || e->d_name[0] == '.') continue;
+    struct stat st;
+    if (fstatat(dirfd(d), e->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+        (st.st_mode & 0111))
+      names.push_back(e->d_name);
+  }
+  closedir(d);
+}
+
+/**
+ * @brief Brings the BK-tree up to date with names and also. Only changes
+ * are made under bk_mutex; the watcher, its only writer, reads it freely.
+ */
+static void suggest_update(const NameList &names, const vector<string> &also) {
+  unordered_set<string> want(also.begin(), also.end());
+  for (auto &name : names) want.insert(name.first);
+
+  if (bk.nodes.empty() || bk.dead > bk.nodes.size() - bk.dead) {
+    BkTree fresh;
+    for (const string &name : want) fresh.insert(name);
+    lock_guard<mutex> lock(bk_mutex);
+    swap(bk, fresh);
+    return;
+  }
+  vector<string> added;
+  vector<uint32_t> gone;
+  for (const string &name : want) {
+    auto it = bk.index.find(name);
+    if (it == bk.index.end() || !bk.nodes[it->second].live)
+      added.push_back(name);
+  }
+  for (auto &entry : bk.index) {
+    if (bk.nodes[entry.second].live && !want.count(entry.first))
+      gone.push_back(entry.second);
+  }
+  lock_guard<mutex> lock(bk_mutex);
+  for (const string &name : added) bk.insert(name);
+  for (uint32_t id : gone) bk.nodes[id].live = false;
+  bk.dead += gone.size();
+}
+
+/**
+ * @brief Builds a trie from the current listings and swaps it in, and
+ * updates the suggestions with them and also.
+ */
+static void publish(const string &path, const vector<string> &dirs,
+                    const vector<vector<string>> &listings,
+                    const vector<string> &also) {
+  unordered_map<string, uint64_t> merged;
+  for (size_t i = 0; i < listings.size(); i++) {
+    for (const string &name : listings[i]) merged[name] |= 1ULL << i;
+  }
+  NameList names(merged.begin(), merged.end());
+  sort(names.begin(), names.end());
+
+  unique_ptr<PathTrie> t(new PathTrie);
+  t->path = path;
+  t->dirs = dirs;
+  for (const string &dir : dirs) t->absolute &= dir[0] == '/';
+  t->nodes.resize(1);
+  if (names.empty()) t->nodes[0] = {0, 0, 0, 0, 0};
+  else t->build(names, 0, names.size(), 0, 0);
+
+  suggest_update(names, also);  // first: a name resolves once suggested
+  lock_guard<mutex> lock(trie_mutex);
+  trie.swap(t);
+}
+
+/**
+ * @brief The watcher thread: lists path's directories, then rescans each
+ * one PATH_SETTLE_MS after inotify reports a change to it, until stop is
+ * signalled.
+ */
+static void watch_loop(string path, int stop, vector<string> also) {
+  vector<string> dirs;
+  for (size_t at = 0; dirs.size() < PATH_INDEX_DIRS;) {
+    size_t colon = path.find(':', at);
+    string dir = path.substr(at, colon - at);
+    dirs.push_back(dir.empty() ? "." : dir);
+    if (colon == string::npos) break;
+    at = colon + 1;
+  }
+
+  int ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  vector<int> wd(dirs.size(), -1);
+  vector<vector<string>> listings(dirs.size());
+  for (size_t i = 0; i < dirs.size(); i++) {
+    // watch first so that nothing changes unseen between the two
+    if (ino >= 0) wd[i] = inotify_add_watch(ino, dirs[i].c_str(), PATH_WATCH);
+    scan(dirs[i], listings[i]);
+  }
+  if (!stopping) publish(path, dirs, listings, also);
+
+  vector<bool> dirty(dirs.size());
+  chrono::steady_clock::time_point due, retry_at;
+  bool pending = false;
+  auto until = [](chrono::steady_clock::time_point t) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(
+        t - chrono::steady_clock::now());
+    return (int) max<long>(0, left.count());
+  };
+  while (!stopping) {
+    // a directory that does not exist (yet) cannot be watched; it is tried
+    // again every PATH_RETRY_MS and scanned once it can be
+    bool unwatched = ino >= 0 && find(wd.begin(), wd.end(), -1) != wd.end();
+    if (unwatched && retry_at == chrono::steady_clock::time_point())
+      retry_at = chrono::steady_clock::now() +
+                 chrono::milliseconds(PATH_RETRY_MS);
+    int timeout = pending ? until(due) : -1;
+    if (unwatched)
+      timeout = timeout < 0 ? until(retry_at) : min(timeout, until(retry_at));
+    struct pollfd pfd[2] = {{stop, POLLIN, 0}, {ino, POLLIN, 0}};
+    int r = poll(pfd, ino >= 0 ? 2 : 1, timeout);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 || pfd[0].revents) break;
+
+    if (r > 0) {
+      alignas(struct inotify_event) char buf[4096];
+      ssize_t n;
+      while ((n = read(ino, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+          struct inotify_event *ev = (struct inotify_event *) p;
+          for (size_t i = 0; i < dirs.size(); i++) {
+            if (wd[i] != ev->wd) continue;
+            dirty[i] = true;
+            if (ev->mask & IN_IGNORED) wd[i] = -1;  // the directory went away
+          }
+          p += sizeof(struct inotify_event) + ev->len;
+        }
+      }
+      if (!pending) due = chrono::steady_clock::now() +
+                          chrono::milliseconds(PATH_SETTLE_MS);
+      pending = true;
+      continue;
+    }
+
+    auto now = chrono::steady_clock::now();
+    if (unwatched && now >= retry_at) {
+      retry_at = chrono::steady_clock::time_point();
+      for (size_t i = 0; i < dirs.size(); i++) {
+        if (wd[i] >= 0) continue;
+        wd[i] = inotify_add_watch(ino, dirs[i].c_str(), PATH_WATCH);
+        if (wd[i] < 0) continue;
+        if (!pending) due = now;
+        dirty[i] = pending = true;
+      }
+    }
+    if (!pending || now < due) continue;
+
+    for (size_t i = 0; i < dirs.size(); i++) {
+      if (!dirty[i]) continue;
+      if (wd[i] < 0) wd[i] = inotify_add_watch(ino, dirs[i].c_str(), PATH_WATCH);
+      scan(dirs[i], listings[i]);
+      dirty[i] = false;
+    }
+    pending = false;
+    if (!stopping) publish(path, dirs, listings, also);
+  }
+  if (ino >= 0) close(ino);
+}
+
+/**
+ * @brief Starts indexing $PATH in the background, or restarts it if $PATH
+ * has changed since. Does nothing without a $PATH. also (the builtins) are
+ * suggested alongside the executables.
+ */
+void path_index_start(const vector<string> &also) {
+  const char *path = getenv("PATH");
+  if (!path) return;
+  if (watcher.joinable()) {
+    if (watched_path == path) return;
+    path_index_stop();
+  }
+  stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd < 0) return;
+  stopping = false;
+  watched_path = path;
+  watcher = thread(watch_loop, watched_path, stop_fd, also);
+}
+
+/**
+ * @brief Stops the watcher and drops the index.
+ */
+void path_index_stop() {
+  if (!watcher.joinable()) return;
+  stopping = true;
+  uint64_t one = 1;
+  if (write(stop_fd, &one, sizeof(one)) < 0) {}
+  watcher.join();
+  close(stop_fd);
+  stop_fd = -1;
+  {
+    lock_guard<mutex> lock(trie_mutex);
+    trie.reset();
+  }
+  lock_guard<mutex> lock(bk_mutex);
+  bk = BkTree();
+}
+
+/**
+ * @brief Writes the path execvp() would run for name into out: name in the
+ * first PATH directory that has it.
+ *
+ * @return false if name has a slash, the index cannot tell, or it is not
+ * on PATH as far as the index knows. Allocation-free.
+ */
+bool path_resolve(const char *name, char *out, size_t size) {
+  if (strchr(name, '/')) return false;
+  const char *path = getenv("PATH");
+  lock_guard<mutex> lock(trie_mutex);
+  if (!trie || !trie->absolute || !path || trie->path != path) return false;
+  size_t start;
+  const PathTrie::Node *n = trie->walk(name, strlen(name), start, false);
+  if (!n || !n->dirs) return false;
+  const string &dir = trie->dirs[__builtin_ctzll(n->dirs)];
+  if ((size_t) snprintf(out, size, "%s/%s", dir.c_str(), name) >= size)
+    return false;
+  stat_add(stats.path_resolved);
+  return true;
+}
+
+/**
+ * @brief Appends to out, in byte order, up to limit executable names that
+ * start with prefix (len bytes).
+ *
+ * @return size_t the number appended.
+ */
+size_t path_complete(const char *prefix, size_t len, vector<string> &out,
+                     size_t limit) {
+  size_t had = out.size();
+  lock_guard<mutex> lock(trie_mutex);
+  if (!trie) return 0;
+  size_t start;
+  const PathTrie::Node *n = trie->walk(prefix, len, start, true);
+  if (!n) return 0;
+  string name(prefix, start);
+  trie->collect(*n, name, out, had + limit);
+  return out.size() - had;
+}
+
+/**
+ * @brief Whether execvp() would find nothing to run called name on $PATH,
+ * for a name path_resolve() did not find. Answered from the index when it
+ * covers the current $PATH, so a file installed in the last PATH_SETTLE_MS
+ * may still be reported missing; otherwise (a non-interactive shell, a
+ * relative or overlong $PATH, a hidden name) checked on disk, an access()
+ * per PATH directory.
+ */
+bool path_absent(const char *name) {
+  const char *path = getenv("PATH");
+  if (!*name || strchr(name, '/') || !path) return false;
+  if (name[0] != '.') {
+    lock_guard<mutex> lock(trie_mutex);
+    if (trie && trie->absolute && trie->path == path &&
+        trie->dirs.size() < PATH_INDEX_DIRS) {
+      size_t start;
+      const PathTrie::Node *n = trie->walk(name, strlen(name), start, false);
+      return !n || !n->dirs;
+    }
+  }
+  char file[PATH_MAX];
+  for (const char *dir = path;; dir++) {
+    const char *end = strchrnul(dir, ':');
+    int n = end == dir ? snprintf(file, sizeof(file), "%s", name)
+                       : snprintf(file, sizeof(file), "%.*s/%s",
+                                  (int) (end - dir), dir, name);
+    if (n < (int) sizeof(file) && access(file, F_OK) == 0) return false;
+    if (!*end) return true;
+    dir = end;
+  }
+}
+
+/**
+ * @brief Appends to out, nearest first, up to limit commands name may be a
+ * typo of: within SUGGEST_RADIUS edits (1 for names under 8 bytes), a swap
+ * of two neighbouring letters counting as one.
+ *
+ * @return size_t the number appended.
+ */
+size_t path_suggest(const char *name, vector<string> &out, size_t limit) {
+  size_t len = strlen(name);
+  if (len > BK_NAME_MAX) return 0;
+  uint32_t radius = len < 8 ? 1 : SUGGEST_RADIUS;
+  vector<pair<uint32_t, string>> near;
+  {
+    vector<pair<uint32_t, uint32_t>> found;
+    lock_guard<mutex> lock(bk_mutex);
+    bk.search(name, len, radius, found);
+    // a swap of neighbours is two plain edits, over the budget of a short
+    // name: look its swapped spellings up as they are
+    char swapped[BK_NAME_MAX];
+    for (size_t i = 0; radius == 1 && i + 1 < len; i++) {
+      if (name[i] == name[i + 1]) continue;
+      memcpy(swapped, name, len);
+      swap(swapped[i], swapped[i + 1]);
+      bk.search(swapped, len, 0, found);
+    }
+    sort(found.begin(), found.end(),
+         [](const pair<uint32_t, uint32_t> &a,
+            const pair<uint32_t, uint32_t> &b) { return a.second < b.second; });
+    for (size_t k = 0; k < found.size(); k++) {
+      if (k && found[k].second == found[k - 1].second) continue;
+      const BkTree::Node &n = bk.nodes[found[k].second];
+      const char *s = bk.names.data() + n.name;
+      uint32_t d = swap_distance(s, n.len, name, len);
+      if (d <= radius) near.emplace_back(d, string(s, n.len));
+    }
+  }
+  sort(near.begin(), near.end());
+  size_t k = 0;
+  for (; k < near.size() && k < limit; k++) out.push_back(near[k].second);
+  return k;
+}
@@ -0,0 +1,153 @@
+#include <tsh.h>
+#include <profile.h>
+#include <intern.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+typedef chrono::steady_clock::duration Duration;
+
+struct LineProfile {
+  int line;
+  string text;
+  uint64_t calls = 0;
+  Duration total{0};
+  Duration shell{0};  // read + parse + spawn + builtins
+  Duration child_cpu{0};
+};
+
+struct CommandProfile {
+  uint64_t calls = 0;
+  Duration total{0};  // fork to reap, or the builtin's run
+  Duration self{0};   // fork to exec, or the builtin's run
+  Duration child_cpu{0};
+};
+
+static double ms(Duration d) {
+  return chrono::duration<double, milli>(d).count();
+}
+
+static long long us(Duration d) {
+  return chrono::duration_cast<chrono::microseconds>(d).count();
+}
+
+/**
+ * @brief Runs script and prints a per-line and a per-command table to stderr,
+ * sorted by total time, then writes folded stacks ("frame;frame value",
+ * microseconds) for flame graph tools to folded_path (SCRIPT.folded if null).
+ *
+ * @return int the status of the last line, or 1 if script cannot be read.
+ */
+int profile_script(const char *script, const char *folded_path) {
+  FILE *in = fopen(script, "r");
+  if (!in) {
+    perror(script);
+    return EXIT_FAILURE;
+  }
+  string folded_name = folded_path ? folded_path : string(script) + ".folded";
+  FILE *folded = fopen(folded_name.c_str(), "w");
+  if (!folded) {
+    perror(folded_name.c_str());
+    fclose(in);
+    return EXIT_FAILURE;
+  }
+  const char *base = strrchr(script, '/') ? strrchr(script, '/') + 1 : script;
+
+  FILE *saved_stdin = stdin;
+  stdin = in;
+
+  vector<LineProfile> lines;
+  unordered_map<const char *, CommandProfile> commands;  // by interned word
+  CommandLine cmdline;
+  vector<StageResult> stages;
+  vector<const char *> names;  // interned, so they outlive the line
+  ExecContext ctx;
+  ctx.shell_state = true;
+  ctx.stages = &stages;
+  bool is_quit = false;
+
+  for (int lineno = 1; !is_quit; lineno++) {
+    auto t0 = chrono::steady_clock::now();
+    char *input_line = read_input();
+    if (!input_line) break;
+
+    LineProfile lp;
+    lp.line = lineno;
+    lp.text = input_line;
+    if (!lp.text.empty() && lp.text.back() == '\n') lp.text.pop_back();
+
+    parse_input(input_line, cmdline);
+    auto t1 = chrono::steady_clock::now();
+    names.clear();
+    for (Process &p : cmdline) names.push_back(intern(p.cmdTokens[0]));
+
+    stages.clear();
+    is_quit = run_commands(cmdline, &ctx);
+    auto t2 = chrono::steady_clock::now();
+    cleanup(cmdline, input_line);
+
+    lp.calls = 1;
+    lp.total = t2 - t0;
+    lp.shell = t1 - t0;
+    fprintf(folded, "%s:%d;[tsh read+parse] %lld\n", base, lineno,
+            us(t1 - t0));
+
+    for (size_t k = 0; k < stages.size(); k++) {
+      const StageResult &st = stages[k];
+      CommandProfile &cp = commands[names[k]];
+      Duration self = st.exec - st.start;
+      cp.calls++;
+      cp.total += st.end - st.start;
+      cp.child_cpu += st.cpu;
+      lp.child_cpu += st.cpu;
+      if (!st.pid) {
+        // a builtin: all of it is shell time
+        cp.self += st.end - st.start;
+        lp.shell += st.end - st.start;
+        fprintf(folded, "%s:%d;[builtin %s] %lld\n", base, lineno,
+                names[k], us(st.end - st.start));
+        continue;
+      }
+      cp.self += self;
+      lp.shell += self;
+      fprintf(folded, "%s:%d;%s;[tsh spawn] %lld\n", base, lineno,
+              names[k], us(self));
+      fprintf(folded, "%s:%d;%s %lld\n", base, lineno, names[k],
+              us(st.end - st.exec));
+    }
+    lines.push_back(lp);
+  }
+
+  stdin = saved_stdin;
+  fclose(in);
+  fclose(folded);
+
+  sort(lines.begin(), lines.end(), [](const LineProfile &a, const LineProfile &b) {
+    return a.total > b.total;
+  });
+  fprintf(stderr, "%6s %6s %10s %10s %10s %10s  %s\n", "line", "calls",
+          "total ms", "shell ms", "child ms", "cpu ms", "source");
+  for (const LineProfile &lp : lines) {
+    fprintf(stderr, "%6d %6lu %10.3f %10.3f %10.3f %10.3f  %s\n", lp.line,
+            (unsigned long) lp.calls, ms(lp.total), ms(lp.shell),
+            ms(lp.total - lp.shell), ms(lp.child_cpu), lp.text.c_str());
+  }
+
+  vector<pair<const char *, CommandProfile>> by_cmd(commands.begin(), commands.end());
+  sort(by_cmd.begin(), by_cmd.end(), [](const auto &a, const auto &b) {
+    return a.second.total > b.second.total;
+  });
+  fprintf(stderr, "\n%-20s %6s %10s %10s %10s\n", "command", "calls",
+          "total ms", "self ms", "cpu ms");
+  for (const auto &entry : by_cmd) {
+    const CommandProfile &cp = entry.second;
+    fprintf(stderr, "%-20s %6lu %10.3f %10.3f %10.3f\n", entry.first,
+            (unsigned long) cp.calls, ms(cp.total), ms(cp.self),
+            ms(cp.child_cpu));
+  }
+  fprintf(stderr, "\nfolded stacks: %s\n", folded_name.c_str());
+
+  return ctx.status;
+}
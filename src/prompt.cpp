@@ -0,0 +1,298 @@
+#include <tsh.h>
+#include <prompt.h>
+#include <reaper.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+
+#define PROMPT_SHOW_DURATION_MS 500
+
+static const struct {
+  const char *name;
+  const char *sgr;
+} colors[] = {
+    {"red", "\x1b[31m"},  {"green", "\x1b[32m"},   {"yellow", "\x1b[33m"},
+    {"blue", "\x1b[34m"}, {"magenta", "\x1b[35m"}, {"cyan", "\x1b[36m"},
+    {"bold", "\x1b[1m"},  {"reset", "\x1b[0m"},
+};
+
+static string current_dir() {
+  char buf[PATH_MAX];
+  return getcwd(buf, sizeof(buf)) ? buf : "";
+}
+
+/**
+ * @brief Runs argv (no shell), collecting its stdout and exit status, and
+ * kills it after SEGMENT_TIMEOUT_MS.
+ *
+ * @return false if it could not be started or was killed.
+ */
+static bool capture(const char *const argv[], string &out, int &status) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) return false;
+  pid_t pid = child_fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execvp(argv[0], (char *const *) argv);
+    _exit(127);
+  }
+  close(fds[1]);
+  if (pid < 0) {
+    close(fds[0]);
+    return false;
+  }
+
+  auto deadline = chrono::steady_clock::now() +
+                  chrono::milliseconds(SEGMENT_TIMEOUT_MS);
+  bool timed_out = false;
+  char buf[4096];
+  for (;;) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(
+        deadline - chrono::steady_clock::now());
+    struct pollfd pfd = {fds[0], POLLIN, 0};
+    int r = left.count() > 0 ? poll(&pfd, 1, left.count()) : 0;
+    if (r < 0 && errno == EINTR) continue;
+    if (r == 0) {
+      timed_out = true;
+      kill(pid, SIGKILL);
+      break;
+    }
+    ssize_t n = read(fds[0], buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    out.append(buf, n);
+  }
+  close(fds[0]);
+  int raw;
+  if (child_wait(pid, &raw) < 0 || timed_out) return false;
+  status = WIFEXITED(raw) ? WEXITSTATUS(raw) : 128 + WTERMSIG(raw);
+  return true;
+}
+
+/**
+ * @brief "branch", or "branch*" with uncommitted changes, for the git
+ * repository containing dir; "" outside one.
+ */
+static bool git_segment(const string &dir, string &value) {
+  const char *argv[] = {"git", "-C", dir.c_str(), "status", "--porcelain",
+                        "--branch", "--untracked-files=no", nullptr};
+  string out;
+  int status;
+  if (!capture(argv, out, status)) return false;
+  value.clear();
+  if (status) return true;  // not in a repository
+  // "## main...origin/main [ahead 1]", "## No commits yet on main",
+  // "## HEAD (no branch)", then a line per changed file
+  size_t eol = out.find('\n');
+  string head = out.substr(0, eol);
+  if (head.compare(0, 3, "## ")) return false;
+  head.erase(0, 3);
+  const char *unborn = "No commits yet on ";
+  if (!head.compare(0, strlen(unborn), unborn)) head.erase(0, strlen(unborn));
+  value = head.substr(0, head.find("..."));
+  value = value.substr(0, value.find(' '));
+  if (eol != string::npos && eol + 1 < out.size()) value += '*';
+  return true;
+}
+
+/**
+ * @brief The current-context of the first file in $KUBECONFIG, else of
+ * ~/.kube/config; "" without one.
+ */
+static bool kube_segment(string &value) {
+  value.clear();
+  string path;
+  const char *env = getenv("KUBECONFIG"), *home = getenv("HOME");
+  if (env && *env) path = string(env).substr(0, string(env).find(':'));
+  else if (home) path = string(home) + "/.kube/config";
+  FILE *f = path.empty() ? nullptr : fopen(path.c_str(), "re");
+  if (!f) return true;
+  char line[1024];
+  const char *field = "current-context:";
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, field, strlen(field))) continue;
+    char *v = line + strlen(field);
+    v += strspn(v, " \t\"'");
+    value.assign(v, strcspn(v, "\"'\r\n"));
+    break;
+  }
+  fclose(f);
+  return true;
+}
+
+/**
+ * @brief Constructor for PromptEngine. tmpl is parsed once; with nullptr
+ * (or "") it is PROMPT_DEFAULT. Workers are only started if it uses a
+ * background segment.
+ */
+PromptEngine::PromptEngine(const char *tmpl) {
+  static const struct {
+    const char *name;
+    Kind kind;
+  } segments[] = {{"cwd", CWD},           {"user", USER}, {"host", HOST},
+                  {"status", STATUS},     {"git", GIT},   {"kube", KUBE},
+                  {"duration", DURATION}};
+  string t = tmpl && *tmpl ? tmpl : PROMPT_DEFAULT;
+  bool background = false;
+  for (size_t pos = 0; pos < t.size();) {
+    size_t open = t.find('{', pos), close = string::npos;
+    if (open != string::npos) close = t.find('}', open);
+    if (close == string::npos) {
+      parts.push_back({TEXT, t.substr(pos)});
+      break;
+    }
+    if (open > pos) parts.push_back({TEXT, t.substr(pos, open - pos)});
+    string name = t.substr(open + 1, close - open - 1);
+    Part part = {TEXT, t.substr(open, close - open + 1)};  // unknown: as is
+    for (auto &s : segments) {
+      if (name == s.name) part = {s.kind, ""};
+    }
+    for (auto &c : colors) {
+      if (name == c.name) part = {TEXT, c.sgr};
+    }
+    background |= async(part.kind);
+    parts.push_back(part);
+    pos = close + 1;
+  }
+
+  if (background) {
+    notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    for (int k = 0; k < PROMPT_WORKERS; k++)
+      workers.emplace_back(&PromptEngine::worker, this);
+  }
+}
+
+PromptEngine::~PromptEngine() {
+  {
+    lock_guard<mutex> lock(mtx);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (thread &t : workers) t.join();
+  if (notify_fd >= 0) close(notify_fd);
+}
+
+/**
+ * @brief Records how the last line went, for {status} and {duration}.
+ */
+void PromptEngine::finished(int status, uint64_t ns) {
+  last_status = status;
+  last_ns = ns;
+}
+
+string PromptEngine::key(Kind k, const string &cwd) const {
+  return k == GIT ? "git:" + cwd : "kube";
+}
+
+/**
+ * @brief Starts a new prompt: queues a refresh of each background segment
+ * not already being refreshed.
+ */
+void PromptEngine::begin() {
+  if (workers.empty()) return;
+  string cwd = current_dir();
+  {
+    lock_guard<mutex> lock(mtx);
+    for (const Part &p : parts) {
+      if (!async(p.kind)) continue;
+      string k = key(p.kind, cwd);
+      bool &busy = pending[k];
+      if (busy) continue;
+      busy = true;
+      jobs.push_back({p.kind, cwd, k});
+    }
+  }
+  wake.notify_all();
+}
+
+/**
+ * @brief The prompt as of now, with the cached values of background
+ * segments. Never blocks on them.
+ */
+string PromptEngine::text() {
+  string out, cwd = current_dir();
+  char buf[256];
+  for (const Part &p : parts) {
+    switch (p.kind) {
+      case TEXT: out += p.text; break;
+      case CWD: {
+        const char *home = getenv("HOME");
+        size_t n = home ? strlen(home) : 0;
+        if (n > 1 && !cwd.compare(0, n, home) &&
+            (cwd.size() == n || cwd[n] == '/'))
+          out += "~" + cwd.substr(n);
+        else
+          out += cwd;
+        break;
+      }
+      case USER: {
+        const char *user = getenv("USER");
+        struct passwd *pw = user ? nullptr : getpwuid(getuid());
+        out += user ? user : pw ? pw->pw_name : "";
+        break;
+      }
+      case HOST:
+        if (gethostname(buf, sizeof(buf)) == 0) {
+          buf[sizeof(buf) - 1] = '\0';
+          out.append(buf, strcspn(buf, "."));
+        }
+        break;
+      case STATUS:
+        if (last_status) out += to_string(last_status);
+        break;
+      case DURATION:
+        if (last_ns >= PROMPT_SHOW_DURATION_MS * 1000000ULL) {
+          snprintf(buf, sizeof(buf), "%.1fs", last_ns / 1e9);
+          out += buf;
+        }
+        break;
+      case GIT:
+      case KUBE: {
+        lock_guard<mutex> lock(mtx);
+        auto it = cache.find(key(p.kind, cwd));
+        if (it != cache.end()) out += it->second;
+        break;
+      }
+    }
+  }
+  return out;
+}
+
+/**
+ * @brief Clears fd() once its news has been taken in.
+ */
+void PromptEngine::drain() {
+  uint64_t count;
+  if (notify_fd >= 0 && read(notify_fd, &count, sizeof(count)) < 0) {}
+}
+
+void PromptEngine::worker() {
+  unique_lock<mutex> lock(mtx);
+  for (;;) {
+    wake.wait(lock, [&] { return stopping || !jobs.empty(); });
+    if (stopping) return;
+    Job job = jobs.front();
+    jobs.pop_front();
+    lock.unlock();
+
+    string value;
+    bool ok = job.kind == GIT ? git_segment(job.cwd, value)
+                              : kube_segment(value);
+
+    lock.lock();
+    pending[job.key] = false;
+    if (!ok) continue;  // timed out or garbled: the stale value stays
+    auto it = cache.find(job.key);
+    if (it != cache.end() && it->second == value) continue;
+    cache[job.key] = value;
+    uint64_t one = 1;
+    if (write(notify_fd, &one, sizeof(one)) < 0) {}
+  }
+}
@@ -0,0 +1,188 @@
+#include <tsh.h>
+#include <reaper.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <atomic>
+#include <memory_resource>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+#define REAP_BATCH 64
+
+static atomic<bool> enabled(false);
+static int wake_pipe[2] = {-1, -1};
+
+// forks hold it shared until their pid is tracked; a reaping pass holds it
+// exclusively, so it can never mistake a fresh child of ours for an orphan
+static shared_mutex fork_lock;
+
+// the registry's nodes come from a pool guarded by reg_mtx and go back to
+// it when erased, so tracking a fork does not allocate once the shell has
+// seen as many children in flight at once
+static mutex reg_mtx;
+static pmr::unsynchronized_pool_resource reg_pool;
+static pmr::unordered_set<pid_t> tracked(&reg_pool);
+struct Parked {
+  int raw_status;
+  struct rusage usage;
+};
+static pmr::unordered_map<pid_t, Parked> parked(&reg_pool);
+
+static atomic<uint64_t> orphans_reaped(0);
+static atomic<uint64_t> owned_reaped(0);
+static atomic<uint64_t> batches(0);
+
+/**
+ * @brief SIGCHLD handler: nudges the reaper thread.
+ */
+static void on_sigchld(int) {
+  int saved = errno;
+  char c = 0;
+  if (write(wake_pipe[1], &c, 1) < 0) {}
+  errno = saved;
+}
+
+/**
+ * @brief Reaps every exited child with wait4(-1, WNOHANG), REAP_BATCH per
+ * locked pass. Children the executor is still waiting for have their status
+ * parked for child_wait().
+ *
+ * @return size_t number of children collected.
+ */
+size_t reap_orphans() {
+  if (!enabled) return 0;
+
+  size_t total = 0;
+  for (;;) {
+    unique_lock<shared_mutex> no_forks(fork_lock);
+    lock_guard<mutex> lock(reg_mtx);
+    int n = 0;
+    for (; n < REAP_BATCH; n++) {
+      Parked status;
+      pid_t pid = wait4(-1, &status.raw_status, WNOHANG, &status.usage);
+      if (pid <= 0) break;
+      if (tracked.count(pid)) {
+        parked[pid] = status;
+        owned_reaped++;
+      } else {
+        orphans_reaped++;
+      }
+    }
+    if (n) batches++;
+    total += n;
+    if (n < REAP_BATCH) break;
+  }
+  return total;
+}
+
+/**
+ * @brief Makes tsh the subreaper of everything it starts and launches the
+ * reaper thread. Meant to be called once, before any command runs.
+ *
+ * @return false if the kernel refused.
+ */
+bool reaper_enable() {
+  if (enabled) return true;
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+    perror("prctl failed");
+    return false;
+  }
+  if (pipe2(wake_pipe, O_CLOEXEC) < 0) {
+    perror("pipe failed");
+    return false;
+  }
+  fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sigchld;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  enabled = true;
+  thread([] {
+    char buf[64];
+    for (;;) {
+      if (read(wake_pipe[0], buf, sizeof(buf)) < 0 && errno != EINTR) break;
+      reap_orphans();
+    }
+  }).detach();
+  return true;
+}
+
+bool reaper_enabled() { return enabled; }
+
+ReaperStats reaper_stats() {
+  return {orphans_reaped, owned_reaped, batches};
+}
+
+/**
+ * @brief fork() for the executor: with the reaper on, the child's pid is
+ * tracked before a reaping pass can see it.
+ *
+ * @return pid_t as fork().
+ */
+pid_t child_fork() {
+  if (!enabled) return fork();
+
+  shared_lock<shared_mutex> forking(fork_lock);
+  pid_t pid = fork();
+  if (pid > 0) {
+    lock_guard<mutex> lock(reg_mtx);
+    tracked.insert(pid);
+  }
+  return pid;
+}
+
+/**
+ * @brief Finishes a wait4() on a child from child_fork() that returned r:
+ * forgets the pid once it is collected, and falls back to its parked status
+ * if the reaper got there first.
+ */
+static pid_t settle(pid_t pid, pid_t r, int *raw_status, struct rusage *usage) {
+  if (!enabled || r == 0) return r;
+
+  int err = errno;
+  lock_guard<mutex> lock(reg_mtx);
+  tracked.erase(pid);
+  if (r < 0 && err == ECHILD) {
+    auto it = parked.find(pid);
+    if (it == parked.end()) return -1;
+    *raw_status = it->second.raw_status;
+    if (usage) *usage = it->second.usage;
+    parked.erase(it);
+    return pid;
+  }
+  return r;
+}
+
+/**
+ * @brief Blocking wait4() for a child from child_fork(), restarted on EINTR.
+ * If the reaper collected it first, its parked status and usage are
+ * returned.
+ *
+ * @param usage if not null, receives the child's resource usage.
+ * @return pid_t pid, or -1 if it was never ours.
+ */
+pid_t child_wait(pid_t pid, int *raw_status, struct rusage *usage) {
+  pid_t r;
+  while ((r = wait4(pid, raw_status, 0, usage)) < 0 && errno == EINTR) {}
+  return settle(pid, r, raw_status, usage);
+}
+
+/**
+ * @brief child_wait() without blocking.
+ *
+ * @return pid_t pid if the child was collected, 0 if it is still running,
+ * -1 if it was never ours.
+ */
+pid_t child_try_wait(pid_t pid, int *raw_status, struct rusage *usage) {
+  pid_t r;
+  while ((r = wait4(pid, raw_status, WNOHANG, usage)) < 0 && errno == EINTR) {}
+  return settle(pid, r, raw_status, usage);
+}
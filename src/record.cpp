@@ -0,0 +1,335 @@
+#include <tsh.h>
+#include <record.h>
+#include <trace.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+extern char **environ;
+
+#define RECORD_FLUSH_BYTES (64 << 10)
+#define RECORD_FLUSH_MS 100
+
+static mutex rec_mtx;
+static condition_variable rec_cv;
+static string rec_buf;       // encoded records not yet handed to the writer
+static bool rec_stop = false;
+static thread rec_writer;
+static int rec_fd = -1;
+
+/* shell-thread state: the line in flight and the last environment seen */
+static string pending_line;
+static uint64_t pending_start;
+static uint64_t last_start;
+static vector<char *> env_seen;
+static map<string, string> env_values;
+
+static void put_varint(string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((char) (v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((char) v);
+}
+
+static bool get_varint(const char *&p, const char *end, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+static void put_bytes(string &out, RecordType type, const string &s) {
+  out.push_back(type);
+  put_varint(out, s.size());
+  out += s;
+}
+
+static void write_all(int fd, const char *p, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      perror("record");
+      return;
+    }
+    p += w;
+    n -= w;
+  }
+}
+
+/**
+ * @brief The writer thread: takes whatever has been buffered every
+ * RECORD_FLUSH_MS, or sooner once RECORD_FLUSH_BYTES pile up, and writes it
+ * outside the lock.
+ */
+static void writer_loop() {
+  string out;
+  unique_lock<mutex> lock(rec_mtx);
+  for (;;) {
+    rec_cv.wait_for(lock, chrono::milliseconds(RECORD_FLUSH_MS), [] {
+      return rec_stop || rec_buf.size() >= RECORD_FLUSH_BYTES;
+    });
+    out.swap(rec_buf);
+    bool stop = rec_stop;
+    lock.unlock();
+    write_all(rec_fd, out.data(), out.size());
+    out.clear();
+    if (stop) return;
+    lock.lock();
+  }
+}
+
+static void enqueue(const string &records) {
+  if (records.empty()) return;
+  lock_guard<mutex> lock(rec_mtx);
+  rec_buf += records;
+  if (rec_buf.size() >= RECORD_FLUSH_BYTES) rec_cv.notify_one();
+}
+
+/**
+ * @brief Appends what changed in environ since the last call. Entries whose
+ * pointers are unchanged are skipped without comparing strings, so the
+ * common case costs one pass over the pointer array.
+ */
+static void diff_environ(string &out) {
+  size_t n = 0;
+  while (environ[n]) n++;
+  if (n == env_seen.size() && equal(env_seen.begin(), env_seen.end(), environ))
+    return;
+
+  map<string, string> now;
+  for (size_t i = 0; i < n; i++) {
+    const char *eq = strchr(environ[i], '=');
+    if (!eq) continue;
+    now.emplace(string(environ[i], eq - environ[i]), eq + 1);
+  }
+  for (const auto &kv : env_values) {
+    if (!now.count(kv.first)) put_bytes(out, REC_ENV_UNSET, kv.first);
+  }
+  for (const auto &kv : now) {
+    auto old = env_values.find(kv.first);
+    if (old == env_values.end() || old->second != kv.second)
+      put_bytes(out, REC_ENV_SET, kv.first + "=" + kv.second);
+  }
+  env_values.swap(now);
+  env_seen.assign(environ, environ + n);
+}
+
+static void close_at_exit() { record_close(); }
+
+/**
+ * @brief Starts recording to path and writes the header and the current
+ * environment.
+ *
+ * @return false if path cannot be created or a recording is already open.
+ */
+bool record_open(const char *path) {
+  static bool registered = false;
+  if (rec_fd >= 0) return false;
+  rec_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (rec_fd < 0) {
+    perror(path);
+    return false;
+  }
+
+  string head(RECORD_MAGIC, sizeof(RECORD_MAGIC) - 1);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  put_varint(head, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+  env_seen.clear();
+  env_values.clear();
+  diff_environ(head);
+  last_start = trace_now();
+
+  rec_stop = false;
+  rec_buf = head;
+  rec_writer = thread(writer_loop);
+  if (!registered) atexit(close_at_exit);
+  registered = true;
+  return true;
+}
+
+bool record_on() { return rec_fd >= 0; }
+
+/**
+ * @brief Notes a line as it is about to run; the record is completed by
+ * record_status. Called before parse_input, which tokenizes in place.
+ */
+void record_input(const char *line) {
+  pending_line = line;
+  pending_start = trace_now();
+}
+
+/**
+ * @brief Completes the line noted by record_input with its exit status and
+ * duration, plus any environment changes it made.
+ */
+void record_status(int status) {
+  uint64_t end = trace_now();
+  string out;
+  out.push_back(REC_LINE);
+  put_varint(out, pending_start - last_start);
+  put_varint(out, end - pending_start);
+  put_varint(out, ((uint64_t) status << 1) ^ (uint64_t) (status >> 31));
+  put_varint(out, pending_line.size());
+  out += pending_line;
+  diff_environ(out);
+  last_start = pending_start;
+  enqueue(out);
+}
+
+/**
+ * @brief Flushes and stops the writer; the log is complete once this
+ * returns. Safe to call when nothing is being recorded.
+ */
+void record_close() {
+  if (rec_fd < 0) return;
+  {
+    lock_guard<mutex> lock(rec_mtx);
+    rec_stop = true;
+  }
+  rec_cv.notify_one();
+  rec_writer.join();
+  close(rec_fd);
+  rec_fd = -1;
+}
+
+struct ReplayLine {
+  uint64_t offset_ns;    // from the session start
+  uint64_t recorded_ns;
+  uint64_t replayed_ns;
+  int recorded_status;
+  int replayed_status;
+  string text;
+};
+
+/**
+ * @brief Replays a recorded session: restores its environment, then runs
+ * each line either at its original offset from the start or, with
+ * max_speed, back to back. Statuses and timings are compared and a summary
+ * goes to stderr.
+ *
+ * @return int 0 if every line exited as recorded, 1 otherwise or if the log
+ * cannot be read.
+ */
+int replay_session(const char *path, bool max_speed) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0) close(fd);
+    return EXIT_FAILURE;
+  }
+  string log(st.st_size, '\0');
+  ssize_t got = read(fd, &log[0], log.size());
+  close(fd);
+  const size_t magic_len = sizeof(RECORD_MAGIC) - 1;
+  if (got != st.st_size || log.compare(0, magic_len, RECORD_MAGIC, magic_len)) {
+    fprintf(stderr, "%s: not a tsh session log\n", path);
+    return EXIT_FAILURE;
+  }
+
+  const char *p = log.data() + magic_len, *end = log.data() + log.size();
+  uint64_t wall_start;
+  if (!get_varint(p, end, wall_start)) p = end;
+
+  vector<ReplayLine> lines;
+  CommandLine cmdline;
+  ExecContext ctx;
+  ctx.shell_state = true;
+  bool is_quit = false, truncated = false;
+  uint64_t offset = 0;
+  clearenv();
+  auto replay_start = chrono::steady_clock::now();
+
+  while (p < end && !is_quit) {
+    uint8_t type = *p++;
+    uint64_t len = 0;
+    if (type == REC_ENV_SET || type == REC_ENV_UNSET) {
+      if (!get_varint(p, end, len) || len > (uint64_t) (end - p)) break;
+      string entry(p, len);
+      p += len;
+      if (type == REC_ENV_UNSET) {
+        unsetenv(entry.c_str());
+      } else {
+        size_t eq = entry.find('=');
+        setenv(entry.substr(0, eq).c_str(), entry.c_str() + eq + 1, 1);
+      }
+      continue;
+    }
+    uint64_t delta, dur, zstatus;
+    if (type != REC_LINE || !get_varint(p, end, delta) ||
+        !get_varint(p, end, dur) || !get_varint(p, end, zstatus) ||
+        !get_varint(p, end, len) || len > (uint64_t) (end - p)) {
+      truncated = true;
+      break;
+    }
+    ReplayLine rl;
+    offset += delta;
+    rl.offset_ns = offset;
+    rl.recorded_ns = dur;
+    rl.recorded_status = (int) ((zstatus >> 1) ^ -(zstatus & 1));
+    rl.text.assign(p, len);
+    p += len;
+
+    if (!max_speed)
+      this_thread::sleep_until(replay_start + chrono::nanoseconds(offset));
+
+    char *input_line = (char *) malloc(len + 1);
+    memcpy(input_line, rl.text.data(), len);
+    input_line[len] = '\0';
+    uint64_t start = trace_now();
+    parse_input(input_line, cmdline);
+    is_quit = run_commands(cmdline, &ctx);
+    cleanup(cmdline, input_line);
+    rl.replayed_ns = trace_now() - start;
+    rl.replayed_status = ctx.status;
+    lines.push_back(move(rl));
+  }
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() -
+                                            replay_start).count();
+  if (truncated) fprintf(stderr, "%s: log truncated\n", path);
+
+  uint64_t recorded_total = 0, replayed_total = 0;
+  size_t mismatches = 0;
+  for (const ReplayLine &rl : lines) {
+    recorded_total += rl.recorded_ns;
+    replayed_total += rl.replayed_ns;
+    if (rl.recorded_status != rl.replayed_status) {
+      mismatches++;
+      fprintf(stderr, "status %d, recorded %d: %s", rl.replayed_status,
+              rl.recorded_status, rl.text.c_str());
+    }
+  }
+  fprintf(stderr,
+          "replayed %zu lines in %.3f s (%.0f lines/s)\n"
+          "executor time %.3f ms, recorded %.3f ms (x%.2f)\n"
+          "%zu status mismatches\n",
+          lines.size(), elapsed, elapsed > 0 ? lines.size() / elapsed : 0.0,
+          replayed_total / 1e6, recorded_total / 1e6,
+          recorded_total ? (double) replayed_total / recorded_total : 0.0,
+          mismatches);
+
+  sort(lines.begin(), lines.end(), [](const ReplayLine &a, const ReplayLine &b) {
+    return (int64_t) (a.replayed_ns - a.recorded_ns) >
+           (int64_t) (b.replayed_ns - b.recorded_ns);
+  });
+  for (size_t i = 0; i < lines.size() && i < 5; i++) {
+    const ReplayLine &rl = lines[i];
+    if (rl.replayed_ns <= rl.recorded_ns) break;
+    if (i == 0) fprintf(stderr, "slowest relative to the recording:\n");
+    fprintf(stderr, "  +%.3f ms  %s", (rl.replayed_ns - rl.recorded_ns) / 1e6,
+            rl.text.c_str());
+  }
+  return mismatches || truncated ? EXIT_FAILURE : EXIT_SUCCESS;
+}
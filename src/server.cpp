@@ -0,0 +1,598 @@
+#include <tsh.h>
+#include <server.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+static volatile sig_atomic_t serve_stop = 0;
+static int serve_lsock = -1;
+
+/**
+ * @brief SIGINT/SIGTERM handler: shutting the listening socket down wakes
+ * accept() whichever thread the signal landed on.
+ */
+static void on_stop(int) {
+  serve_stop = 1;
+  shutdown(serve_lsock, SHUT_RDWR);
+}
+
+/**
+ * @brief Writes an iovec array out completely. On a socket the first call is
+ * a sendmsg() that carries nfds descriptors and MSG_NOSIGNAL keeps a vanished
+ * client from killing the daemon without having to ignore SIGPIPE, which
+ * children would inherit. Anything else (the --batch stdout) gets writev().
+ *
+ * @return true on success.
+ */
+static bool send_iov(int fd, bool sock, struct iovec *iov, int iovcnt,
+                     const int *fds, int nfds) {
+  char cbuf[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+
+  if (nfds > 0) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+  }
+
+  while (iovcnt > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    ssize_t n = sock ? sendmsg(fd, &msg, MSG_NOSIGNAL) : writev(fd, iov, iovcnt);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return false;
+    // the descriptors went with the first byte; the rest is plain stream data
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief read() exactly len bytes.
+ *
+ * @return true on success, false on EOF or error.
+ */
+static bool read_full(int fd, void *buf, size_t len) {
+  char *p = (char *) buf;
+  while (len) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Sends one frame, optionally attaching nfds descriptors to its header.
+ */
+static bool send_frame(int fd, bool sock, uint32_t type, const void *payload,
+                       uint32_t len, const int *fds, int nfds) {
+  FrameHeader hdr = {type, len};
+  struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void *) payload, len}};
+  return send_iov(fd, sock, iov, len ? 2 : 1, fds, nfds);
+}
+
+/**
+ * @brief Receives a frame header and any descriptors attached to it. Received
+ * descriptors are close-on-exec; they only reach a child through dup2().
+ *
+ * @param fds receives up to 3 descriptors.
+ * @param nfds receives how many were attached.
+ * @return true if a whole header was read.
+ */
+static bool recv_header(int fd, bool sock, FrameHeader *hdr, int *fds,
+                        int *nfds) {
+  *nfds = 0;
+  if (!sock) return read_full(fd, hdr, sizeof(*hdr));
+
+  char cbuf[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {hdr, sizeof(*hdr)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  ssize_t n;
+  while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+  if (n <= 0) return false;
+
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+    int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int *data = (int *) CMSG_DATA(cm);
+    for (int k = 0; k < count; k++) {
+      if (*nfds < 3) fds[(*nfds)++] = data[k];
+      else close(data[k]);
+    }
+  }
+
+  return (size_t) n == sizeof(*hdr) ||
+         read_full(fd, (char *) hdr + n, sizeof(*hdr) - n);
+}
+
+/**
+ * @brief Kills batch lines that outlive their timeout. Each concurrent batch
+ * worker owns one slot; the process group of whatever pipeline the slot's
+ * line is running gets SIGKILL once the deadline passes.
+ */
+class Watchdog {
+ public:
+  Watchdog(size_t nslots, uint32_t timeout_ms)
+      : slots(nslots), timeout(timeout_ms), stop(false) {
+    thr = thread([this] { loop(); });
+  }
+
+  ~Watchdog() {
+    {
+      lock_guard<mutex> lock(mtx);
+      stop = true;
+    }
+    cv.notify_one();
+    thr.join();
+  }
+
+  void arm(size_t k) {
+    lock_guard<mutex> lock(mtx);
+    slots[k].armed = true;
+    slots[k].fired = false;
+    slots[k].pgid = 0;
+    slots[k].deadline = chrono::steady_clock::now() + timeout;
+    cv.notify_one();
+  }
+
+  void set_pgrp(size_t k, pid_t pgid) {
+    lock_guard<mutex> lock(mtx);
+    slots[k].pgid = pgid;
+    if (slots[k].fired) kill(-pgid, SIGKILL);
+  }
+
+  /**
+   * @return true if the line ran out of time.
+   */
+  bool disarm(size_t k) {
+    lock_guard<mutex> lock(mtx);
+    slots[k].armed = false;
+    return slots[k].fired;
+  }
+
+ private:
+  struct Slot {
+    bool armed = false;
+    bool fired = false;
+    pid_t pgid = 0;
+    chrono::steady_clock::time_point deadline;
+  };
+
+  void loop() {
+    unique_lock<mutex> lock(mtx);
+    while (!stop) {
+      auto now = chrono::steady_clock::now();
+      auto next = chrono::steady_clock::time_point::max();
+      for (Slot &s : slots) {
+        if (!s.armed || s.fired) continue;
+        if (s.deadline <= now) {
+          s.fired = true;
+          if (s.pgid > 0) kill(-s.pgid, SIGKILL);
+        } else if (s.deadline < next) {
+          next = s.deadline;
+        }
+      }
+      if (next == chrono::steady_clock::time_point::max()) cv.wait(lock);
+      else cv.wait_until(lock, next);
+    }
+  }
+
+  vector<Slot> slots;
+  chrono::milliseconds timeout;
+  bool stop;
+  mutex mtx;
+  condition_variable cv;
+  thread thr;
+};
+
+/**
+ * @brief Reads the whole of a capture memfd, up to max bytes.
+ */
+static string slurp(int fd, size_t max) {
+  struct stat st;
+  string out;
+  if (fstat(fd, &st) < 0) return out;
+  out.resize(min((size_t) st.st_size, max));
+  ssize_t n = pread(fd, &out[0], out.size(), 0);
+  out.resize(n > 0 ? n : 0);
+  return out;
+}
+
+/**
+ * @brief Runs one FRAME_BATCH: its lines are handed out to up to
+ * opts.concurrency threads, each going through parse_input/run_commands,
+ * and every result is written back as soon as its line finishes. A line
+ * that would inherit the daemon's own descriptors, as CAPTURE_SESSION does
+ * on a session that never bound any or as a failed memfd_create() would,
+ * fails with EXIT_FAILURE without being run.
+ *
+ * @param out_mtx serialises frames written to out_fd.
+ * @return false if the frame was malformed (including bytes left over after
+ * its count lines) or the client went away.
+ */
+static bool run_batch(int out_fd, bool sock, mutex &out_mtx, char *payload,
+                      uint32_t len, ExecContext &bound) {
+  BatchOptions opts;
+  if (len < sizeof(opts)) return false;
+  memcpy(&opts, payload, sizeof(opts));
+
+  vector<pair<const char *, uint32_t>> lines;
+  lines.reserve(min(opts.count, len / (uint32_t) sizeof(uint32_t)));
+  uint32_t off = sizeof(opts);
+  for (uint32_t k = 0; k < opts.count; k++) {
+    uint32_t line_len;
+    if (len - off < sizeof(line_len)) return false;
+    memcpy(&line_len, payload + off, sizeof(line_len));
+    off += sizeof(line_len);
+    if (len - off < line_len) return false;
+    lines.push_back({payload + off, line_len});
+    off += line_len;
+  }
+  if (off != len) return false;  // more than count lines' worth
+
+  int devnull = -1;
+  if (opts.capture == CAPTURE_DISCARD)
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+  size_t nthreads = max(1u, min(opts.concurrency, (uint32_t) BATCH_MAX_CONCURRENCY));
+  nthreads = min(nthreads, max((size_t) 1, lines.size()));
+  unique_ptr<Watchdog> watchdog;
+  if (opts.timeout_ms) watchdog.reset(new Watchdog(nthreads, opts.timeout_ms));
+
+  atomic<size_t> next(0);
+  atomic<uint32_t> sent(0);
+  atomic<bool> broken(false);
+
+  auto worker = [&](size_t slot) {
+    CommandLine line;
+    size_t idx;
+    while (!broken && (idx = next++) < lines.size()) {
+      ExecContext ctx;
+      ctx.in_fd = bound.in_fd;
+      ctx.out_fd = bound.out_fd;
+      ctx.err_fd = bound.err_fd;
+      int capture[2] = {-1, -1};
+      if (opts.capture == CAPTURE_DISCARD) {
+        ctx.out_fd = ctx.err_fd = devnull;
+      } else if (opts.capture == CAPTURE_OUTPUT) {
+        ctx.out_fd = capture[0] = memfd_create("tsh-stdout", MFD_CLOEXEC);
+        ctx.err_fd = capture[1] = memfd_create("tsh-stderr", MFD_CLOEXEC);
+      }
+      // a descriptor of -1 would inherit the daemon's own, which under
+      // --batch is the frame stream: such a line fails without running
+      bool unwired = ctx.out_fd < 0 || ctx.err_fd < 0;
+
+      auto start = chrono::steady_clock::now();
+      if (unwired) {
+        ctx.status = EXIT_FAILURE;
+      } else {
+        if (watchdog) {
+          ctx.own_pgrp = true;
+          ctx.on_pgrp = [&](pid_t pgid) { watchdog->set_pgrp(slot, pgid); };
+          watchdog->arm(slot);
+        }
+        char *input_line = strndup(lines[idx].first, lines[idx].second);
+        parse_input(input_line, line);
+        run_commands(line, &ctx);
+        cleanup(line, input_line);
+      }
+      auto usec = chrono::duration_cast<chrono::microseconds>(
+          chrono::steady_clock::now() - start).count();
+
+      BatchResult res = {(uint32_t) idx, ctx.status, (uint64_t) usec, 0, 0, 0};
+      if (watchdog && !unwired && watchdog->disarm(slot))
+        res.flags |= RESULT_TIMED_OUT;
+
+      string out, err;
+      if (opts.capture == CAPTURE_OUTPUT) {
+        if (unwired) {
+          err = "tsh: cannot capture output\n";
+        } else {
+          out = slurp(capture[0], SERVE_MAX_FRAME / 2);
+          err = slurp(capture[1], SERVE_MAX_FRAME / 2);
+        }
+        for (int fd : capture)
+          if (fd >= 0) close(fd);
+        res.out_len = out.size();
+        res.err_len = err.size();
+      }
+
+      FrameHeader hdr = {FRAME_RESULT,
+                         (uint32_t) (sizeof(res) + out.size() + err.size())};
+      struct iovec iov[4] = {{&hdr, sizeof(hdr)},
+                             {&res, sizeof(res)},
+                             {&out[0], out.size()},
+                             {&err[0], err.size()}};
+      lock_guard<mutex> lock(out_mtx);
+      if (!send_iov(out_fd, sock, iov, 4, NULL, 0)) broken = true;
+      else sent++;
+    }
+  };
+
+  vector<thread> threads;
+  for (size_t k = 1; k < nthreads; k++) threads.emplace_back(worker, k);
+  worker(0);
+  for (thread &t : threads) t.join();
+
+  if (devnull >= 0) close(devnull);
+  uint32_t total = sent;
+  lock_guard<mutex> lock(out_mtx);
+  return !broken &&
+         send_frame(out_fd, sock, FRAME_END, &total, sizeof(total), NULL, 0);
+}
+
+/**
+ * @brief Serves one client stream until it hangs up or runs quit.
+ *
+ * Each FRAME_LINE goes through the same parse_input/run_commands path as the
+ * interactive loop, with the session's descriptors wired in via ExecContext;
+ * each FRAME_BATCH is handed to run_batch. Descriptors received on a socket
+ * replace the session's binding in bound (the old ones are closed); the
+ * caller owns whatever bound holds when this returns.
+ */
+void serve_stream(int in_fd, int out_fd, bool sock, ExecContext &bound) {
+  int *binding[3] = {&bound.in_fd, &bound.out_fd, &bound.err_fd};
+  CommandLine line;
+  mutex out_mtx;
+  bool is_quit = false;
+
+  while (!is_quit) {
+    FrameHeader hdr;
+    int fds[3], nfds;
+    if (!recv_header(in_fd, sock, &hdr, fds, &nfds)) break;
+
+    if (nfds == 3) {
+      for (int k = 0; k < 3; k++) {
+        if (*binding[k] >= 0) close(*binding[k]);
+        *binding[k] = fds[k];
+      }
+    } else {
+      for (int k = 0; k < nfds; k++) close(fds[k]);
+    }
+
+    if ((hdr.type != FRAME_LINE && hdr.type != FRAME_BATCH) ||
+        hdr.len > SERVE_MAX_FRAME)
+      break;
+
+    char *input_line = (char *) malloc(hdr.len + 1);
+    if (!input_line || !read_full(in_fd, input_line, hdr.len)) {
+      free(input_line);
+      break;
+    }
+    input_line[hdr.len] = '\0';
+
+    if (hdr.type == FRAME_BATCH) {
+      bool ok = run_batch(out_fd, sock, out_mtx, input_line, hdr.len, bound);
+      free(input_line);
+      if (!ok) break;
+      continue;
+    }
+
+    int32_t status;
+    if (bound.out_fd < 0) {
+      // never bound: refuse rather than spray output over the daemon's tty
+      status = EXIT_FAILURE;
+    } else {
+      ExecContext ctx = bound;
+      parse_input(input_line, line);
+      is_quit = run_commands(line, &ctx);
+      status = ctx.status;
+    }
+    cleanup(line, input_line);
+
+    if (!send_frame(out_fd, sock, FRAME_STATUS, &status, sizeof(status), NULL,
+                    0))
+      break;
+  }
+}
+
+/**
+ * @brief Serves one socket connection; the session owns what it was bound to.
+ */
+static void serve_session(int conn) {
+  ExecContext bound;
+  serve_stream(conn, conn, true, bound);
+  if (bound.in_fd >= 0) close(bound.in_fd);
+  if (bound.out_fd >= 0) close(bound.out_fd);
+  if (bound.err_fd >= 0) close(bound.err_fd);
+  close(conn);
+}
+
+/**
+ * @brief tsh_app --batch: the frame protocol over stdin/stdout. Children get
+ * /dev/null for stdin and the shell's stderr for both outputs, since stdout
+ * carries the replies.
+ *
+ * @return int
+ */
+int serve_stdio() {
+  ExecContext bound;
+  bound.in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  bound.out_fd = STDERR_FILENO;
+  bound.err_fd = STDERR_FILENO;
+  serve_stream(STDIN_FILENO, STDOUT_FILENO, false, bound);
+  close(bound.in_fd);
+  return 0;
+}
+
+/**
+ * @brief Bounded hand-off between the accept loop and the worker pool. When
+ * every worker is busy and the queue is full, accept() stops being called and
+ * new clients wait in the listen backlog.
+ */
+class ConnQueue {
+ public:
+  explicit ConnQueue(size_t cap) : cap(cap) {}
+
+  void push(int conn) {
+    unique_lock<mutex> lock(mtx);
+    not_full.wait(lock, [this] { return conns.size() < cap; });
+    conns.push_back(conn);
+    not_empty.notify_one();
+  }
+
+  int pop() {
+    unique_lock<mutex> lock(mtx);
+    not_empty.wait(lock, [this] { return !conns.empty(); });
+    int conn = conns.front();
+    conns.pop_front();
+    not_full.notify_one();
+    return conn;
+  }
+
+ private:
+  size_t cap;
+  deque<int> conns;
+  mutex mtx;
+  condition_variable not_empty;
+  condition_variable not_full;
+};
+
+/**
+ * @brief Runs tsh as a daemon on a Unix socket.
+ *
+ * The process stays warm between jobs, so clients skip the exec, dynamic
+ * linking and startup of a fresh shell. Connections are served by a fixed
+ * pool of worker threads; each session runs its lines in order.
+ *
+ * @param sock_path filesystem path of the socket; a stale one is replaced.
+ * @param workers size of the worker pool (at least 1).
+ * @return int exit status for main(): 0 after SIGINT/SIGTERM, 1 on setup
+ * failure.
+ */
+int serve(const char *sock_path, int workers) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "tsh: socket path too long: %s\n", sock_path);
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, sock_path);
+
+  int lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lsock < 0) {
+    perror("socket failed");
+    return EXIT_FAILURE;
+  }
+  unlink(sock_path);
+  if (bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(lsock, SOMAXCONN) < 0) {
+    perror("bind failed");
+    close(lsock);
+    return EXIT_FAILURE;
+  }
+
+  serve_lsock = lsock;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (workers < 1) workers = 1;
+  // outlives serve(): the detached workers may still be parked on it
+  ConnQueue *queue = new ConnQueue(workers * 4);
+  for (int k = 0; k < workers; k++) {
+    thread([queue] {
+      for (;;) serve_session(queue->pop());
+    }).detach();
+  }
+
+  while (!serve_stop) {
+    int conn = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (serve_stop) break;
+      if (errno != EINTR && errno != ECONNABORTED) perror("accept failed");
+      continue;
+    }
+    queue->push(conn);
+  }
+
+  close(lsock);
+  unlink(sock_path);
+  return 0;
+}
+
+/**
+ * @brief Client side of --serve: reads lines from stdin like run() does and
+ * submits each to the daemon, binding this process's stdin, stdout and stderr
+ * to the session on the first request.
+ *
+ * @return int the status of the last line, or 1 if the daemon is unreachable.
+ */
+int submit(const char *sock_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("connect failed");
+    if (sock >= 0) close(sock);
+    return EXIT_FAILURE;
+  }
+
+  int std_fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  int nfds = 3;
+  int32_t status = 0;
+  char *input_line;
+
+  while ((input_line = read_input())) {
+    uint32_t len = strlen(input_line);
+    bool ok = send_frame(sock, true, FRAME_LINE, input_line, len, std_fds, nfds);
+    free(input_line);
+    nfds = 0;
+
+    FrameHeader hdr;
+    int fds[3], got;
+    if (!ok || !recv_header(sock, true, &hdr, fds, &got) ||
+        hdr.type != FRAME_STATUS || hdr.len != sizeof(status) ||
+        !read_full(sock, &status, sizeof(status))) {
+      break;
+    }
+  }
+
+  close(sock);
+  return status;
+}
@@ -0,0 +1,112 @@
+#include <tsh.h>
+#include <stats.h>
+#include <reaper.h>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+ShellStats stats;
+
+static string dump_path;
+
+/**
+ * @brief Writes every counter to fd, one "name value  # description" line
+ * each, or as a single JSON object. Reaper counters are included when
+ * --subreaper is on.
+ */
+void stats_print(int fd, bool json) {
+  string out;
+  char buf[256];
+  const char *sep = "";
+  out += json ? "{" : "";
+
+#define TSH_STAT_PRINT(name, desc)                                          \
+  if (json) snprintf(buf, sizeof(buf), "%s\"%s\":%lu", sep, #name,          \
+                     (unsigned long) stats.name.load(memory_order_relaxed)); \
+  else snprintf(buf, sizeof(buf), "%-18s %12lu  # %s\n", #name,             \
+                (unsigned long) stats.name.load(memory_order_relaxed), desc); \
+  out += buf;                                                               \
+  sep = ",";
+  TSH_STATS(TSH_STAT_PRINT)
+#undef TSH_STAT_PRINT
+
+  if (reaper_enabled()) {
+    ReaperStats r = reaper_stats();
+    if (json) {
+      snprintf(buf, sizeof(buf),
+               ",\"orphans_reaped\":%lu,\"owned_reaped\":%lu,"
+               "\"reaper_batches\":%lu",
+               (unsigned long) r.orphans_reaped, (unsigned long) r.owned_reaped,
+               (unsigned long) r.batches);
+    } else {
+      snprintf(buf, sizeof(buf),
+               "%-18s %12lu  # %s\n%-18s %12lu  # %s\n%-18s %12lu  # %s\n",
+               "orphans_reaped", (unsigned long) r.orphans_reaped,
+               "orphans collected by the subreaper", "owned_reaped",
+               (unsigned long) r.owned_reaped,
+               "executor children it collected first", "reaper_batches",
+               (unsigned long) r.batches, "subreaper passes that reaped");
+    }
+    out += buf;
+  }
+
+  out += json ? "}\n" : "";
+  if (write(fd, out.data(), out.size()) < 0) {}
+}
+
+/**
+ * @brief Replaces the dump file with the current counters in JSON; written
+ * to a temporary and renamed so readers never see half a document.
+ */
+static void stats_dump() {
+  string tmp = dump_path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return;
+  stats_print(fd, true);
+  close(fd);
+  rename(tmp.c_str(), dump_path.c_str());
+}
+
+static void stats_dump_at_exit() { stats_dump(); }
+
+/**
+ * @brief Dumps the counters to path every interval_sec seconds (if non-zero)
+ * from a background thread, and once more at exit.
+ *
+ * @return false if path cannot be written.
+ */
+bool stats_dump_start(const char *path, unsigned interval_sec) {
+  dump_path = path;
+  int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  close(fd);
+
+  atexit(stats_dump_at_exit);
+  if (interval_sec) {
+    thread([interval_sec] {
+      for (;;) {
+        sleep(interval_sec);
+        stats_dump();
+      }
+    }).detach();
+  }
+  return true;
+}
+
+/**
+ * @brief tsh-stats [-j] — prints the runtime counters, -j for JSON.
+ */
+int stats_builtin(Process *p, int out_fd, int err_fd) {
+  const char *arg = p->cmdTokens[1];
+  bool json = arg && (strcmp(arg, "-j") == 0 || strcmp(arg, "--json") == 0);
+  if (arg && !json) {
+    dprintf(err_fd, "usage: tsh-stats [-j]\n");
+    return 2;
+  }
+  stats_print(out_fd, json);
+  return 0;
+}
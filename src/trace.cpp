@@ -0,0 +1,228 @@
+#include <tsh.h>
+#include <trace.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+atomic<bool> trace_enabled(false);
+
+struct TraceEvent {
+  const char *name;
+  uint64_t start_ns;
+  uint64_t dur_ns;
+  pid_t track;  // a child's pid, or the recording thread's tid
+  char detail[36];
+};
+
+/**
+ * @brief One thread's events. Only the owner writes; head is published with
+ * release order so the exit-time dump sees whole events, and writing is set
+ * around each event so the dump can wait out one in progress.
+ */
+struct TraceRing {
+  TraceEvent ev[TRACE_RING_SIZE];
+  atomic<uint64_t> head{0};
+  atomic<bool> writing{false};
+};
+
+static mutex rings_mtx;
+static vector<TraceRing *> rings;       // every ring, kept for the dump
+static vector<TraceRing *> free_rings;  // rings of threads that have exited
+static string trace_path;
+static bool flushed = false;
+
+/**
+ * @brief The calling thread's claim on a ring; gives it back on thread exit
+ * so the next new thread reuses it instead of allocating another.
+ */
+struct RingHolder {
+  TraceRing *ring = nullptr;
+  ~RingHolder() {
+    if (!ring) return;
+    lock_guard<mutex> lock(rings_mtx);
+    free_rings.push_back(ring);
+  }
+};
+
+static thread_local RingHolder my_ring;
+static thread_local pid_t my_tid = 0;
+
+/**
+ * @brief Monotonic clock in nanoseconds (a vDSO call, no syscall).
+ */
+uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Claims a ring for the calling thread, reusing one an exited thread
+ * gave back; runs once per thread. A reused ring keeps its older events,
+ * which carry their own thread ids.
+ */
+static TraceRing *ring() {
+  if (!my_ring.ring) {
+    my_tid = syscall(SYS_gettid);
+    lock_guard<mutex> lock(rings_mtx);
+    if (!free_rings.empty()) {
+      my_ring.ring = free_rings.back();
+      free_rings.pop_back();
+    } else {
+      my_ring.ring = new TraceRing();
+      rings.push_back(my_ring.ring);
+    }
+  }
+  return my_ring.ring;
+}
+
+/**
+ * @brief Records one complete event on the calling thread's ring.
+ *
+ * @param detail optional text shown as the event's "detail" arg; copied.
+ * @param track a child pid to draw the event on that child's track instead
+ * of the thread's.
+ */
+void trace_event(const char *name, uint64_t start_ns, uint64_t end_ns,
+                 const char *detail, pid_t track) {
+  if (!trace_on()) return;
+  TraceRing *r = ring();
+  // pairs with trace_flush(): it either sees writing or we see it stopped
+  r->writing.store(true);
+  if (!trace_enabled.load()) {
+    r->writing.store(false, memory_order_release);
+    return;
+  }
+  uint64_t h = r->head.load(memory_order_relaxed);
+  TraceEvent &e = r->ev[h & (TRACE_RING_SIZE - 1)];
+  e.name = name;
+  e.start_ns = start_ns;
+  e.dur_ns = end_ns - start_ns;
+  e.track = track ? track : my_tid;
+  if (detail) {
+    strncpy(e.detail, detail, sizeof(e.detail) - 1);
+    e.detail[sizeof(e.detail) - 1] = '\0';
+  } else {
+    e.detail[0] = '\0';
+  }
+  r->head.store(h + 1, memory_order_release);
+  r->writing.store(false, memory_order_release);
+}
+
+/**
+ * @brief Writes every ring to the trace file as a Chrome trace-event JSON
+ * document. Runs once, at exit; recording stops first, and an event another
+ * thread is part way through recording is waited for, not read torn.
+ */
+void trace_flush() {
+  lock_guard<mutex> lock(rings_mtx);
+  if (flushed || trace_path.empty()) return;
+  flushed = true;
+  trace_enabled = false;
+  for (TraceRing *r : rings)
+    while (r->writing.load(memory_order_acquire)) this_thread::yield();
+
+  FILE *f = fopen(trace_path.c_str(), "w");
+  if (!f) {
+    perror("trace");
+    return;
+  }
+
+  pid_t pid = getpid();
+  string buf;
+  bool first = true;
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", f);
+  for (TraceRing *r : rings) {
+    uint64_t head = r->head.load(memory_order_acquire);
+    uint64_t from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (uint64_t k = from; k < head; k++) {
+      const TraceEvent &e = r->ev[k & (TRACE_RING_SIZE - 1)];
+      buf.clear();
+      buf += first ? "{\"name\":\"" : ",\n{\"name\":\"";
+      json_escape(buf, e.name);
+      char nums[160];
+      snprintf(nums, sizeof(nums),
+               "\",\"cat\":\"tsh\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+               "\"pid\":%d,\"tid\":%d",
+               e.start_ns / 1000.0, e.dur_ns / 1000.0, pid, e.track);
+      buf += nums;
+      if (e.detail[0]) {
+        buf += ",\"args\":{\"detail\":\"";
+        json_escape(buf, e.detail);
+        buf += "\"}";
+      }
+      buf += '}';
+      fputs(buf.c_str(), f);
+      first = false;
+    }
+  }
+  fputs("\n]}\n", f);
+  fclose(f);
+}
+
+static void flush_at_exit() { trace_flush(); }
+
+/**
+ * @brief Sets the file the trace is written to at exit and starts recording.
+ *
+ * @return false if path cannot be created.
+ */
+bool trace_open(const char *path) {
+  FILE *probe = fopen(path, "w");
+  if (!probe) {
+    perror(path);
+    return false;
+  }
+  fclose(probe);
+
+  lock_guard<mutex> lock(rings_mtx);
+  if (trace_path.empty()) atexit(flush_at_exit);
+  trace_path = path;
+  trace_enabled = true;
+  return true;
+}
+
+/**
+ * @brief Pauses or resumes recording; the first "on" without a file traces
+ * to tsh-trace.json.
+ */
+void trace_set(bool on) {
+  if (on) {
+    bool opened;
+    {
+      lock_guard<mutex> lock(rings_mtx);
+      opened = !trace_path.empty();
+    }
+    if (!opened) {
+      trace_open("tsh-trace.json");
+      return;
+    }
+  }
+  trace_enabled = on;
+}
+
+/**
+ * @brief trace on [FILE] | trace off — the in-shell switch for tracing.
+ */
+int trace_builtin(Process *p, int out_fd, int err_fd) {
+  const char *arg = p->cmdTokens[1];
+  if (arg && strcmp(arg, "on") == 0) {
+    if (p->cmdTokens[2]) return trace_open(p->cmdTokens[2]) ? 0 : 1;
+    trace_set(true);
+    return 0;
+  }
+  if (arg && strcmp(arg, "off") == 0) {
+    trace_set(false);
+    return 0;
+  }
+  if (arg) {
+    dprintf(err_fd, "usage: trace [on [FILE] | off]\n");
+    return 2;
+  }
+  dprintf(out_fd, "trace: %s\n", trace_on() ? "on" : "off");
+  return 0;
+}
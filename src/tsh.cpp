@@ -1,5 +1,21 @@
 
 #include <tsh.h>
+#include <audit.h>
+#include <editor.h>
+#include <filecomplete.h>
+#include <history.h>
+#include <intern.h>
+#include <jumpdb.h>
+#include <pathindex.h>
+#include <prompt.h>
+#include <reaper.h>
+#include <latency.h>
+#include <record.h>
+#include <stats.h>
+#include <trace.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <unordered_map>
 
 using namespace std;
 
@@ -19,18 +35,15 @@ void display_prompt() { cout << "$ " << flush; }
 /**
  * @brief Cleans up allocated resources to prevent memory leaks.
  *
- * This function deletes all elements in the provided list of Process objects,
- * clears the list, and frees the memory allocated for the input line.
+ * This function empties the command line for reuse and frees the memory
+ * allocated for the input line its tokens point into.
  *
- * @param process_list A pointer to a list of Process pointers to be cleaned up.
+ * @param line The parsed command line to be cleared.
  * @param input_line A pointer to the dynamically allocated memory for user
  * input. This memory is freed to avoid memory leaks.
  */
-void cleanup(list<Process *> &process_list, char *input_line) {
-  for (Process *p : process_list) {
-    delete p;
-  }
-  process_list.clear();
+void cleanup(CommandLine &line, char *input_line) {
+  line.clear();
   free(input_line);
   input_line = nullptr;
 }
@@ -53,19 +66,58 @@ void cleanup(list<Process *> &process_list, char *input_line) {
  *   6. Breaking out of the loop if the user enters the quit command.
  *   7. Continuously prompting the user for new commands until an exit condition
  * is met.
+ * Under --record, each line and its status also go to the session log.
+ * When stdin and stdout are terminals, lines are read with the LineEditor
+ * instead, which draws the prompt itself, and kept in the shared history;
+ * the directories cd enters go to the database z jumps from (jumpdb.h).
+ * $PATH is indexed in the background meanwhile (see pathindex.h), and the
+ * prompt is expanded from $TSH_PROMPT (see prompt.h); a script does without
+ * both and leaves PATH lookups to execvp(). The lines of a
+ * multi-line paste run one after another with no prompt in between.
  */
 void run() {
-  list<Process *> process_list;
+  CommandLine line;
   char *input_line;
   bool is_quit = false;
+  bool recording = record_on();
+  ExecContext ctx;
+  ctx.shell_state = true;
+  bool interactive = isatty(fileno(stdin)) && isatty(STDOUT_FILENO);
+  LineEditor editor(fileno(stdin), STDOUT_FILENO);
+  History history;
+  if (interactive && history_path() && history.open(history_path())) {
+    shell_history = &history;
+    editor.set_history(&history);
+  }
+  JumpDb jumps;
+  if (interactive && jump_db_path() && jumps.open(jump_db_path()))
+    shell_jumps = &jumps;
+  if (interactive) path_index_start(builtin_names());
+
+  PromptEngine prompts(interactive ? getenv("TSH_PROMPT") : nullptr);
+  editor.set_prompt_engine(&prompts);
 
   while (!is_quit) {
-    display_prompt();
-    if (!(input_line = read_input())) break;
-    parse_input(input_line, process_list);
-    is_quit = run_commands(process_list);
-    cleanup(process_list, input_line);
+    if (interactive) {
+      if (!editor.pasting()) prompts.begin();
+      if (!(input_line = editor.read_line(prompts.text().c_str()))) break;
+      history.add(input_line, strlen(input_line) - 1);
+    } else {
+      display_prompt();
+      if (!(input_line = read_input())) break;
+    }
+    if (recording) record_input(input_line);
+    parse_input(input_line, line);
+    uint64_t started = trace_now();
+    is_quit = run_commands(line, &ctx);
+    prompts.finished(ctx.status, trace_now() - started);
+    if (recording) record_status(ctx.status);
+    cleanup(line, input_line);
   } 
+  shell_history = nullptr;
+  shell_jumps = nullptr;
+  path_index_stop();
+  file_complete_stop();
 }
 
 /**
@@ -82,8 +134,11 @@ void run() {
  * string. The caller is responsible for freeing this memory when it is no
  * longer needed. If an error occurs or EOF is reached during input, the
  * function returns NULL.
+ *
+ * @note Each line is a fresh allocation.
  */
 char *read_input() {
+  TraceSpan span("read_input");
   char *input = NULL;
   char tempbuf[MAX_LINE];
   size_t inputlen = 0, templen = 0;
@@ -98,11 +153,17 @@ char *read_input() {
     input = tempinput;
     strcpy(input + inputlen, tempbuf);
     if (tempbuf[templen - 1] == '\n') {
+      stat_add(stats.lines_read);
+      stat_add(stats.bytes_read, inputlen + templen);
       return input;
     }
     inputlen += templen;
   }
 
+  if (input) {
+    stat_add(stats.lines_read);
+    stat_add(stats.bytes_read, inputlen);
+  }
   return input;
 }
 
@@ -111,37 +172,40 @@ char *read_input() {
  * removes the new line char of the end in cmd. 
  */
 void senetize(char *cmd) {
-  char* tail = cmd + strlen(cmd) - 1;
-  if (*tail == '\n') *tail = '\0';
+  size_t len = strlen(cmd);
+  if (len && cmd[len - 1] == '\n') cmd[len - 1] = '\0';
 }
 
 
 /**
- * @brief Parses the given command string and populates a list of Process objects.
+ * @brief Parses the given command string and populates a CommandLine.
  *
- * This function takes a command string and a reference to a list of Process
- * pointers. It tokenizes the command based on the delimiters "|; " and creates
- * a new Process object for each token. The created Process objects are added to
- * the provided process_list. Additionally, it sets pipe flags for each Process
+ * This function takes a command string and a reference to a CommandLine. It
+ * tokenizes the command based on the delimiters "|; " and appends a Process
+ * stage for each command. Additionally, it sets pipe flags for each Process
  * based on the presence of pipe delimiters '|' in the original command string.
  *
- * @param cmd The command string to be parsed.
- * @param process_list A reference to a list of Process pointers where the
- * created Process objects will be stored.
+ * The string is tokenized in place, so the tokens live exactly as long as cmd
+ * and go away with it in cleanup(). A dangling '|' at the end of the line is
+ * dropped rather than leaving a pipe nobody reads and a child nobody waits
+ * for.
+ *
+ * @param cmd The command string to be parsed; modified.
+ * @param line The command line the parsed stages are appended to.
  */
 
 bool is_delim(char c) {
   return (c == ' ' || c == ';' || c == '|' || c == '\0');
 }
 
-void parse_input(char *cmd, list<Process *> &process_list) {
+void parse_input(char *cmd, CommandLine &line) {
+  TraceSpan span("parse_input");
   int pipe_in_val = 0;
-  Process *currProcess = nullptr;
 
-  list<char*> curr_tokens;
+  char *curr_tokens[MAX_ARGS];  // words past MAX_ARGS are dropped, as in add_token
+  int ntokens = 0;
   char *curr_tok = NULL;
-  char *curr_char = (char*) malloc(strlen(cmd) + 1);
-  strcpy(curr_char, cmd);
+  char *curr_char = cmd;
   senetize(curr_char);
 
   bool stop = false;
@@ -151,17 +215,17 @@ void parse_input(char *cmd, list<Process *> &process_list) {
       char delim = *curr_char;
       if (curr_tok) {
         *curr_char = '\0';
-        curr_tokens.push_back(curr_tok);
+        if (ntokens < MAX_ARGS) curr_tokens[ntokens++] = curr_tok;
         curr_tok = NULL;
+        stat_add(stats.tokens_parsed);
       }
 
-      if (delim != ' ' && !curr_tokens.empty()) {
+      if (delim != ' ' && ntokens) {
         int pipe_out_val = delim == '|' ? 1 : 0;
-        currProcess = new Process(pipe_in_val, pipe_out_val);
+        Process &stage = line.add(pipe_in_val, pipe_out_val);
         pipe_in_val = pipe_out_val;
-        for (char *token : curr_tokens) currProcess->add_token(token);
-        curr_tokens.clear();
-        process_list.push_back(currProcess);
+        for (int k = 0; k < ntokens; k++) stage.add_token(curr_tokens[k]);
+        ntokens = 0;
       }
     } else if (!curr_tok) {
       curr_tok = curr_char;
@@ -170,20 +234,296 @@ void parse_input(char *cmd, list<Process *> &process_list) {
     if (stop) break;
     curr_char++;
   }
+
+  if (!line.empty()) line.back().pipe_out = false;
 }
 
+static const char *quit_word = intern("quit");
+
 /**
  * @brief Check if the given command represents a quit request.
  *
  * This function compares the first token of the provided command with the
- * string "quit" to determine if the command is a quit request.
+ * string "quit" to determine if the command is a quit request. "quit" is
+ * interned, so add_token gave the word its interned copy and this is a
+ * pointer compare.
  *
  * @param p A pointer to a Process structure representing the command.
  *
  * @return A boolean indicating whether the command is a quit request (the first token is "quit").
  */
 bool isQuit(Process *p) {
-  return strcmp(p->cmdTokens[0], "quit") == 0;
+  return p->cmdTokens[0] == quit_word;
+}
+
+/**
+ * @brief Folds a raw waitpid() status into a shell exit status: the exit code
+ * for a normal exit, 128 + signal number for a killed child.
+ *
+ * @param raw_status status as filled in by waitpid().
+ * @return int
+ */
+int wait_status(int raw_status) {
+  if (WIFEXITED(raw_status)) return WEXITSTATUS(raw_status);
+  if (WIFSIGNALED(raw_status)) return 128 + WTERMSIG(raw_status);
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief Per-stage bookkeeping of one run_commands call, indexed by stage;
+ * points into the CommandLine's flat arrays.
+ */
+struct StageTable {
+  pid_t *pids;
+  Process *procs;
+  uint64_t *spawn_ns;  // just before fork
+  uint64_t *exec_ns;   // exec observed; 0 if the stage never exec'd
+  int *raw_status;
+  char *reaped;        // collected, by wait_stages or early by reap_exited
+  size_t base;         // index of stage 0 in ctx->stages
+};
+
+/* stages a pipeline may start before the executor looks for exited ones */
+#define REAP_WINDOW 64
+#define SUGGESTIONS 3  // commands named when one is not found
+
+/**
+ * @brief A trace_now() reading as a steady_clock time point; both are
+ * CLOCK_MONOTONIC.
+ */
+static chrono::steady_clock::time_point steady_at(uint64_t ns) {
+  return chrono::steady_clock::time_point(chrono::nanoseconds(ns));
+}
+
+/**
+ * @brief Records what became of stage k once it has been waited for: its
+ * status, latency, audit record, trace span and stage result.
+ */
+static void finish_stage(StageTable &st, int k, int raw,
+                         const struct rusage &usage, uint64_t reaped,
+                         bool collected, ExecContext *ctx) {
+  const char *cmd = st.procs[k].cmdTokens[0];
+  if (collected) stat_add(stats.children_reaped);
+  st.raw_status[k] = raw;
+  st.reaped[k] = 1;
+
+  if (st.exec_ns[k]) latency_exec_exit(cmd, reaped - st.exec_ns[k]);
+  if (audit_on()) {
+    audit_command(st.procs[k].cmdTokens, st.pids[k], wait_status(raw),
+                  st.spawn_ns[k], reaped);
+  }
+  if (trace_on()) trace_event("child", st.spawn_ns[k], reaped, cmd, st.pids[k]);
+  if (ctx->stages) {
+    StageResult &rec = (*ctx->stages)[st.base + k];
+    rec.status = wait_status(raw);
+    rec.end = steady_at(reaped);
+    rec.cpu = chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+              chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+  }
+}
+
+/**
+ * @brief Waits for stages from..to of one pipeline and records the status of
+ * the last one in ctx, plus the stage results, latencies and trace spans.
+ * Stages already collected by reap_exited are not waited for again.
+ */
+static void wait_stages(StageTable &st, int from, int to, ExecContext *ctx) {
+  if (from > to) return;
+  bool traced = trace_on();
+  for (int k = from; k <= to; k++) {
+    if (st.reaped[k]) continue;
+    int raw = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    uint64_t wait_start = trace_now();
+    bool collected = child_wait(st.pids[k], &raw, &usage) > 0;
+    uint64_t reaped = trace_now();
+    if (traced) trace_event("wait", wait_start, reaped, st.procs[k].cmdTokens[0]);
+    finish_stage(st, k, raw, usage, reaped, collected, ctx);
+  }
+  ctx->status = wait_status(st.raw_status[to]);
+  latency_pipeline(trace_now() - st.spawn_ns[from]);
+}
+
+/**
+ * @brief Collects whichever of stages first_live..to have already exited,
+ * without blocking, so a long pipeline does not pile up zombies (and run
+ * out of pids) while its later stages are still being started. first_live
+ * is advanced past the stages that are done.
+ *
+ * @return int how many of the stages are still running.
+ */
+static int reap_exited(StageTable &st, int &first_live, int to,
+                       ExecContext *ctx) {
+  int live = 0;
+  for (int k = first_live; k <= to; k++) {
+    if (st.reaped[k]) continue;
+    int raw = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    if (child_try_wait(st.pids[k], &raw, &usage) > 0) {
+      finish_stage(st, k, raw, usage, trace_now(), true, ctx);
+    } else {
+      live++;
+    }
+  }
+  while (first_live <= to && st.reaped[first_live]) first_live++;
+  return live;
+}
+
+/**
+ * @brief ":" — the POSIX null command; does nothing, successfully.
+ */
+static int noop_builtin(Process *, int, int) { return 0; }
+
+/**
+ * @brief Moves the shell to dir, keeping $PWD and $OLDPWD, and records the
+ * visit for z.
+ *
+ * @return int 0, or 1 (with a message on err_fd) if dir cannot be entered.
+ */
+int change_dir(const char *dir, int err_fd) {
+  char old[PATH_MAX], cwd[PATH_MAX];
+  bool had_old = getcwd(old, sizeof(old)) != NULL;
+  if (chdir(dir) < 0) {
+    dprintf(err_fd, "cd: %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  if (had_old) setenv("OLDPWD", old, 1);
+  if (getcwd(cwd, sizeof(cwd))) {
+    setenv("PWD", cwd, 1);
+    if (shell_jumps) shell_jumps->visit(cwd, time(NULL));
+  }
+  return 0;
+}
+
+/**
+ * @brief cd [DIR] — to DIR, else $HOME; "cd -" goes back to $OLDPWD and
+ * prints it.
+ */
+static int cd_builtin(Process *p, int out_fd, int err_fd) {
+  const char *dir = p->cmdTokens[1];
+  bool back = dir && !strcmp(dir, "-");
+  if (!dir || back) dir = getenv(back ? "OLDPWD" : "HOME");
+  if (!dir) {
+    dprintf(err_fd, "cd: %s not set\n", back ? "OLDPWD" : "HOME");
+    return 1;
+  }
+  if (back) dprintf(out_fd, "%s\n", dir);
+  return change_dir(dir, err_fd);
+}
+
+/**
+ * @brief The shell's builtins, keyed by interned command word. Each writes to
+ * the descriptors it is given and returns an exit status.
+ */
+static const unordered_map<const char *, Builtin> builtins = {
+    {intern(":"), noop_builtin},
+    {intern("trace"), trace_builtin},
+    {intern("tsh-stats"), stats_builtin},
+    {intern("tsh-latency"), latency_builtin},
+    {intern("history"), history_builtin},
+    {intern("cd"), cd_builtin},
+    {intern("z"), z_builtin},
+};
+
+/**
+ * @brief What a forked child says when its exec fails and it has no probe to
+ * tell the parent through. Past fork() in a threaded process only
+ * async-signal-safe calls are made, so no stdio: one write() from the stack.
+ */
+static void exec_failed_message(const char *name) {
+  static const char prefix[] = "tsh: exec failed: ";
+  char msg[sizeof(prefix) + NAME_MAX + 1];
+  size_t n = sizeof(prefix) - 1;
+  memcpy(msg, prefix, n);
+  for (; *name && n < sizeof(msg) - 1; name++) msg[n++] = *name;
+  msg[n++] = '\n';
+  if (write(STDERR_FILENO, msg, n) < 0) {}
+}
+
+/**
+ * @brief Whether b changes the process's own state (its directory and
+ * environment), which is only the shell's to change: run_commands refuses
+ * these unless ExecContext::shell_state is set.
+ */
+static bool changes_shell(Builtin b) {
+  return b == cd_builtin || b == z_builtin;
+}
+
+/**
+ * @brief Runs cd or z as a pipeline stage, which stands for a subshell: the
+ * shell's directory, $PWD and $OLDPWD are put back afterwards. The visit z
+ * is told of is kept. If the directory cannot be held open to return to,
+ * the stage fails without running.
+ */
+static int run_as_subshell(Builtin b, Process *p, int out_fd, int err_fd) {
+  static const char *const vars[] = {"PWD", "OLDPWD"};
+  string saved[2];
+  bool had[2];
+  for (int k = 0; k < 2; k++) {
+    const char *v = getenv(vars[k]);
+    if ((had[k] = v)) saved[k] = v;
+  }
+  // O_PATH needs no read permission, so an unlistable cwd can still be held
+  int here = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (here < 0) {
+    dprintf(err_fd, "tsh: %s: cannot keep the working directory: %s\n",
+            p->cmdTokens[0], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  int status = b(p, out_fd, err_fd);
+  if (fchdir(here) < 0) perror("cd");
+  close(here);
+  for (int k = 0; k < 2; k++) {
+    if (had[k]) setenv(vars[k], saved[k].c_str(), 1);
+    else unsetenv(vars[k]);
+  }
+  return status;
+}
+
+/**
+ * @brief Looks up a builtin by an interned command word, as found in
+ * cmdTokens[0]: a pointer hash, no string compare.
+ */
+static Builtin lookup_builtin(const char *word) {
+  auto it = builtins.find(word);
+  return it == builtins.end() ? nullptr : it->second;
+}
+
+/**
+ * @brief The builtins' names, for suggestions.
+ */
+vector<string> builtin_names() {
+  vector<string> names;
+  for (auto &b : builtins) names.push_back(b.first);
+  return names;
+}
+
+/**
+ * @brief Says that name is not a command, and which ones it may have been
+ * meant to be.
+ */
+static void command_not_found(const char *name, int err_fd) {
+  vector<string> near;
+  path_suggest(name, near, SUGGESTIONS);
+  string msg = "tsh: command not found: " + string(name) + "\n";
+  if (!near.empty()) {
+    msg += "tsh: did you mean:";
+    for (const string &s : near) msg += " " + s;
+    msg += "?\n";
+  }
+  if (write(err_fd, msg.data(), msg.size()) < 0) {}
+}
+
+/**
+ * @brief Looks up a builtin by name; name need not be interned.
+ *
+ * @return Builtin, or nullptr if name is an external command.
+ */
+Builtin find_builtin(const char *name) {
+  const char *word = intern_find(name);
+  return word ? lookup_builtin(word) : nullptr;
 }
 
 /**
@@ -193,9 +533,12 @@ bool isQuit(Process *p) {
  * connecting their input and output through pipes if needed. It handles forking
  * processes, creating pipes, and waiting for child processes to finish.
  *
- * @param command_list A list of Process pointers representing the commands to
- * execute. Each Process object contains information about the command, such as
- *                     command tokens, pipe settings, and file descriptors.
+ * @param line The parsed command line to execute. Each Process stage contains
+ * information about the command, such as command tokens, pipe settings, and
+ * file descriptors; the executor's per-stage records live alongside.
+ * @param ctx Optional descriptors for the first stage's stdin, the last
+ * stage's stdout and every stage's stderr; receives the exit status of the
+ * last pipeline run. May be null to inherit the shell's own descriptors.
  *
  * @return A boolean indicating whether a quit command was encountered during
  * execution. If true, the execution was terminated prematurely due to a quit
@@ -219,37 +562,182 @@ bool isQuit(Process *p) {
  * between them.
  * - The function exits with an error message if execvp fails to execute the
  * command.
- * - Make sure to properly manage file descriptors, close unused pipes, and wait
- * for child processes.
+ * - Pipes are created close-on-exec so that, when several threads run
+ * pipelines at once (server mode), no child holds another pipeline's pipe
+ * open. dup2() onto stdin/stdout clears the flag where it is needed.
+ * - A failed pipe() or fork() abandons the rest of the line with status
+ * EXIT_FAILURE rather than taking the whole shell down.
+ * - Per-stage state lives in the CommandLine's arrays rather than on the
+ * stack, and a long pipeline's exited stages are reaped while later ones are
+ * still being started, so the length of a pipeline is bounded by the
+ * processes that are alive at once, not by the stages it has.
+ * - Builtins always run inside the shell. In a pipeline, a builtin's output
+ * goes to a memfd that the next stage is then given as stdin, so no builtin
+ * runs in a forked child: past fork() the child only makes the
+ * async-signal-safe calls up to exec, and exec errors are reported by the
+ * parent. A piped cd or z leaves the shell where it was, as a subshell
+ * would.
+ * - A command found nowhere on PATH is reported by the parent, with the
+ * nearest command names (path_suggest), and is not forked when it stands
+ * alone.
+ * - Every fork is followed by waiting for the child's exec through a
+ * close-on-exec pipe that the child only writes to when execvp fails (the
+ * same handshake posix_spawn does), which yields the fork-to-exec latency and
+ * exec failure counters. While tracing, each stage also records fork, exec,
+ * wait and child-lifetime spans.
  * - The function returns true if a quit command is encountered during
  * execution; otherwise, false.
  */
-bool run_commands(list<Process *> &command_list) {
+bool run_commands(CommandLine &line, ExecContext *ctx) {
+  TraceSpan span("run_commands");
+  ExecContext defaults;
+  if (!ctx) ctx = &defaults;
+
   bool is_quit = false;
+  bool traced = trace_on();
   int i = 0;
   int j = 0;
-  int size = command_list.size();
-  pid_t pids[size];
+  size_t size = line.size();
+  line.pids.resize(size);
+  line.spawn_ns.resize(size);
+  line.exec_ns.resize(size);
+  line.raw_status.resize(size);
+  line.reaped.assign(size, 0);
+  pid_t *pids = line.pids.data();
+  uint64_t *spawn_ns = line.spawn_ns.data();
+  uint64_t *exec_ns = line.exec_ns.data();
+  StageTable st = {pids, line.begin(), spawn_ns, exec_ns,
+                   line.raw_status.data(), line.reaped.data(),
+                   ctx->stages ? ctx->stages->size() : 0};
+  int first_live = 0;
+  int reap_at = REAP_WINDOW;
+  pid_t pgid = 0;
   Process *prev = nullptr;
 
-  for (Process *curr : command_list) {
+  for (Process &stage : line) {
+    Process *curr = &stage;
     int *curr_fd = curr->pipe_fd;
     int *prev_fd = prev ? prev->pipe_fd : NULL;
     bool curr_in = curr->pipe_in;
     bool curr_out = curr->pipe_out;
 
     if (isQuit(curr)) {
+      stat_add(stats.quits);
+      stat_add(stats.builtins);
       is_quit = true;
-      if (prev) {
+      if (prev && prev->pipe_out) {
         close(prev_fd[0]);
         close(prev_fd[1]);
+        wait_stages(st, j, i - 1, ctx);
+      }
+      if (audit_on()) {
+        uint64_t now = trace_now();
+        audit_command(curr->cmdTokens, 0, 0, now, now);
       }
       break;
     }
 
-    int pipe_failed;
-    if ((curr_out && ((pipe_failed = pipe(curr_fd))))
-    || (pids[i] = fork()) < 0 ) {
+    Builtin builtin = lookup_builtin(curr->cmdTokens[0]);
+    if (builtin) {
+      TraceSpan builtin_span("builtin", curr->cmdTokens[0]);
+      stat_add(stats.builtins);
+      // a builtin reads no input; its writer gets EPIPE, as from a child
+      if (curr_in && prev) {
+        close(prev_fd[0]);
+        close(prev_fd[1]);
+      }
+      // piped, its output is kept in a memfd that the next stage reads as
+      // stdin, so it runs to completion with no reader running yet
+      if (curr_out) {
+        curr_fd[1] = -1;
+        if ((curr_fd[0] = memfd_create("tsh-builtin", MFD_CLOEXEC)) < 0) {
+          perror("memfd_create failed");
+          wait_stages(st, j, i - 1, ctx);
+          ctx->status = EXIT_FAILURE;
+          break;
+        }
+      }
+      int out = curr_out ? curr_fd[0]
+                : ctx->out_fd >= 0 ? ctx->out_fd : STDOUT_FILENO;
+      int err = ctx->err_fd >= 0 ? ctx->err_fd : STDERR_FILENO;
+      auto now = chrono::steady_clock::now();
+      uint64_t builtin_start = spawn_ns[i] = trace_now();
+      int status;
+      if (changes_shell(builtin) && !ctx->shell_state) {
+        dprintf(err, "tsh: %s: not available here\n", curr->cmdTokens[0]);
+        status = EXIT_FAILURE;
+      } else if (changes_shell(builtin) && (curr_in || curr_out)) {
+        status = run_as_subshell(builtin, curr, out, err);
+      } else {
+        status = builtin(curr, out, err);
+      }
+      if (curr_out) lseek(curr_fd[0], 0, SEEK_SET);
+      if (audit_on()) {
+        audit_command(curr->cmdTokens, 0, status, builtin_start, trace_now());
+      }
+      if (ctx->stages) {
+        ctx->stages->push_back({0, status, now, now,
+                                chrono::steady_clock::now(), {}});
+      }
+      // keeps stage indices aligned with the stages record
+      pids[i] = 0;
+      exec_ns[i] = 0;
+      st.raw_status[i] = W_EXITCODE(status, 0);
+      line.reaped[i] = 1;
+      if (!curr_out) {
+        if (curr_in) wait_stages(st, j, i, ctx);
+        ctx->status = status;
+        j = i + 1;
+        reap_at = j + REAP_WINDOW;
+      }
+      prev = curr;
+      i++;
+      continue;
+    }
+
+    // looked up here, so the child has nothing to search or allocate
+    char resolved[PATH_MAX];
+    bool indexed = path_resolve(curr->cmdTokens[0], resolved,
+                                sizeof(resolved));
+    // a command that is nowhere on PATH is reported here, with suggestions,
+    // rather than by the child once execvp fails; on its own, the stage is
+    // not even forked
+    bool missing = !indexed && path_absent(curr->cmdTokens[0]);
+    if (missing) {
+      command_not_found(curr->cmdTokens[0],
+                        ctx->err_fd >= 0 ? ctx->err_fd : STDERR_FILENO);
+    }
+    if (missing && !curr_in && !curr_out) {
+      stat_add(stats.exec_failures);
+      ctx->status = EXIT_FAILURE;
+      if (audit_on()) {
+        uint64_t now = trace_now();
+        audit_command(curr->cmdTokens, 0, ctx->status, now, now);
+      }
+      if (ctx->stages) {
+        auto now = chrono::steady_clock::now();
+        ctx->stages->push_back({0, ctx->status, now, now, now, {}});
+      }
+      pids[i] = 0;
+      spawn_ns[i] = exec_ns[i] = 0;
+      line.reaped[i] = 1;
+      j = i + 1;
+      reap_at = j + REAP_WINDOW;
+      prev = curr;
+      i++;
+      continue;
+    }
+
+    uint64_t fork_start = spawn_ns[i] = trace_now();
+    exec_ns[i] = 0;
+    int exec_probe[2] = {-1, -1};
+    if (pipe2(exec_probe, O_CLOEXEC) < 0) {
+      exec_probe[0] = exec_probe[1] = -1;
+    }
+
+    int pipe_failed = 0;
+    if ((curr_out && ((pipe_failed = pipe2(curr_fd, O_CLOEXEC))))
+    || (pids[i] = child_fork()) < 0 ) {
       if (curr_in && prev) {
         close(prev_fd[0]);
         close(prev_fd[1]);
@@ -260,27 +748,102 @@ bool run_commands(list<Process *> &command_list) {
         close(curr_fd[1]);
       }
 
+      if (exec_probe[0] >= 0) {
+        close(exec_probe[0]);
+        close(exec_probe[1]);
+      }
+
       perror(pipe_failed ? "pipe failed" : "fork failed");
-      exit(EXIT_FAILURE);
+      wait_stages(st, j, i - 1, ctx);
+      ctx->status = EXIT_FAILURE;
+      break;
     }
 
+    bool own_pgrp = ctx->own_pgrp;
+    if (own_pgrp && !(curr_in && prev)) pgid = 0;
+
     if (pids[i] == 0) {
+      if (own_pgrp) setpgid(0, pgid);
+
       if (curr_in && prev) {
         close(prev_fd[1]);
         dup2(prev_fd[0], STDIN_FILENO);
         close(prev_fd[0]);
+      } else if (ctx->in_fd >= 0) {
+        dup2(ctx->in_fd, STDIN_FILENO);
       }
 
       if (curr_out) {
         close(curr_fd[0]);
         dup2(curr_fd[1], STDOUT_FILENO); 
         close(curr_fd[1]);
+      } else if (ctx->out_fd >= 0) {
+        dup2(ctx->out_fd, STDOUT_FILENO);
       }
 
-      execvp(curr->cmdTokens[0], curr->cmdTokens);
-      if (errno == ENOENT) fprintf(stderr, "tsh: command not found: %s\n", curr->cmdTokens[0]);
-      else perror("exec failed");
-      exit(EXIT_FAILURE);
+      if (ctx->err_fd >= 0) dup2(ctx->err_fd, STDERR_FILENO);
+
+      if (!missing) {
+        // a stale index entry (the file just went away) falls back to execvp
+        if (indexed) execv(resolved, curr->cmdTokens);
+        execvp(curr->cmdTokens[0], curr->cmdTokens);
+      }
+      // the parent says why, from the errno on the probe; _exit: the
+      // parent's atexit work (trace dump) and stdio buffers are not the
+      // child's to run or flush
+      int exec_errno = missing ? ENOENT : errno;
+      if (exec_probe[1] < 0 ||
+          write(exec_probe[1], &exec_errno, sizeof(exec_errno)) < 0) {
+        exec_failed_message(curr->cmdTokens[0]);
+      }
+      _exit(EXIT_FAILURE);
+    }
+
+    stat_add(stats.forks);
+    uint64_t forked = trace_now();
+    if (traced) trace_event("fork", fork_start, forked, curr->cmdTokens[0]);
+    if (exec_probe[0] >= 0) {
+      int exec_errno;
+      ssize_t n;
+      close(exec_probe[1]);
+      while ((n = read(exec_probe[0], &exec_errno, sizeof(exec_errno))) < 0 &&
+             errno == EINTR) {}
+      close(exec_probe[0]);
+      uint64_t exec_done = trace_now();
+      bool exec_failed = n == sizeof(exec_errno);
+      if (exec_failed) {
+        stat_add(stats.exec_failures);
+        int err = ctx->err_fd >= 0 ? ctx->err_fd : STDERR_FILENO;
+        if (missing) {}  // said so above
+        else if (exec_errno == ENOENT)
+          dprintf(err, "tsh: command not found: %s\n", curr->cmdTokens[0]);
+        else
+          dprintf(err, "tsh: %s: %s\n", curr->cmdTokens[0], strerror(exec_errno));
+      } else {
+        exec_ns[i] = exec_done;
+        stat_add(stats.execs);
+        stat_add(stats.fork_exec_ns, exec_done - fork_start);
+        latency_fork_exec(curr->cmdTokens[0], exec_done - fork_start);
+      }
+      if (traced) {
+        trace_event(exec_failed ? "exec failed" : "exec", forked, exec_done,
+                    curr->cmdTokens[0], pids[i]);
+      }
+    }
+
+    if (ctx->stages) {
+      ctx->stages->push_back({pids[i], 0, steady_at(fork_start),
+                              steady_at(exec_ns[i] ? exec_ns[i] : fork_start),
+                              {}, {}});
+    }
+
+    if (own_pgrp) {
+      // also done by the child; whichever runs first wins the race
+      setpgid(pids[i], pgid);
+      if (!pgid) {
+        pgid = pids[i];
+        if (ctx->on_pgrp) ctx->on_pgrp(pgid);
+      }
     }
 
     if (curr_in && prev) {
@@ -289,10 +852,12 @@ bool run_commands(list<Process *> &command_list) {
     }
 
     if (!curr_out) {
-      while (j <= i) {
-        waitpid(pids[i], nullptr, 0);
-        j++;
-      }
+      wait_stages(st, j, i, ctx);
+      j = i + 1;
+      reap_at = j + REAP_WINDOW;
+    } else if (i >= reap_at) {
+      first_live = max(first_live, j);
+      reap_at = i + max(REAP_WINDOW, reap_exited(st, first_live, i, ctx));
     }
 
     prev = curr;
@@ -302,6 +867,61 @@ bool run_commands(list<Process *> &command_list) {
   return is_quit;
 }
 
+/**
+ * @brief Appends s to out as the inside of a JSON string.
+ */
+void json_escape(string &out, const char *s) {
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+}
+
+/**
+ * @brief Constructor for ExecContext: inherit every descriptor, status 0.
+ */
+ExecContext::ExecContext()
+    : in_fd(-1), out_fd(-1), err_fd(-1), status(0), own_pgrp(false),
+      shell_state(false), stages(nullptr) {}
+
+/**
+ * @brief Empties the command line for the next one. The stage array and the
+ * executor's arrays keep their memory, so lines up to CMDLINE_KEEP_STAGES
+ * stages long are parsed and run without allocating once one that long has
+ * been seen; after a longer one the memory is given back. This covers
+ * parse_input and run_commands only: the line text is the caller's, and
+ * read_input allocates it afresh each time.
+ */
+void CommandLine::clear() {
+  stages.clear();
+  if (stages.capacity() <= CMDLINE_KEEP_STAGES) return;
+  vector<Process>().swap(stages);
+  vector<pid_t>().swap(pids);
+  vector<uint64_t>().swap(spawn_ns);
+  vector<uint64_t>().swap(exec_ns);
+  vector<int>().swap(raw_status);
+  vector<char>().swap(reaped);
+}
+
+/**
+ * @brief Appends a stage to the command line.
+ *
+ * @return Process& the new stage; valid until the next add or clear.
+ */
+Process &CommandLine::add(bool pipe_in, bool pipe_out) {
+  stages.emplace_back(pipe_in, pipe_out);
+  return stages.back();
+}
+
 /**
  * @brief Constructor for Process class.
  *
@@ -324,12 +944,18 @@ Process::~Process() {}
 
 /**
  * @brief add a pointer to a command or flags to cmdTokens
- * 
+ *
+ * A command word (the first token) that is already interned, as builtin
+ * names and "quit" are, is replaced by its interned copy, so it can be
+ * compared by pointer. Others are not interned here, so that a long-running
+ * shell or server does not keep every command name it ever ran.
+ *
  * @param tok 
  */
 void Process::add_token(char *tok) {
-  if (i <= 23) {
-    cmdTokens[i] = tok;
+  if (i < MAX_ARGS) {
+    const char *known = i ? nullptr : intern_find(tok);
+    cmdTokens[i] = known ? (char *) known : tok;
     cmdTokens[++i] = NULL;
   }
 }
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <tsh.h>
+
+using namespace std;
+
+/**
+ * Soak test for resource hygiene: pushes a long stream of mixed builtins,
+ * commands, failing commands and pipelines through run(), and checks after
+ * every chunk that open descriptors, live children and RSS stay flat.
+ *
+ * TSH_SOAK_LINES sets the number of lines (default 200000).
+ */
+
+struct Sample {
+  long lines;
+  int fds;
+  int children;
+  long rss_kb;
+};
+
+static int count_fds() {
+  int n = 0;
+  DIR *d = opendir("/proc/self/fd");
+  while (readdir(d)) n++;
+  closedir(d);
+  return n - 3;  // ".", ".." and the DIR's own descriptor
+}
+
+/**
+ * @brief Children of this process, zombies included, found by their ppid.
+ */
+static int count_children() {
+  int n = 0;
+  pid_t self = getpid();
+  DIR *d = opendir("/proc");
+  while (struct dirent *e = readdir(d)) {
+    if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+    ifstream stat(string("/proc/") + e->d_name + "/stat");
+    string line;
+    if (!getline(stat, line)) continue;
+    // pid (comm) state ppid ...; comm may itself contain spaces or parens
+    size_t close = line.rfind(')');
+    if (close == string::npos) continue;
+    char state;
+    int ppid;
+    if (sscanf(line.c_str() + close + 1, " %c %d", &state, &ppid) == 2 &&
+        ppid == self)
+      n++;
+  }
+  closedir(d);
+  return n;
+}
+
+static long rss_kb() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * @brief One chunk of input: mostly builtins, then the commands and
+ * pipelines that exercise fork, exec failure, pipes and dangling pipes.
+ */
+static string make_chunk(int lines) {
+  static const char *mix[] = {
+      "/bin/true",
+      "nosuch-command-for-soak",
+      "/bin/true | /bin/true",
+      "echo soak | cat | cat",
+      "/bin/true |",
+      "; ; |",
+      ": a b c; /bin/false",
+      "tsh-stats -j",
+  };
+  string chunk;
+  for (int k = 0; k < lines; k++) {
+    chunk += k % 10 ? ": soak line" : mix[(k / 10) % 8];
+    chunk += '\n';
+  }
+  return chunk;
+}
+
+static void print_profile(const vector<Sample> &samples) {
+  fprintf(stderr, "%10s %6s %9s %10s\n", "lines", "fds", "children", "rss KB");
+  size_t step = max((size_t) 1, samples.size() / 40);
+  for (size_t k = 0; k < samples.size(); k += step) {
+    const Sample &s = samples[k];
+    fprintf(stderr, "%10ld %6d %9d %10ld\n", s.lines, s.fds, s.children,
+            s.rss_kb);
+  }
+}
+
+TEST(SoakTest, ResourcesStayFlat) {
+  long total = getenv("TSH_SOAK_LINES") ? atol(getenv("TSH_SOAK_LINES")) : 200000;
+  const int chunk_lines = 2000;
+  string chunk = make_chunk(chunk_lines);
+
+  // run() prints a prompt per line and the commands print too
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int saved_stderr = dup(STDERR_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  dup2(null, STDERR_FILENO);
+  close(null);
+  FILE *saved_stdin = stdin;
+
+  vector<Sample> samples;
+  for (long done = 0; done < total; done += chunk_lines) {
+    stdin = fmemopen(&chunk[0], chunk.size(), "r");
+    run();
+    fclose(stdin);
+    samples.push_back({done + chunk_lines, count_fds(), count_children(),
+                       rss_kb()});
+  }
+
+  stdin = saved_stdin;
+  cout.flush();
+  dup2(saved_stdout, STDOUT_FILENO);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stdout);
+  close(saved_stderr);
+
+  // allow the allocator and stdio to reach their working size first
+  const Sample &base = samples[samples.size() / 10];
+  bool flat = true;
+  for (const Sample &s : samples) {
+    if (s.children != 0) flat = false;
+    if (&s >= &base && (s.fds != base.fds || s.rss_kb > base.rss_kb + 1024))
+      flat = false;
+  }
+  if (!flat) print_profile(samples);
+
+  EXPECT_TRUE(flat) << "descriptors, children or RSS grew; profile above";
+  EXPECT_EQ(samples.back().children, 0);
+  EXPECT_EQ(samples.back().fds, base.fds);
+  EXPECT_LE(samples.back().rss_kb, base.rss_kb + 1024);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
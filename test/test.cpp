@@ -6,6 +6,26 @@
 #include <string>
 #include <ctime>
 #include <tsh.h>
+#include <libtsh.h>
+#include <server.h>
+#include <reaper.h>
+#include <stats.h>
+#include <latency.h>
+#include <profile.h>
+#include <record.h>
+#include <audit.h>
+#include <editor.h>
+#include <history.h>
+#include <intern.h>
+#include <pathindex.h>
+#include <filecomplete.h>
+#include <prompt.h>
+#include <jumpdb.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <thread>
 
 using namespace std;
 
@@ -101,6 +121,811 @@ TEST(ShellTest, TestSimpleRun) {
                                          << expected_output;
 }
 
+// run_commands should report the last stage's status and honour out_fd
+TEST(ShellTest, ExecContext) {
+  CommandLine cmdline;
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+
+  ExecContext ctx;
+  ctx.out_fd = fds[1];
+  char *line = strdup("echo hi | tr a-z A-Z; false");
+  parse_input(line, cmdline);
+  EXPECT_FALSE(run_commands(cmdline, &ctx));
+  cleanup(cmdline, line);
+  close(fds[1]);
+
+  char buf[16] = {0};
+  EXPECT_EQ(read(fds[0], buf, sizeof(buf) - 1), 3);
+  close(fds[0]);
+  EXPECT_STREQ(buf, "HI\n");
+  EXPECT_EQ(ctx.status, 1) << "status should come from the last pipeline";
+}
+
+// a captured batch should stream one result per line, then the end frame
+TEST(ShellTest, BatchCapture) {
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  thread server([&] {
+    ExecContext bound;
+    serve_stream(sv[1], sv[1], true, bound);
+    close(sv[1]);
+  });
+
+  char cwd[PATH_MAX], after[PATH_MAX];
+  ASSERT_NE(getcwd(cwd, sizeof(cwd)), nullptr);
+  // cd would move every session the daemon serves
+  const char *lines[] = {"echo a", "echo b | tr b c", "cd /"};
+  BatchOptions opts = {2, 0, CAPTURE_OUTPUT, 3};
+  string body((char *) &opts, sizeof(opts));
+  for (const char *l : lines) {
+    uint32_t len = strlen(l);
+    body.append((char *) &len, sizeof(len)).append(l);
+  }
+  FrameHeader hdr = {FRAME_BATCH, (uint32_t) body.size()};
+  ASSERT_EQ(write(sv[0], &hdr, sizeof(hdr)), (ssize_t) sizeof(hdr));
+  ASSERT_EQ(write(sv[0], body.data(), body.size()), (ssize_t) body.size());
+
+  string seen[3], errs[3];
+  int status[3] = {-1, -1, -1};
+  for (;;) {
+    ASSERT_EQ(read(sv[0], &hdr, sizeof(hdr)), (ssize_t) sizeof(hdr));
+    string payload(hdr.len, '\0');
+    ASSERT_EQ(recv(sv[0], &payload[0], hdr.len, MSG_WAITALL), (ssize_t) hdr.len);
+    if (hdr.type == FRAME_END) break;
+    ASSERT_EQ(hdr.type, (uint32_t) FRAME_RESULT);
+    BatchResult res;
+    memcpy(&res, payload.data(), sizeof(res));
+    ASSERT_LT(res.index, 3u);
+    EXPECT_LT(res.usec, 60000000u) << "usec is a 64-bit wall time";
+    status[res.index] = res.status;
+    seen[res.index] = payload.substr(sizeof(res), res.out_len);
+    errs[res.index] = payload.substr(sizeof(res) + res.out_len, res.err_len);
+  }
+
+  // nothing bound to run it on: refused, as a FRAME_LINE would be
+  const char unbound[] = "echo leaked";
+  opts = {1, 0, CAPTURE_SESSION, 1};
+  body.assign((char *) &opts, sizeof(opts));
+  uint32_t unbound_len = sizeof(unbound) - 1;
+  body.append((char *) &unbound_len, sizeof(unbound_len)).append(unbound);
+  hdr = {FRAME_BATCH, (uint32_t) body.size()};
+  ASSERT_EQ(write(sv[0], &hdr, sizeof(hdr)), (ssize_t) sizeof(hdr));
+  ASSERT_EQ(write(sv[0], body.data(), body.size()), (ssize_t) body.size());
+  ASSERT_EQ(read(sv[0], &hdr, sizeof(hdr)), (ssize_t) sizeof(hdr));
+  ASSERT_EQ(hdr.type, (uint32_t) FRAME_RESULT);
+  BatchResult refused;
+  ASSERT_EQ(recv(sv[0], &refused, sizeof(refused), MSG_WAITALL),
+            (ssize_t) sizeof(refused));
+  EXPECT_EQ(refused.status, EXIT_FAILURE);
+  uint32_t total;
+  ASSERT_EQ(read(sv[0], &hdr, sizeof(hdr)), (ssize_t) sizeof(hdr));
+  ASSERT_EQ(hdr.type, (uint32_t) FRAME_END);
+  ASSERT_EQ(read(sv[0], &total, sizeof(total)), (ssize_t) sizeof(total));
+
+  shutdown(sv[0], SHUT_WR);
+  server.join();
+  close(sv[0]);
+
+  EXPECT_EQ(seen[0], "a\n");
+  EXPECT_EQ(seen[1], "c\n");
+  EXPECT_EQ(status[0], 0);
+  EXPECT_EQ(status[1], 0);
+  EXPECT_EQ(status[2], EXIT_FAILURE);
+  EXPECT_NE(errs[2].find("not available here"), string::npos);
+  ASSERT_NE(getcwd(after, sizeof(after)), nullptr);
+  EXPECT_STREQ(after, cwd);
+}
+
+// the typed API should run argv vectors without any parsing
+TEST(ShellTest, LibPipeline) {
+  tsh::Result r = tsh::Pipeline{{"echo", "b a|c"}, {"tr", " |", "\\n\\n"}, {"sort"}}.run();
+
+  ASSERT_EQ(r.status.size(), 3u);
+  EXPECT_TRUE(r.ok());
+  EXPECT_EQ(r.out, "a\nb\nc\n") << "'|' inside a word must not split stages";
+  EXPECT_EQ(r.stage_wall.size(), 3u);
+
+  r = tsh::Pipeline{{"ls", "/nonexistent/path"}}.run();
+  EXPECT_FALSE(r.ok());
+  EXPECT_NE(r.err.find("nonexistent"), string::npos);
+
+  try {
+    tsh::Pipeline().add({});
+    ADD_FAILURE() << "an empty stage should be refused";
+  } catch (const invalid_argument &e) {
+    EXPECT_NE(string(e.what()).find(to_string(MAX_ARGS)), string::npos);
+  }
+
+  // the host's directory is not the pipeline's to change
+  char cwd[PATH_MAX], after[PATH_MAX];
+  ASSERT_NE(getcwd(cwd, sizeof(cwd)), nullptr);
+  r = tsh::Pipeline{{"cd", "/"}}.run();
+  EXPECT_FALSE(r.ok());
+  ASSERT_NE(getcwd(after, sizeof(after)), nullptr);
+  EXPECT_STREQ(after, cwd);
+}
+
+// orphans should be collected while the executor keeps its own statuses
+TEST(ShellTest, Subreaper) {
+  ASSERT_TRUE(reaper_enable());
+  uint64_t before = reaper_stats().orphans_reaped;
+
+  tsh::Result r = tsh::Pipeline{{"sh", "-c", "sleep 0.05 & exit 7"}}.run();
+  EXPECT_EQ(r.exit_status(), 7);
+
+  for (int k = 0; k < 100 && reaper_stats().orphans_reaped == before; k++)
+    usleep(10000);
+  EXPECT_GT(reaper_stats().orphans_reaped, before);
+
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  stats_print(fds[1], true);
+  close(fds[1]);
+  char buf[4096] = {0};
+  ASSERT_GT(read(fds[0], buf, sizeof(buf) - 1), 0);
+  close(fds[0]);
+  EXPECT_NE(strstr(buf, "\"owned_reaped\":"), nullptr) << "shown by tsh-stats";
+}
+
+// stages past the reap window are collected while the pipeline is started
+TEST(ShellTest, LongPipeline) {
+  tsh::Pipeline p;
+  for (int k = 0; k < 1000; k++) p.add({"true"});
+  p.add({"echo", "end"});
+
+  tsh::Result r = p.run();
+  ASSERT_EQ(r.status.size(), 1001u);
+  EXPECT_EQ(count(r.status.begin(), r.status.end(), 0), 1001);
+  EXPECT_EQ(r.out, "end\n");
+}
+
+// once warmed up, a reused CommandLine parses and runs without operator new;
+// the line itself is the caller's (strdup here, read_input in the shell)
+TEST(ShellTest, ExecutorSteadyStateAllocs) {
+  CommandLine cmdline;
+  ExecContext ctx;
+  ctx.out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  auto run_line = [&] {
+    char *line = strdup("echo a b c | tr a-z A-Z | cat; : x");
+    parse_input(line, cmdline);
+    run_commands(cmdline, &ctx);
+    cleanup(cmdline, line);
+  };
+  run_line();
+  run_line();
+
+  uint64_t allocs = stats.allocs;
+  for (int k = 0; k < 20; k++) run_line();
+  EXPECT_EQ(stats.allocs - allocs, 0u);
+  close(ctx.out_fd);
+}
+
+// equal words intern to one pointer, including parsed command words
+TEST(ShellTest, Intern) {
+  char word[] = "grep -r";
+  const char *grep = intern("grep");
+  EXPECT_EQ(intern(word, 4), grep);
+  EXPECT_STREQ(grep, "grep");
+  EXPECT_EQ(intern_find("tsh-never-interned"), nullptr);
+
+  CommandLine cmdline;
+  char *line = strdup("grep x | grep y");
+  parse_input(line, cmdline);
+  EXPECT_EQ(cmdline[0].cmdTokens[0], grep);
+  EXPECT_EQ(cmdline[1].cmdTokens[0], grep);
+  cleanup(cmdline, line);
+
+  // a command name is not kept for good just for having been typed
+  line = strdup("tsh-typed-once x");
+  parse_input(line, cmdline);
+  EXPECT_EQ(intern_find("tsh-typed-once"), nullptr);
+  cleanup(cmdline, line);
+}
+
+// each keystroke redraws only what changed, in one write
+TEST(ShellTest, LineEditor) {
+  int in[2], out[2];
+  ASSERT_EQ(pipe(in), 0);
+  ASSERT_EQ(pipe(out), 0);
+  LineEditor editor(in[0], out[1]);
+  char *line = nullptr;
+  thread reader([&] { line = editor.read_line("$ "); });
+
+  auto key = [&](const char *k) {
+    if (*k && write(in[1], k, strlen(k)) < 0) return string();
+    char buf[256];
+    ssize_t n = read(out[0], buf, sizeof(buf));
+    return string(buf, n > 0 ? n : 0);
+  };
+  EXPECT_EQ(key(""), "\r$ \x1b[K");
+  EXPECT_EQ(key("a"), "a");
+  EXPECT_EQ(key("b"), "b");
+  EXPECT_EQ(key("\x1b[D"), "\b");
+  EXPECT_EQ(key("X"), "Xb\b");
+  EXPECT_EQ(key("\xc3\xa9"), "\xc3\xa9" "b\b");
+  EXPECT_EQ(key("\x7f"), "\bb\x1b[K\b");
+  EXPECT_EQ(key("\r"), "\r\n");
+  reader.join();
+  ASSERT_NE(line, nullptr);
+  EXPECT_STREQ(line, "aXb\n");
+  free(line);
+
+  // kill and yank, typed ahead in one go
+  const char keys[] = "one two\x17\x01\x19 \r\x04";
+  ASSERT_EQ(write(in[1], keys, sizeof(keys) - 1), (ssize_t) sizeof(keys) - 1);
+  line = editor.read_line("$ ");
+  ASSERT_NE(line, nullptr);
+  EXPECT_STREQ(line, "two one \n");
+  free(line);
+  EXPECT_EQ(editor.read_line("$ "), nullptr) << "C-d on an empty line";
+
+  for (int fd : {in[0], in[1], out[0], out[1]}) close(fd);
+}
+
+// a paste is taken in whole: its lines come back one per read_line, with
+// the echo of all of them drawn once
+TEST(ShellTest, BracketedPaste) {
+  int in[2], out[2];
+  ASSERT_EQ(pipe(in), 0);
+  ASSERT_EQ(pipe(out), 0);
+  LineEditor editor(in[0], out[1]);
+  const char keys[] = "ec\x1b[200~ho 1\rtwo\r\nthree\x1b[201~ more\r"
+                      "\x1b[200~a\tb\x1b[201~\r";
+  ASSERT_EQ(write(in[1], keys, sizeof(keys) - 1), (ssize_t) sizeof(keys) - 1);
+
+  char *line = editor.read_line("$ ");
+  ASSERT_NE(line, nullptr);
+  EXPECT_STREQ(line, "echo 1\n");
+  free(line);
+  char buf[256];
+  ssize_t n = read(out[0], buf, sizeof(buf));
+  EXPECT_EQ(string(buf, n > 0 ? n : 0), "\r$ \x1b[Kecho 1\r\ntwo\r\n");
+
+  EXPECT_TRUE(editor.pasting());
+  line = editor.read_line("$ ");
+  EXPECT_STREQ(line, "two\n");
+  free(line);
+  EXPECT_FALSE(editor.pasting());
+  line = editor.read_line("$ ");
+  EXPECT_STREQ(line, "three more\n") << "the last line is left to edit";
+  free(line);
+  line = editor.read_line("$ ");
+  EXPECT_STREQ(line, "a\tb\n") << "a pasted Tab does not complete";
+  free(line);
+
+  for (int fd : {in[0], in[1], out[0], out[1]}) close(fd);
+}
+
+// two sessions share one file; each sees the other's entries on refresh
+TEST(ShellTest, SharedHistory) {
+  const char *path = "history_test";
+  remove(path);
+  History a, b;
+  ASSERT_TRUE(a.open(path));
+  ASSERT_TRUE(b.open(path));
+
+  EXPECT_TRUE(a.add("ls -l", 5));
+  EXPECT_FALSE(a.add("ls -l", 5)) << "repeats are not recorded";
+  EXPECT_TRUE(b.add("pwd", 3));
+  int fd = open(path, O_WRONLY | O_APPEND);
+  ASSERT_EQ(write(fd, "half-writ", 9), 9);  // a session mid-write
+  close(fd);
+
+  a.refresh();
+  const char *entry;
+  size_t len, pos = a.end();
+  ASSERT_TRUE(a.prev(pos, entry, len));
+  EXPECT_EQ(string(entry, len), "pwd");
+  ASSERT_TRUE(a.prev(pos, entry, len));
+  EXPECT_EQ(string(entry, len), "ls -l");
+  EXPECT_FALSE(a.prev(pos, entry, len));
+
+  // the editor steps through it with the arrows
+  int in[2], out[2];
+  ASSERT_EQ(pipe(in), 0);
+  ASSERT_EQ(pipe(out), 0);
+  LineEditor editor(in[0], out[1]);
+  editor.set_history(&b);
+  const char keys[] = "x\x1b[A\x1b[A\x1b[B\x1b[B\x1b[A\r";
+  ASSERT_EQ(write(in[1], keys, sizeof(keys) - 1), (ssize_t) sizeof(keys) - 1);
+  char *line = editor.read_line("$ ");
+  ASSERT_NE(line, nullptr);
+  EXPECT_STREQ(line, "pwd\n");
+  free(line);
+  for (int fd : {in[0], in[1], out[0], out[1]}) close(fd);
+  remove(path);
+}
+
+// search ranks distinct entries, and picks up where the saved index stopped
+TEST(ShellTest, HistorySearch) {
+  const char *path = "history_search_test";
+  string idx = string(path) + ".idx";
+  remove(path);
+  remove(idx.c_str());
+  {
+    History h;
+    ASSERT_TRUE(h.open(path));
+    for (const char *cmd : {"Git log", "make test", "git status", "make all",
+                            "git status", "ls", "git status", "make install"})
+      h.add(cmd, strlen(cmd));
+
+    vector<HistoryMatch> m = h.search("git", 10);
+    ASSERT_EQ(m.size(), 2u) << "case is ignored, repeats are merged";
+    EXPECT_EQ(string(m[0].text, m[0].len), "git status");
+    EXPECT_EQ(m[0].count, 3u);
+    m = h.search("make", 10);
+    ASSERT_EQ(m.size(), 3u);
+    EXPECT_EQ(string(m[0].text, m[0].len), "make install") << "newest first";
+    EXPECT_TRUE(h.search("ake t", 10).size() == 1);
+    EXPECT_TRUE(h.search("zzz", 10).empty());
+    EXPECT_EQ(h.search("l", 10).size(), 4u) << "short queries scan";
+  }
+  struct stat st;
+  ASSERT_EQ(stat(idx.c_str(), &st), 0) << "the index is saved on exit";
+
+  {
+    History h;
+    ASSERT_TRUE(h.open(path));
+    h.add("make test", 9);
+    vector<HistoryMatch> m = h.search("make", 10);
+    ASSERT_EQ(m.size(), 3u);
+    EXPECT_EQ(string(m[0].text, m[0].len), "make test");
+    EXPECT_EQ(m[0].count, 2u);
+
+    // C-r finds the best match, C-r again the next one
+    int in[2], out[2];
+    ASSERT_EQ(pipe(in), 0);
+    ASSERT_EQ(pipe(out), 0);
+    LineEditor editor(in[0], out[1]);
+    editor.set_history(&h);
+    const char keys[] = "x\x12mak\x12\x05!\r";
+    ASSERT_EQ(write(in[1], keys, sizeof(keys) - 1), (ssize_t) sizeof(keys) - 1);
+    char *line = editor.read_line("$ ");
+    ASSERT_NE(line, nullptr);
+    EXPECT_STREQ(line, "make install!\n");
+    free(line);
+    for (int fd : {in[0], in[1], out[0], out[1]}) close(fd);
+  }
+
+  // a corrupt index is rebuilt rather than followed
+  int fd = open(idx.c_str(), O_RDWR);
+  ASSERT_GE(fd, 0);
+  uint32_t nentries;
+  ASSERT_EQ(pread(fd, &nentries, 4, 28), 4);
+  uint64_t bad = ~0ull;  // the first trigram's postings start
+  ASSERT_EQ(pwrite(fd, &bad, 8, 48 + nentries * 24 + 8), 8);
+  close(fd);
+  {
+    History h;
+    ASSERT_TRUE(h.open(path));
+    EXPECT_EQ(h.search("make", 10).size(), 3u);
+  }
+  remove(path);
+  remove(idx.c_str());
+}
+
+// sessions share the directory database; z and cd go through it
+TEST(ShellTest, JumpDatabase) {
+  const char *path = "jump_test";
+  remove(path);
+  char cwd[PATH_MAX];
+  ASSERT_NE(getcwd(cwd, sizeof(cwd)), nullptr);
+  string proj = string(cwd) + "/jump_proj", src = proj + "/src";
+  string docs = string(cwd) + "/jump_docs";
+  mkdir(proj.c_str(), 0755);
+  mkdir(src.c_str(), 0755);
+  mkdir(docs.c_str(), 0755);
+
+  JumpDb a, b;
+  ASSERT_TRUE(a.open(path));
+  ASSERT_TRUE(b.open(path));
+  time_t now = time(NULL);
+  EXPECT_TRUE(a.visit(src.c_str(), now - 7200));
+  EXPECT_TRUE(a.visit(src.c_str(), now - 7200));
+  EXPECT_TRUE(b.visit(proj.c_str(), now));
+  EXPECT_FALSE(a.visit("relative", now));
+
+  vector<JumpMatch> m = a.match({"jump", "src"}, now);
+  ASSERT_EQ(m.size(), 1u) << "terms match in order";
+  EXPECT_EQ(m[0].dir, src);
+  EXPECT_EQ(m[0].score, 4) << "two visits two hours ago";
+  m = b.match({"JUMP_P"}, now);
+  ASSERT_EQ(m.size(), 2u) << "case is ignored when nothing matches with it";
+  EXPECT_EQ(m[0].dir, proj) << "one visit just now, x4";
+  EXPECT_EQ(m[1].dir, src);
+
+  // enough visits and the file is folded into a line per directory, which
+  // the other session follows
+  for (int k = 0; k <= JUMP_SLACK; k++) a.visit(docs.c_str(), now);
+  struct stat st;
+  ASSERT_EQ(stat(path, &st), 0);
+  EXPECT_LT(st.st_size, 1024) << "compacted";
+  m = b.match({"docs"}, now);
+  ASSERT_EQ(m.size(), 1u);
+  EXPECT_EQ(m[0].score, (JUMP_SLACK + 1) * 4);
+  EXPECT_EQ(b.size(), 3u);
+
+  shell_jumps = &a;
+  Process z(0, 0);
+  char *argv[] = {(char *) "z", (char *) "src"};
+  for (char *arg : argv) z.add_token(arg);
+  EXPECT_EQ(find_builtin("z")(&z, STDOUT_FILENO, STDERR_FILENO), 0);
+  char now_cwd[PATH_MAX];
+  ASSERT_NE(getcwd(now_cwd, sizeof(now_cwd)), nullptr);
+  EXPECT_EQ(now_cwd, src);
+  EXPECT_STREQ(getenv("OLDPWD"), cwd);
+
+  Process cd(0, 0);
+  char *back[] = {(char *) "cd", (char *) "-"};
+  for (char *arg : back) cd.add_token(arg);
+  int out[2];
+  ASSERT_EQ(pipe(out), 0);
+  EXPECT_EQ(find_builtin("cd")(&cd, out[1], STDERR_FILENO), 0);
+  char buf[PATH_MAX + 1];
+  ssize_t n = read(out[0], buf, sizeof(buf));
+  EXPECT_EQ(string(buf, n > 0 ? n : 0), string(cwd) + "\n");
+  close(out[0]);
+  close(out[1]);
+  ASSERT_NE(getcwd(now_cwd, sizeof(now_cwd)), nullptr);
+  EXPECT_STREQ(now_cwd, cwd);
+  EXPECT_EQ(a.match({"src"}, now)[0].score, 12) << "the jump was recorded";
+  shell_jumps = nullptr;
+  ASSERT_EQ(chdir(cwd), 0);
+
+  rmdir(src.c_str());
+  rmdir(proj.c_str());
+  rmdir(docs.c_str());
+  remove(path);
+}
+
+// the path index follows its directories and resolves what execvp would
+TEST(ShellTest, PathIndex) {
+  char dir[PATH_MAX];
+  ASSERT_NE(getcwd(dir, sizeof(dir) - 32), nullptr);
+  strcat(dir, "/path_index_test");
+  mkdir(dir, 0755);
+  auto make_tool = [&](const char *name, mode_t mode) {
+    string file = string(dir) + "/" + name;
+    write_line(file, "#!/bin/sh\necho tool\n");
+    chmod(file.c_str(), mode);
+  };
+  make_tool("tsh-tool-a", 0755);
+  make_tool("tsh-tool-b", 0755);
+  make_tool("tsh-tool-data", 0644);
+  string late = string(dir) + "_late";  // on PATH before it exists
+  rmdir(late.c_str());
+  string old_path = getenv("PATH");
+  setenv("PATH", (string(dir) + ":" + late + ":" + old_path).c_str(), 1);
+  path_index_start(builtin_names());
+
+  char resolved[PATH_MAX];
+  auto wait_for = [&](const char *name, bool present) {
+    for (int k = 0; k < 300; k++) {
+      if (path_resolve(name, resolved, sizeof(resolved)) == present) return true;
+      usleep(10000);
+    }
+    return false;
+  };
+  ASSERT_TRUE(wait_for("tsh-tool-a", true));
+  EXPECT_EQ(string(resolved), string(dir) + "/tsh-tool-a");
+  EXPECT_FALSE(path_resolve("tsh-tool-data", resolved, sizeof(resolved)))
+      << "not executable";
+  vector<string> names;
+  EXPECT_EQ(path_complete("tsh-tool-", 9, names, 10), 2u);
+  EXPECT_EQ(names, (vector<string>{"tsh-tool-a", "tsh-tool-b"}));
+
+  make_tool("tsh-tool-c", 0755);
+  EXPECT_TRUE(wait_for("tsh-tool-c", true)) << "a new file is noticed";
+  remove((string(dir) + "/tsh-tool-b").c_str());
+  EXPECT_TRUE(wait_for("tsh-tool-b", false)) << "and a removed one";
+  mkdir(late.c_str(), 0755);
+  write_line(late + "/tsh-tool-late", "#!/bin/sh\n");
+  chmod((late + "/tsh-tool-late").c_str(), 0755);
+  EXPECT_TRUE(wait_for("tsh-tool-late", true)) << "so is a directory made later";
+
+  uint64_t resolved_before = stats.path_resolved;
+  tsh::Result r = tsh::Pipeline{{"tsh-tool-a"}}.run();
+  EXPECT_EQ(r.out, "tool\n");
+  EXPECT_EQ(stats.path_resolved - resolved_before, 1u);
+
+  // a command that is not found is caught before forking, with suggestions
+  names.clear();
+  ASSERT_GE(path_suggest("histroy", names, 3), 1u);
+  EXPECT_EQ(names[0], "history") << "builtins too; a swap is one edit";
+  uint64_t forks = stats.forks;
+  r = tsh::Pipeline{{"tsh-tol-a"}}.run();
+  EXPECT_EQ(r.err, "tsh: command not found: tsh-tol-a\n"
+                   "tsh: did you mean: tsh-tool-a tsh-tool-c?\n");
+  EXPECT_EQ(r.exit_status(), EXIT_FAILURE);
+  EXPECT_EQ(stats.forks, forks);
+  r = tsh::Pipeline{{"tsh-tool-q"}, {"cat"}}.run();
+  EXPECT_EQ(r.err, "tsh: command not found: tsh-tool-q\n"
+                   "tsh: did you mean: tsh-tool-a tsh-tool-c?\n")
+      << "said once, by the parent";
+  EXPECT_EQ(r.status, (vector<int>{EXIT_FAILURE, 0}));
+
+  // Tab completes command words
+  int in[2], out[2];
+  ASSERT_EQ(pipe(in), 0);
+  ASSERT_EQ(pipe(out), 0);
+  LineEditor editor(in[0], out[1]);
+  const char keys[] = "tsh-tool-\t\tc\t-x\r";  // bell, list, complete
+  ASSERT_EQ(write(in[1], keys, sizeof(keys) - 1), (ssize_t) sizeof(keys) - 1);
+  char *line = editor.read_line("$ ");
+  ASSERT_NE(line, nullptr);
+  EXPECT_STREQ(line, "tsh-tool-c -x\n");
+  free(line);
+  for (int fd : {in[0], in[1], out[0], out[1]}) close(fd);
+
+  path_index_stop();
+  setenv("PATH", old_path.c_str(), 1);
+  for (const char *name : {"tsh-tool-a", "tsh-tool-c", "tsh-tool-data"})
+    remove((string(dir) + "/" + name).c_str());
+  rmdir(dir);
+  remove((late + "/tsh-tool-late").c_str());
+  rmdir(late.c_str());
+}
+
+// filenames complete on the worker; the editor shows them when they land
+TEST(ShellTest, FileComplete) {
+  mkdir("fc_test", 0755);
+  mkdir("fc_test/alphabet", 0755);
+  write_line("fc_test/alpha.txt", "");
+  write_line("fc_test/beta", "");
+
+  uint64_t id = file_complete_start("fc_test", "al");
+  file_complete_cancel();
+  FileMatches m;
+  EXPECT_FALSE(file_complete_poll(id, m)) << "a cancelled completion is gone";
+
+  int in[2], out[2];
+  ASSERT_EQ(pipe(in), 0);
+  ASSERT_EQ(pipe(out), 0);
+  LineEditor editor(in[0], out[1]);
+  char *line = nullptr;
+  thread reader([&] { line = editor.read_line("$ "); });
+  auto key = [&](const char *k) {
+    if (*k && write(in[1], k, strlen(k)) < 0) return string();
+    char buf[512];
+    ssize_t n = read(out[0], buf, sizeof(buf));
+    return string(buf, n > 0 ? n : 0);
+  };
+  key("");
+  EXPECT_EQ(key("ls fc_test/al"), "ls fc_test/al");
+  EXPECT_EQ(key("\t"), "pha") << "extended as far as the names agree";
+  EXPECT_EQ(key("\t"), "\a");
+  string listed = key("\t");
+  EXPECT_NE(listed.find("alpha.txt  alphabet/\r\n"), string::npos) << listed;
+  EXPECT_EQ(key("b"), "b");
+  EXPECT_EQ(key("\t"), "et/");
+  EXPECT_EQ(key("\r"), "\r\n");
+  reader.join();
+  ASSERT_NE(line, nullptr);
+  EXPECT_STREQ(line, "ls fc_test/alphabet/\n");
+  free(line);
+  for (int fd : {in[0], in[1], out[0], out[1]}) close(fd);
+  file_complete_stop();
+
+  remove("fc_test/alpha.txt");
+  remove("fc_test/beta");
+  rmdir("fc_test/alphabet");
+  rmdir("fc_test");
+}
+
+// slow segments come from the workers; the prompt never waits for them
+TEST(ShellTest, PromptSegments) {
+  PromptEngine plain(nullptr);
+  EXPECT_EQ(plain.text(), "$ ");
+  EXPECT_EQ(plain.fd(), -1) << "no workers without background segments";
+
+  PromptEngine sync("{red}{status}{reset}{duration} {nope}$ ");
+  sync.finished(2, 1500000000);
+  EXPECT_EQ(sync.text(), "\x1b[31m2\x1b[0m1.5s {nope}$ ");
+  sync.finished(0, 1000);
+  EXPECT_EQ(sync.text(), "\x1b[31m\x1b[0m {nope}$ ");
+
+  char cwd[PATH_MAX];
+  ASSERT_NE(getcwd(cwd, sizeof(cwd)), nullptr);
+  // through the executor: system() would race the reaper left enabled
+  auto sh = [](const char *cmd) {
+    return tsh::Pipeline{{"sh", "-c", cmd}}.run().ok();
+  };
+  ASSERT_TRUE(sh("rm -rf prompt_git_test && mkdir prompt_git_test && "
+                 "git -C prompt_git_test init -q -b trunk"));
+  ASSERT_EQ(chdir("prompt_git_test"), 0);
+  {
+    PromptEngine git("[{git}]$ ");
+    auto refreshed = [&] {
+      git.begin();
+      struct pollfd pfd = {git.fd(), POLLIN, 0};
+      bool ready = poll(&pfd, 1, 5000) == 1;
+      git.drain();
+      return ready;
+    };
+    EXPECT_EQ(git.text(), "[]$ ") << "nothing cached yet";
+    ASSERT_TRUE(refreshed());
+    EXPECT_EQ(git.text(), "[trunk]$ ");
+    write_line("f", "x");
+    ASSERT_TRUE(sh("git add f"));
+    ASSERT_TRUE(refreshed());
+    EXPECT_EQ(git.text(), "[trunk*]$ ");
+  }
+  ASSERT_EQ(chdir(cwd), 0);
+  ASSERT_TRUE(sh("rm -rf prompt_git_test"));
+
+  // colours in the prompt take no columns
+  int in[2], out[2];
+  ASSERT_EQ(pipe(in), 0);
+  ASSERT_EQ(pipe(out), 0);
+  LineEditor editor(in[0], out[1]);
+  char *line = nullptr;
+  thread reader([&] { line = editor.read_line("\x1b[32mok\x1b[0m> "); });
+  auto key = [&](const char *k) {
+    if (*k && write(in[1], k, strlen(k)) < 0) return string();
+    char buf[256];
+    ssize_t n = read(out[0], buf, sizeof(buf));
+    return string(buf, n > 0 ? n : 0);
+  };
+  EXPECT_EQ(key(""), "\r\x1b[0m\x1b[32mok\x1b[0m> \x1b[K");
+  EXPECT_EQ(key("ab"), "ab");
+  EXPECT_EQ(key("\x01"), "\b\b");
+  EXPECT_EQ(key("\r"), "\r\n");
+  reader.join();
+  ASSERT_NE(line, nullptr);
+  EXPECT_STREQ(line, "ab\n");
+  free(line);
+  for (int fd : {in[0], in[1], out[0], out[1]}) close(fd);
+}
+
+// builtins resolve by name; everything else is left to execvp
+TEST(ShellTest, Builtins) {
+  EXPECT_NE(find_builtin("trace"), nullptr);
+  EXPECT_EQ(find_builtin("ls"), nullptr);
+
+  tsh::Result r = tsh::Pipeline{{"trace"}, {"tr", "a-z", "A-Z"}}.run();
+  EXPECT_EQ(r.out, "TRACE: OFF\n") << "a piped builtin feeds the next stage";
+
+  // even in the shell, a piped cd is a subshell's
+  char cwd[PATH_MAX], after[PATH_MAX];
+  ASSERT_NE(getcwd(cwd, sizeof(cwd)), nullptr);
+  CommandLine cmdline;
+  ExecContext shell;
+  shell.shell_state = true;
+  char *line = strdup("cd / | cat");
+  parse_input(line, cmdline);
+  run_commands(cmdline, &shell);
+  cleanup(cmdline, line);
+  ASSERT_NE(getcwd(after, sizeof(after)), nullptr);
+  EXPECT_STREQ(after, cwd);
+
+  // more than a pipe holds: the reader has to be running while it writes
+  const char *path = "builtin_pipe_test";
+  remove(path);
+  History h;
+  ASSERT_TRUE(h.open(path));
+  char entry[64];
+  for (int k = 0; k < 5000; k++) {
+    int n = snprintf(entry, sizeof(entry), "echo %040d", k);
+    ASSERT_TRUE(h.add(entry, n));
+  }
+  shell_history = &h;
+  r = tsh::Pipeline{{"history", "5000"}, {"wc", "-l"}}.run();
+  shell_history = nullptr;
+  EXPECT_EQ(r.out, "5000\n");
+  remove(path);
+}
+
+// the executor's counters should follow what it ran
+TEST(ShellTest, Stats) {
+  uint64_t forks = stats.forks, execs = stats.execs;
+  uint64_t failures = stats.exec_failures;
+
+  tsh::Pipeline{{"true"}, {"true"}}.run();
+  tsh::Pipeline{{"/nonexistent/cmd"}}.run();
+
+  EXPECT_EQ(stats.forks - forks, 3u);
+  EXPECT_EQ(stats.execs - execs, 2u);
+  EXPECT_EQ(stats.exec_failures - failures, 1u);
+}
+
+// percentiles should be within one sub-bucket (1/16) of the exact value
+TEST(ShellTest, LatencyHistogram) {
+  LatencyHistogram h;
+  for (uint64_t us = 1; us <= 1000; us++) h.record(us * 1000);
+
+  EXPECT_EQ(h.count(), 1000u);
+  EXPECT_EQ(h.max(), 1000000u);
+  EXPECT_NEAR(h.percentile(0.5), 500000.0, 500000.0 / 16);
+  EXPECT_NEAR(h.percentile(0.99), 990000.0, 990000.0 / 16);
+  EXPECT_LE(h.percentile(0.999), h.max());
+
+  // a busy command keeps its row however many others come and go
+  for (int k = 0; k < 100; k++) latency_fork_exec("tsh-busy", 1000);
+  for (int k = 0; k < 4 * LATENCY_MAX_COMMANDS; k++)
+    latency_fork_exec(("tsh-once-" + to_string(k)).c_str(), 1000);
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  latency_print(fds[1], true);
+  close(fds[1]);
+  string json;
+  char buf[4096];
+  for (ssize_t n; (n = read(fds[0], buf, sizeof(buf))) > 0;) json.append(buf, n);
+  close(fds[0]);
+  EXPECT_NE(json.find("\"tsh-busy fork->exec\":{\"count\":100,"), string::npos);
+}
+
+// every line and every stage should leave a folded stack behind
+TEST(ShellTest, Profile) {
+  const string script = "profile_test.tsh", folded = "profile_test.folded";
+  write_line(script, "true | true\n:\n");
+
+  EXPECT_EQ(profile_script(script.c_str(), folded.c_str()), 0);
+
+  ifstream in(folded);
+  string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  EXPECT_NE(text.find("profile_test.tsh:1;true;[tsh spawn] "), string::npos);
+  EXPECT_NE(text.find("profile_test.tsh:2;[builtin :] "), string::npos);
+  remove(script.c_str());
+  remove(folded.c_str());
+}
+
+// a replayed session should exit as recorded and restore its environment
+TEST(ShellTest, RecordReplay) {
+  const char *log = "record_test.rec";
+  ASSERT_TRUE(record_open(log));
+  record_input("true\n");
+  record_status(0);
+  setenv("TSH_RECORD_TEST", "1", 1);
+  record_input("false\n");
+  record_status(1);
+  record_close();
+  unsetenv("TSH_RECORD_TEST");
+
+  EXPECT_EQ(replay_session(log, true), 0);
+  ASSERT_NE(getenv("TSH_RECORD_TEST"), nullptr);
+  EXPECT_STREQ(getenv("TSH_RECORD_TEST"), "1");
+  unsetenv("TSH_RECORD_TEST");
+  remove(log);
+}
+
+// every audited command is either written or counted as dropped
+TEST(ShellTest, AuditLog) {
+  const char *log = "audit_test.log";
+  remove(log);
+  uint64_t written = stats.audit_records, dropped = stats.audit_dropped;
+  ASSERT_TRUE(audit_open(log));
+
+  tsh::Pipeline{{"true"}, {"false"}}.run();
+  CommandLine cmdline;
+  char *quit = strdup("quit");
+  parse_input(quit, cmdline);
+  EXPECT_TRUE(run_commands(cmdline));
+  cleanup(cmdline, quit);
+  char arg0[] = "producer", *argv[] = {arg0, nullptr};
+  vector<thread> producers;
+  for (int t = 0; t < 4; t++) {
+    producers.emplace_back([&argv] {
+      for (int i = 0; i < 5000; i++) audit_command(argv, 1, 0, 0, 0);
+    });
+  }
+  for (thread &t : producers) t.join();
+  audit_close();
+
+  ifstream in(log);
+  string line, first;
+  size_t lines = 0, quits = 0;
+  while (getline(in, line)) {
+    if (!lines++) first = line;
+    quits += line.find("\"argv\":\"quit\"") != string::npos;
+  }
+  EXPECT_EQ(lines, stats.audit_records - written);
+  EXPECT_EQ(lines + stats.audit_dropped - dropped, 20003u);
+  EXPECT_EQ(quits, 1u);
+  EXPECT_NE(first.find("\"argv\":\"true\""), string::npos);
+  remove(log);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();